@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/*
+ * Benchmark stamp_corrector over logs made by gen_log with different
+ * profiles, and report the throughput and the peak RSS of each.
+ */
+
+#define MAX_ARGS 64
+#define MAX_EXTRA_ARGS 16
+
+struct profile_t {
+	const char *name;
+	const char *args[8];
+};
+
+static const struct profile_t profiles[] = {
+	{ "typical", { "-l", "uniform:16:512", NULL } },
+	{ "short", { "-l", "fixed:32", NULL } },
+	{ "long", { "-l", "uniform:2048:8192", NULL } },
+	{ "escapes", { "-e", "100", NULL } },
+	{ "corrupt", { "-c", "10", "-u", "10", NULL } },
+	{ "msgstamps", { "-p", NULL } },
+};
+
+#define NR_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+static const char *corrector_path = "./stamp_corrector";
+static const char *generator_path = "./gen_log";
+static const char *extra_args[MAX_EXTRA_ARGS];
+static int nr_extra_args;
+
+static uint64_t get_monotonic_timestamp(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+/*
+ * Run the command with its output discarded. The peak RSS in KiB is stored
+ * if rss is not NULL. The exit status is returned, or -1 if it cannot run.
+ */
+static int run(char **argv, long *rss)
+{
+	struct rusage usage;
+	int status, fd;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		printf("Cannot fork (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		printf("Cannot wait for %s (%s)\n", argv[0], strerror(errno));
+		return -1;
+	}
+	if (rss)
+		*rss = usage.ru_maxrss;
+	if (!WIFEXITED(status)) {
+		printf("%s was killed by signal %d\n", argv[0], WTERMSIG(status));
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+static int generate(const struct profile_t *profile, const char *size,
+		    const char *data_path, const char *stamp_path)
+{
+	char *argv[MAX_ARGS];
+	int argc = 0, i;
+
+	argv[argc++] = (char *) generator_path;
+	argv[argc++] = "-s";
+	argv[argc++] = (char *) size;
+	for (i = 0; profile->args[i]; ++i)
+		argv[argc++] = (char *) profile->args[i];
+	argv[argc++] = (char *) data_path;
+	argv[argc++] = (char *) stamp_path;
+	argv[argc] = NULL;
+	return run(argv, NULL);
+}
+
+static int bench(const struct profile_t *profile, const char *dir, const char *size, int runs)
+{
+	char data_path[FILENAME_MAX], stamp_path[FILENAME_MAX], out_path[FILENAME_MAX];
+	char *argv[MAX_ARGS];
+	uint64_t start, elapsed, best = UINT64_MAX, total = 0;
+	long rss, peak_rss = 0;
+	struct stat st;
+	int argc = 0, i, ret;
+
+	snprintf(data_path, sizeof(data_path), "%s/bench-%s.dlog", dir, profile->name);
+	snprintf(stamp_path, sizeof(stamp_path), "%s/bench-%s.tlog", dir, profile->name);
+	snprintf(out_path, sizeof(out_path), "%s/bench-%s.out", dir, profile->name);
+
+	ret = generate(profile, size, data_path, stamp_path);
+	if (ret != 0 || stat(data_path, &st) < 0) {
+		printf("Failed to generate the logs of profile %s\n", profile->name);
+		return -1;
+	}
+
+	argv[argc++] = (char *) corrector_path;
+	for (i = 0; i < nr_extra_args; ++i)
+		argv[argc++] = (char *) extra_args[i];
+	argv[argc++] = data_path;
+	argv[argc++] = stamp_path;
+	argv[argc++] = out_path;
+	argv[argc] = NULL;
+
+	for (i = 0; i < runs; ++i) {
+		start = get_monotonic_timestamp();
+		ret = run(argv, &rss);
+		elapsed = get_monotonic_timestamp() - start;
+		if (ret != 0) {
+			printf("%s failed with %d on profile %s\n", corrector_path, ret, profile->name);
+			return -1;
+		}
+		if (elapsed < best)
+			best = elapsed;
+		total += elapsed;
+		if (rss > peak_rss)
+			peak_rss = rss;
+	}
+
+	printf("%-12s %10.1f %10.3f %10.3f %10.1f %12.1f\n", profile->name, st.st_size / 1e6,
+	       best / 1e9, total / 1e9 / runs, st.st_size / (best / 1e9) / 1e6, peak_rss / 1024.0);
+	fflush(stdout);
+
+	unlink(data_path);
+	unlink(stamp_path);
+	unlink(out_path);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	int i;
+
+	printf("Usage: %s [OPTIONS] [PROFILE...]\n"
+	       "Options:\n"
+	       "  -c PATH    stamp_corrector to benchmark (default: ./stamp_corrector)\n"
+	       "  -g PATH    gen_log to generate the logs (default: ./gen_log)\n"
+	       "  -d DIR     directory for the generated logs (default: /tmp)\n"
+	       "  -s MIB     size of the data log of each profile (default: 256)\n"
+	       "  -n RUNS    runs per profile, the best and the mean are reported (default: 3)\n"
+	       "  -o OPTION  pass OPTION to stamp_corrector, can be repeated\n"
+	       "Profiles:", name);
+	for (i = 0; i < NR_PROFILES; ++i)
+		printf(" %s", profiles[i].name);
+	printf(" (default: all)\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = "/tmp", *size = "256";
+	int runs = 3, failed = 0, opt, i, j;
+
+	while ((opt = getopt(argc, argv, "c:g:d:s:n:o:")) != -1) {
+		switch (opt) {
+		case 'c':
+			corrector_path = optarg;
+			break;
+		case 'g':
+			generator_path = optarg;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			size = optarg;
+			break;
+		case 'n':
+			runs = strtoul(optarg, NULL, 10);
+			if (runs <= 0)
+				runs = 1;
+			break;
+		case 'o':
+			if (nr_extra_args == MAX_EXTRA_ARGS) {
+				printf("Too many options for stamp_corrector\n");
+				return -1;
+			}
+			extra_args[nr_extra_args++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	printf("%-12s %10s %10s %10s %10s %12s\n",
+	       "profile", "size_MB", "best_s", "mean_s", "MB/s", "peak_rss_MiB");
+	if (optind == argc) {
+		for (i = 0; i < NR_PROFILES; ++i)
+			failed |= bench(&profiles[i], dir, size, runs) < 0;
+		return failed;
+	}
+	for (i = optind; i < argc; ++i) {
+		for (j = 0; j < NR_PROFILES; ++j)
+			if (!strcmp(argv[i], profiles[j].name))
+				break;
+		if (j == NR_PROFILES) {
+			printf("Unknown profile %s\n", argv[i]);
+			return -1;
+		}
+		failed |= bench(&profiles[j], dir, size, runs) < 0;
+	}
+	return failed;
+}
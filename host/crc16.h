@@ -0,0 +1,169 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * CRC-16/X.25 (reflected 0x1021, the one of HDLC) by slicing-by-8, and by
+ * folding with carry-less multiplication on CPUs which have it. The engine
+ * is selected at startup. The crc16_update functions take and return the
+ * raw register, without the initial value and the final xor.
+ */
+
+#define CRC16_POLY		0x11021
+#define CRC16_POLY_REFLECTED	0x8408
+// Folding is only worth it from about this length
+#define CRC16_CLMUL_MIN		64
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC16_HAVE_CLMUL
+#define CRC16_CLMUL_TARGET __attribute__((target("pclmul,sse2")))
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL (1 << 4)
+#endif
+#define CRC16_HAVE_CLMUL
+#ifdef __clang__
+#define CRC16_CLMUL_TARGET __attribute__((target("aes")))
+#else
+#define CRC16_CLMUL_TARGET __attribute__((target("+crypto")))
+#endif
+#endif
+
+static uint16_t crc16_table[8][256];
+// x^191 and x^127 mod P, to fold the high and the low halves of 128 bits
+static uint64_t crc16_fold_high, crc16_fold_low;
+static int crc16_has_clmul;
+
+static inline uint16_t crc16_update_bytewise(uint16_t crc, const uint8_t *data, size_t len)
+{
+	while (len--)
+		crc = crc16_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static inline uint16_t crc16_update_slice8(uint16_t crc, const uint8_t *data, size_t len)
+{
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		memcpy(&v, data, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		v = __builtin_bswap64(v);
+#endif
+		v ^= crc;
+		crc = crc16_table[7][v & 0xff] ^ crc16_table[6][(v >> 8) & 0xff] ^
+		      crc16_table[5][(v >> 16) & 0xff] ^ crc16_table[4][(v >> 24) & 0xff] ^
+		      crc16_table[3][(v >> 32) & 0xff] ^ crc16_table[2][(v >> 40) & 0xff] ^
+		      crc16_table[1][(v >> 48) & 0xff] ^ crc16_table[0][v >> 56];
+	}
+	return crc16_update_bytewise(crc, data, len);
+}
+
+#ifdef CRC16_HAVE_CLMUL
+/*
+ * Fold 16 bytes at a time into a 128-bit remainder, which is congruent to
+ * the data so far, then finish it and the tail with the tables. The bytes
+ * are loaded as they are, so the polynomials are bit-reflected, and the
+ * product of two of them comes out one bit short, which the constants make
+ * up for. len must be at least 16.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+static CRC16_CLMUL_TARGET uint16_t crc16_update_clmul(uint16_t crc, const uint8_t *data, size_t len)
+{
+	__m128i k = _mm_set_epi64x(crc16_fold_low, crc16_fold_high);
+	__m128i x;
+	uint8_t rem[16];
+
+	x = _mm_xor_si128(_mm_loadu_si128((const __m128i *) data), _mm_cvtsi32_si128(crc));
+	for (data += 16, len -= 16; len >= 16; data += 16, len -= 16) {
+		x = _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+		x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *) data));
+	}
+	_mm_storeu_si128((__m128i *) rem, x);
+	crc = crc16_update_slice8(0, rem, sizeof(rem));
+	return crc16_update_slice8(crc, data, len);
+}
+#else
+static CRC16_CLMUL_TARGET uint16_t crc16_update_clmul(uint16_t crc, const uint8_t *data, size_t len)
+{
+	uint64x2_t x, high, low;
+	uint8_t rem[16];
+
+	x = veorq_u64(vreinterpretq_u64_u8(vld1q_u8(data)), vsetq_lane_u64(crc, vdupq_n_u64(0), 0));
+	for (data += 16, len -= 16; len >= 16; data += 16, len -= 16) {
+		high = vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(x, 0),
+							(poly64_t) crc16_fold_high));
+		low = vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(x, 1),
+						       (poly64_t) crc16_fold_low));
+		x = veorq_u64(veorq_u64(high, low), vreinterpretq_u64_u8(vld1q_u8(data)));
+	}
+	vst1q_u8(rem, vreinterpretq_u8_u64(x));
+	crc = crc16_update_slice8(0, rem, sizeof(rem));
+	return crc16_update_slice8(crc, data, len);
+}
+#endif
+#endif
+
+/*
+ * x^(n - 1) mod P as a bit-reflected 64-bit operand, in which bit i is the
+ * coefficient of x^(63 - i).
+ */
+static inline uint64_t crc16_fold_constant(unsigned int n)
+{
+	uint32_t r = 1;
+	uint64_t k = 0;
+	int i;
+
+	while (--n) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= CRC16_POLY;
+	}
+	for (i = 0; i < 16; ++i)
+		if (r & (1u << i))
+			k |= 1ull << (63 - i);
+	return k;
+}
+
+__attribute__((constructor)) static void crc16_init(void)
+{
+	uint16_t c;
+	int i, j;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (j = 0; j < 8; ++j)
+			c = c & 1 ? (c >> 1) ^ CRC16_POLY_REFLECTED : c >> 1;
+		crc16_table[0][i] = c;
+	}
+	for (i = 0; i < 256; ++i)
+		for (j = 1; j < 8; ++j)
+			crc16_table[j][i] = (crc16_table[j - 1][i] >> 8) ^
+					    crc16_table[0][crc16_table[j - 1][i] & 0xff];
+
+	crc16_fold_high = crc16_fold_constant(192);
+	crc16_fold_low = crc16_fold_constant(128);
+#if defined(__x86_64__) || defined(__i386__)
+	crc16_has_clmul = __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+	crc16_has_clmul = !!(getauxval(AT_HWCAP) & HWCAP_PMULL);
+#endif
+}
+
+static inline uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len)
+{
+#ifdef CRC16_HAVE_CLMUL
+	if (len >= CRC16_CLMUL_MIN && crc16_has_clmul)
+		return crc16_update_clmul(crc, data, len);
+#endif
+	return crc16_update_slice8(crc, data, len);
+}
+
+static inline uint16_t crc16_x25(const uint8_t *data, size_t len)
+{
+	return crc16_update(0xffff, data, len) ^ 0xffff;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "hdlc.h"
+
+/*
+ * A log packet of diag, which may follow the 8-byte header of a multi-SIM
+ * device: the command, a byte, two lengths, the log code and the timestamp,
+ * which counts 1/52428800 s since the GPS epoch.
+ */
+#define DIAG_LOG_CMD		0x10
+#define DIAG_LOG_CODE_OFFSET	6
+#define DIAG_LOG_STAMP_OFFSET	8
+#define DIAG_LOG_HEADER_LEN	16
+
+#define DIAG_STAMP_PER_SECOND	52428800
+// The GPS epoch in POSIX seconds
+#define DIAG_GPS_EPOCH		315936000
+// The log packet header is within that many escaped bytes of a frame
+#define DIAG_LOG_HEADER_SCAN_LEN	(2 * (8 + DIAG_LOG_HEADER_LEN))
+
+/*
+ * The offset of the log packet in a decoded frame, or -1 if it is not one.
+ * Whether the frame is long enough for the header is up to the caller.
+ */
+static inline ssize_t diag_log_offset(const uint8_t *frame, size_t len)
+{
+	uint64_t start_bytes;
+	size_t offset = 0;
+
+	if (len >= 8) {
+		memcpy(&start_bytes, frame, sizeof(start_bytes));
+		if (start_bytes == 0x200000198 || start_bytes == 0x100000198)
+			offset = 8;
+	}
+	if (len < offset + 2 || frame[offset] != DIAG_LOG_CMD)
+		return -1;
+	return offset;
+}
+
+static inline uint64_t diag_log_stamp(const uint8_t *packet)
+{
+	uint64_t stamp;
+
+	memcpy(&stamp, packet + DIAG_LOG_STAMP_OFFSET, sizeof(stamp));
+	return stamp;
+}
+
+static inline uint16_t diag_log_code(const uint8_t *packet)
+{
+	uint16_t code;
+
+	memcpy(&code, packet + DIAG_LOG_CODE_OFFSET, sizeof(code));
+	return code;
+}
+
+/*
+ * The stamp of an encoded frame, without its delimiter, or UINT64_MAX if it
+ * is not a log packet. Only the start of the frame is decoded.
+ */
+static inline uint64_t diag_frame_stamp(const uint8_t *in, const uint8_t *end)
+{
+	uint8_t packet[DIAG_LOG_HEADER_SCAN_LEN];
+	ssize_t offset;
+	size_t len;
+
+	if (end - in > DIAG_LOG_HEADER_SCAN_LEN)
+		end = in + DIAG_LOG_HEADER_SCAN_LEN;
+	len = hdlc_unescape(in, end, packet) - packet;
+	offset = diag_log_offset(packet, len);
+	if (offset < 0 || len < offset + DIAG_LOG_HEADER_LEN)
+		return UINT64_MAX;
+	return diag_log_stamp(packet + offset);
+}
+
+static inline uint64_t diag_stamp_from_posix(uint64_t posix)
+{
+	uint64_t seconds = posix / 1000000000;
+	uint64_t remained = posix % 1000000000;
+	seconds -= DIAG_GPS_EPOCH;
+	remained *= DIAG_STAMP_PER_SECOND;
+	remained /= 1000000000;
+	return seconds * DIAG_STAMP_PER_SECOND + remained;
+}
+
+static inline uint64_t diag_stamp_to_posix(uint64_t stamp)
+{
+	return (stamp / DIAG_STAMP_PER_SECOND + DIAG_GPS_EPOCH) * 1000000000 +
+	       stamp % DIAG_STAMP_PER_SECOND * 1000000000 / DIAG_STAMP_PER_SECOND;
+}
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "diag_log.h"
+#include "stamp_index.h"
+
+/*
+ * Copy the frames of a time range out of a corrected log, with the index
+ * written by stamp_corrector -i. The blocks which may have such frames are
+ * found by binary search, so only they are read, however long the log is.
+ */
+
+#define READ_SIZE (1 << 20)
+
+static int index_fd;
+static struct stamp_index_header_t header;
+static uint64_t nr_entries;
+
+static uint64_t get_monotonic_timestamp(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+static int read_entry(uint64_t i, struct stamp_index_entry_t *entry)
+{
+	off_t pos = sizeof(header) + i * sizeof(*entry);
+
+	if (pread(index_fd, entry, sizeof(*entry), pos) != sizeof(*entry)) {
+		printf("Failed to read from index\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int open_index(const char *path, uint64_t log_size)
+{
+	struct stamp_index_entry_t last;
+	struct stat st;
+
+	index_fd = open(path, O_RDONLY);
+	if (index_fd < 0) {
+		printf("Cannot open index %s for reading\n", path);
+		return -2;
+	}
+	if (fstat(index_fd, &st) < 0 || pread(index_fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    header.magic != STAMP_INDEX_MAGIC || header.version != STAMP_INDEX_VERSION) {
+		printf("%s is not an index of stamp_corrector\n", path);
+		return -4;
+	}
+	nr_entries = (st.st_size - sizeof(header)) / sizeof(struct stamp_index_entry_t);
+	if (nr_entries > 0 && read_entry(nr_entries - 1, &last) < 0)
+		return -4;
+	if (nr_entries > 0 && last.offset >= log_size) {
+		printf("Index %s does not match the log\n", path);
+		return -4;
+	}
+	return 0;
+}
+
+// The first entry whose stamp (max_before or min_after) is above stamp, or nr_entries
+static int64_t search_index(uint64_t stamp, int min_after)
+{
+	struct stamp_index_entry_t entry;
+	uint64_t lo = 0, hi = nr_entries, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (read_entry(mid, &entry) < 0)
+			return -1;
+		if ((min_after ? entry.min_after : entry.max_before) > stamp)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/*
+ * Copy the frames from start to end of the log with stamps from t0 to t1,
+ * or all of them if all is set. start is always at a frame, and end either
+ * at one or at the end of the log.
+ */
+static int copy_frames(FILE *log_fp, FILE *out_fp, uint64_t start, uint64_t end,
+		       uint64_t t0, uint64_t t1, int all, uint64_t *nr_copied, uint64_t *copied)
+{
+	uint8_t *buf = NULL, *in, *delim, *next;
+	size_t size = READ_SIZE, len = 0, want;
+	uint64_t pos = start, stamp;
+	int ret = -1;
+
+	buf = malloc(size);
+	if (!buf) {
+		printf("Cannot allocate memory for reading log\n");
+		return -5;
+	}
+	if (fseeko(log_fp, start, SEEK_SET) < 0)
+		goto read_fail;
+
+	while (pos < end) {
+		// A frame longer than the buffer makes it grow
+		if (len == size) {
+			size *= 2;
+			next = realloc(buf, size);
+			if (!next) {
+				printf("Cannot allocate memory for reading log\n");
+				ret = -5;
+				goto out;
+			}
+			buf = next;
+		}
+		want = size - len < end - pos ? size - len : end - pos;
+		if (fread(buf + len, 1, want, log_fp) != want)
+			goto read_fail;
+		pos += want;
+		len += want;
+
+		if (all) {
+			if (fwrite(buf, 1, len, out_fp) != len)
+				goto write_fail;
+			*copied += len;
+			len = 0;
+			continue;
+		}
+		for (in = buf; (delim = memchr(in, 0x7e, buf + len - in)) != NULL; in = delim + 1) {
+			stamp = diag_frame_stamp(in, delim);
+			if (stamp < t0 || stamp > t1)
+				continue;
+			if (fwrite(in, 1, delim + 1 - in, out_fp) != delim + 1 - in)
+				goto write_fail;
+			++*nr_copied;
+			*copied += delim + 1 - in;
+		}
+		len = buf + len - in;
+		memmove(buf, in, len);
+	}
+	ret = 0;
+	goto out;
+
+read_fail:
+	printf("Failed to read from log\n");
+	goto out;
+write_fail:
+	printf("Failed to write into output log\n");
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Parse POSIX seconds with up to 9 digits of fraction into a Qualcomm stamp,
+ * or a Qualcomm stamp as it is. 0 is returned if it is neither.
+ */
+static int parse_time(const char *s, int qualcomm, uint64_t *stamp)
+{
+	uint64_t ns = 0, scale = 100000000;
+	char *end;
+
+	*stamp = strtoull(s, &end, 10);
+	if (end == s)
+		return 0;
+	if (qualcomm)
+		return *end == '\0';
+	if (*end == '.')
+		for (++end; isdigit((unsigned char) *end); ++end, scale /= 10)
+			ns += (*end - '0') * scale;
+	if (*end != '\0' || *stamp < DIAG_GPS_EPOCH)
+		return 0;
+	*stamp = diag_stamp_from_posix(*stamp * 1000000000 + ns);
+	return 1;
+}
+
+static void print_stamp(const char *name, uint64_t stamp)
+{
+	uint64_t posix = diag_stamp_to_posix(stamp);
+
+	printf("%-12s %llu.%09llu (qualcomm %llu)\n", name, (unsigned long long) (posix / 1000000000),
+	       (unsigned long long) (posix % 1000000000), (unsigned long long) stamp);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-x INDEX] [-a] [-Q] [corrected log] [start] [end] [output log]\n"
+	       "       %s [-x INDEX] -l [corrected log]\n"
+	       "Copy the frames of a corrected log stamped from start to end, both included.\n"
+	       "  -x INDEX  index of the log (default: the log name followed by .idx)\n"
+	       "  -a        copy whole indexed blocks, without checking the frames\n"
+	       "  -Q        start and end are Qualcomm stamps instead of POSIX seconds\n"
+	       "  -l        show the stamps covered by the log\n",
+	       name, name);
+}
+
+int main(int argc, char **argv)
+{
+	char index_path[FILENAME_MAX];
+	const char *index_arg = NULL;
+	int all = 0, qualcomm = 0, list = 0, opt, ret;
+	uint64_t t0, t1, start = 0, end, nr_copied = 0, copied = 0, begin;
+	struct stamp_index_entry_t entry;
+	int64_t first, last;
+	FILE *log_fp, *out_fp;
+	struct stat st;
+
+	while ((opt = getopt(argc, argv, "x:aQl")) != -1) {
+		switch (opt) {
+		case 'x':
+			index_arg = optarg;
+			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'Q':
+			qualcomm = 1;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (argc - optind != (list ? 1 : 4)) {
+		usage(argv[0]);
+		return -1;
+	}
+	begin = get_monotonic_timestamp();
+
+	log_fp = fopen(argv[optind], "rb");
+	if (!log_fp || fstat(fileno(log_fp), &st) < 0) {
+		printf("Cannot open log %s for reading\n", argv[optind]);
+		return -2;
+	}
+	snprintf(index_path, sizeof(index_path), "%s.idx", argv[optind]);
+	ret = open_index(index_arg ? index_arg : index_path, st.st_size);
+	if (ret < 0)
+		return ret;
+
+	if (list) {
+		printf("%-12s %llu bytes\n", "log", (unsigned long long) st.st_size);
+		printf("%-12s %llu of %u bytes\n", "entries", (unsigned long long) nr_entries,
+		       header.granularity);
+		if (nr_entries > 0) {
+			print_stamp("earliest", header.min_stamp);
+			print_stamp("latest", header.max_stamp);
+		}
+		return 0;
+	}
+
+	if (!parse_time(argv[optind + 1], qualcomm, &t0) ||
+	    !parse_time(argv[optind + 2], qualcomm, &t1)) {
+		printf("Invalid time range %s to %s\n", argv[optind + 1], argv[optind + 2]);
+		return -1;
+	}
+
+	/*
+	 * From the last block after frames only stamped before t0, to the
+	 * first block followed by frames only stamped after t1.
+	 */
+	end = start;
+	if (t0 <= t1 && nr_entries > 0) {
+		first = search_index(t0 - (t0 > 0), 0);
+		last = search_index(t1, 1);
+		if (first < 0 || last < 0)
+			return -4;
+		if (first > 0 && read_entry(first - 1, &entry) == 0)
+			start = entry.offset;
+		end = st.st_size;
+		if (last < nr_entries && read_entry(last, &entry) == 0)
+			end = entry.offset;
+		if (end < start)
+			end = start;
+	}
+
+	out_fp = fopen(argv[optind + 3], "wb");
+	if (!out_fp) {
+		printf("Cannot open output log %s for writing\n", argv[optind + 3]);
+		return -2;
+	}
+	ret = copy_frames(log_fp, out_fp, start, end, t0, t1, all, &nr_copied, &copied);
+	if (fclose(out_fp) != 0 && ret == 0) {
+		printf("Failed to write into output log\n");
+		ret = -3;
+	}
+	if (ret < 0)
+		return ret;
+
+	if (all)
+		printf("Copied %llu bytes", (unsigned long long) copied);
+	else
+		printf("Copied %llu frames (%llu bytes)", (unsigned long long) nr_copied,
+		       (unsigned long long) copied);
+	printf(" from %llu bytes at %llu of %llu in %.3f ms\n", (unsigned long long) (end - start),
+	       (unsigned long long) start, (unsigned long long) st.st_size,
+	       (get_monotonic_timestamp() - begin) / 1e6);
+	return 0;
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "diag_log.h"
+#include "../jni/stamp.h"
+#include "rng.h"
+
+/*
+ * Generate a synthetic data log of HDLC frames and its stamp log, in the
+ * formats written by diag_logcat, to benchmark stamp_corrector. The output
+ * only depends on the options, so the same data can be generated anywhere.
+ */
+
+#define MAX_FRAME_LEN 8192
+// A log packet has the command, two lengths, the log code and the timestamp
+#define LOG_HEADER_LEN 16
+#define MSG_LEN 2048
+#define START_STAMP 1700000000000000000ull
+// The logs are assumed to come at 20 MB/s
+#define NS_PER_BYTE 50
+
+enum dist_type {
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_EXP,
+};
+
+struct dist_t {
+	int type;
+	double a, b;
+};
+
+static double rng_uniform(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int rng_percent(double percent)
+{
+	return rng_uniform() * 100 < percent;
+}
+
+static int parse_dist(const char *spec, struct dist_t *dist)
+{
+	if (sscanf(spec, "fixed:%lf", &dist->a) == 1)
+		dist->type = DIST_FIXED;
+	else if (sscanf(spec, "uniform:%lf:%lf", &dist->a, &dist->b) == 2 && dist->a <= dist->b)
+		dist->type = DIST_UNIFORM;
+	else if (sscanf(spec, "exp:%lf", &dist->a) == 1)
+		dist->type = DIST_EXP;
+	else
+		return -1;
+	return 0;
+}
+
+static size_t frame_length(const struct dist_t *dist)
+{
+	double len;
+
+	switch (dist->type) {
+	case DIST_FIXED:
+		len = dist->a;
+		break;
+	case DIST_UNIFORM:
+		len = dist->a + rng_uniform() * (dist->b - dist->a + 1);
+		break;
+	default:
+		len = LOG_HEADER_LEN - dist->a * log(1 - rng_uniform());
+		break;
+	}
+	if (len < LOG_HEADER_LEN)
+		return LOG_HEADER_LEN;
+	return len > MAX_FRAME_LEN ? MAX_FRAME_LEN : len;
+}
+
+/*
+ * Fill a frame of len bytes. With escapes per mille, each payload byte is
+ * 0x7e or 0x7d with that probability, and never otherwise.
+ */
+static void fill_frame(uint8_t *frame, size_t len, int unsupported, uint64_t stamp,
+		       double escapes)
+{
+	uint64_t qcom_stamp;
+	size_t i;
+
+	// The device clock runs 3 seconds behind, which is what gets corrected
+	qcom_stamp = diag_stamp_from_posix(stamp - 3000000000ull);
+	frame[0] = unsupported ? 0x4b : 0x10;
+	frame[1] = 0;
+	frame[2] = frame[4] = (len - 4) & 0xff;
+	frame[3] = frame[5] = (len - 4) >> 8;
+	frame[6] = 0xc0 + rng_next() % 16;
+	frame[7] = 0xb0 + rng_next() % 16;
+	memcpy(frame + 8, &qcom_stamp, sizeof(qcom_stamp));
+
+	for (i = LOG_HEADER_LEN; i < len; ++i) {
+		if (rng_uniform() * 1000 < escapes) {
+			frame[i] = rng_next() & 1 ? 0x7e : 0x7d;
+		} else {
+			do
+				frame[i] = rng_next();
+			while (frame[i] == 0x7e || frame[i] == 0x7d);
+		}
+	}
+}
+
+/*
+ * Flip a bit of an encoded frame without making another delimiter. If the
+ * flip makes 0x7e or 0x7d, bit 2 is flipped instead, which turns 0x7f into
+ * 0x7b and 0x7c into 0x78.
+ */
+static void corrupt_frame(char *start, char *end)
+{
+	char *p = start + rng_next() % (end - start - 1);
+
+	*p ^= 0x01;
+	if (*p == 0x7e || *p == 0x7d)
+		*p ^= 0x05;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [OPTIONS] [DATA LOG] [STAMP LOG]\n"
+	       "Options:\n"
+	       "  -s MIB       size of the data log (default: 64)\n"
+	       "  -l DIST      frame length in bytes, fixed:N, uniform:MIN:MAX or exp:MEAN\n"
+	       "               (default: uniform:16:512)\n"
+	       "  -e PERMILLE  share of payload bytes to be escaped (default: 8)\n"
+	       "  -c PERCENT   share of corrupted frames (default: 0)\n"
+	       "  -u PERCENT   share of unsupported frames (default: 0)\n"
+	       "  -r BYTES     bytes per read, i.e. per stamp record (default: 16384)\n"
+	       "  -p           write per-message stamps, as diag_logcat -p does\n"
+	       "  -S SEED      seed of the generator (default: 1)\n",
+	       name);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t frame[MAX_FRAME_LEN];
+	static char encoded[2 * MAX_FRAME_LEN + 5];
+	static struct stamp_msg_t msgs[65536];
+	struct dist_t dist = { DIST_UNIFORM, 16, 512 };
+	double escapes = 8, corrupted = 0, unsupported = 0;
+	uint64_t size = 64 << 20, offset = 0, read_start = 0, msg_start = 0, stamp, seed = 1;
+	size_t read_size = 16384, len;
+	struct stamp_log_t slog;
+	struct stamp_batch_t sbatch;
+	int message_stamps = 0, nr_msgs = 0, opt;
+	FILE *data_fp, *stamp_fp;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "s:l:e:c:u:r:pS:")) != -1) {
+		switch (opt) {
+		case 's':
+			size = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'l':
+			if (parse_dist(optarg, &dist) < 0) {
+				printf("Invalid frame length distribution %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'e':
+			escapes = strtod(optarg, NULL);
+			break;
+		case 'c':
+			corrupted = strtod(optarg, NULL);
+			break;
+		case 'u':
+			unsupported = strtod(optarg, NULL);
+			break;
+		case 'r':
+			read_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			message_stamps = 1;
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return -1;
+	}
+	// xorshift never leaves the zero state
+	rng_state = seed * 0x9e3779b97f4a7c15ull | 1;
+
+	data_fp = fopen(argv[optind], "wb");
+	if (!data_fp) {
+		printf("Cannot open data log %s for writing\n", argv[optind]);
+		return -2;
+	}
+	stamp_fp = fopen(argv[optind + 1], "wb");
+	if (!stamp_fp) {
+		printf("Cannot open stamp log %s for writing\n", argv[optind + 1]);
+		return -2;
+	}
+	if (message_stamps) {
+		slog.offset = STAMP_LOG_MAGIC_OFFSET;
+		slog.stamp = STAMP_LOG_MAGIC_V2;
+		fwrite(&slog, sizeof(slog), 1, stamp_fp);
+	}
+
+	while (offset < size) {
+		stamp = START_STAMP + offset * NS_PER_BYTE;
+		len = frame_length(&dist);
+		fill_frame(frame, len, rng_percent(unsupported), stamp, escapes);
+		end = hdlc_encode(frame, len, encoded);
+		if (rng_percent(corrupted))
+			corrupt_frame(encoded, end);
+		if (fwrite(encoded, 1, end - encoded, data_fp) != end - encoded) {
+			printf("Failed to write into data log\n");
+			return -3;
+		}
+		offset += end - encoded;
+
+		// A read ends after the frame which fills it, as a message does
+		if (offset - msg_start >= MSG_LEN || offset - read_start >= read_size ||
+		    offset >= size) {
+			msgs[nr_msgs].len = offset - msg_start;
+			msgs[nr_msgs].delta = (msg_start - read_start) * NS_PER_BYTE;
+			++nr_msgs;
+			msg_start = offset;
+		}
+		if (offset - read_start < read_size && offset < size &&
+		    nr_msgs < sizeof(msgs) / sizeof(msgs[0]))
+			continue;
+
+		if (message_stamps) {
+			sbatch.offset = read_start;
+			sbatch.stamp = START_STAMP + read_start * NS_PER_BYTE;
+			sbatch.nr_msgs = nr_msgs;
+			sbatch.reserved = 0;
+			fwrite(&sbatch, sizeof(sbatch), 1, stamp_fp);
+			fwrite(msgs, sizeof(msgs[0]), nr_msgs, stamp_fp);
+		} else {
+			slog.offset = offset;
+			slog.stamp = START_STAMP + offset * NS_PER_BYTE;
+			fwrite(&slog, sizeof(slog), 1, stamp_fp);
+		}
+		read_start = msg_start = offset;
+		nr_msgs = 0;
+	}
+
+	if (fclose(data_fp) != 0 || fclose(stamp_fp) != 0) {
+		printf("Failed to write the logs\n");
+		return -3;
+	}
+	return 0;
+}
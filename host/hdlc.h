@@ -0,0 +1,230 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "crc16.h"
+
+/*
+ * HDLC framing as used by diag: every frame is followed by 0x7e, 0x7e and
+ * 0x7d are escaped by 0x7d and xor 0x20, and the CRC-16/X.25 of the frame
+ * is appended in little endian before encoding.
+ */
+
+static inline uint16_t hdlc_crc(const uint8_t *data, size_t len)
+{
+	return crc16_x25(data, len);
+}
+
+static inline char *hdlc_put(char *out, uint8_t c)
+{
+	if (c == 0x7e || c == 0x7d) {
+		*out++ = 0x7d;
+		c ^= 0x20;
+	}
+	*out++ = c;
+	return out;
+}
+
+/*
+ * Most frames have no byte to escape, so the kernels look for 0x7e and 0x7d
+ * 16 or 32 bytes at a time on the CPUs which can, and copy the blocks with
+ * none as they are. first_of() returns the index of the first byte which is
+ * a or b in the next width bytes, or width if there is none.
+ */
+typedef size_t (*hdlc_first_of_t)(const uint8_t *p, uint8_t a, uint8_t b);
+
+static inline __attribute__((always_inline)) uint8_t *
+hdlc_unescape_with(const uint8_t *in, const uint8_t *end, uint8_t *out,
+		   hdlc_first_of_t first_of, size_t width)
+{
+	size_t n;
+
+	while (width && end - in >= width) {
+		n = first_of(in, 0x7d, 0x7d);
+		if (n == width) {
+			memcpy(out, in, width);
+			in += width;
+			out += width;
+			continue;
+		}
+		memcpy(out, in, n);
+		in += n;
+		out += n;
+		if (in + 1 == end)
+			return out;
+		*out++ = in[1] ^ 0x20;
+		in += 2;
+	}
+	for (; in != end; ++in) {
+		if (*in != 0x7d)
+			*out++ = *in;
+		else if (in + 1 != end)
+			*out++ = *++in ^ 0x20;
+	}
+	return out;
+}
+
+static inline __attribute__((always_inline)) char *
+hdlc_escape_with(const uint8_t *in, size_t len, char *out, hdlc_first_of_t first_of, size_t width)
+{
+	const uint8_t *end = in + len;
+	size_t n;
+
+	while (width && end - in >= width) {
+		n = first_of(in, 0x7e, 0x7d);
+		if (n == width) {
+			memcpy(out, in, width);
+			in += width;
+			out += width;
+			continue;
+		}
+		memcpy(out, in, n);
+		in += n;
+		out += n;
+		*out++ = 0x7d;
+		*out++ = *in++ ^ 0x20;
+	}
+	for (; in != end; ++in)
+		out = hdlc_put(out, *in);
+	return out;
+}
+
+static uint8_t *hdlc_unescape_scalar(const uint8_t *in, const uint8_t *end, uint8_t *out)
+{
+	return hdlc_unescape_with(in, end, out, NULL, 0);
+}
+
+static char *hdlc_escape_scalar(const uint8_t *in, size_t len, char *out)
+{
+	return hdlc_escape_with(in, len, out, NULL, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline __attribute__((always_inline, target("sse2"))) size_t
+hdlc_first_of_sse2(const uint8_t *p, uint8_t a, uint8_t b)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+	int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(a)),
+						  _mm_cmpeq_epi8(v, _mm_set1_epi8(b))));
+
+	return mask ? __builtin_ctz(mask) : 16;
+}
+
+static inline __attribute__((always_inline, target("avx2"))) size_t
+hdlc_first_of_avx2(const uint8_t *p, uint8_t a, uint8_t b)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *) p);
+	unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8(a)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b))));
+
+	return mask ? __builtin_ctz(mask) : 32;
+}
+
+static __attribute__((target("sse2"))) uint8_t *
+hdlc_unescape_sse2(const uint8_t *in, const uint8_t *end, uint8_t *out)
+{
+	return hdlc_unescape_with(in, end, out, hdlc_first_of_sse2, 16);
+}
+
+static __attribute__((target("sse2"))) char *
+hdlc_escape_sse2(const uint8_t *in, size_t len, char *out)
+{
+	return hdlc_escape_with(in, len, out, hdlc_first_of_sse2, 16);
+}
+
+static __attribute__((target("avx2"))) uint8_t *
+hdlc_unescape_avx2(const uint8_t *in, const uint8_t *end, uint8_t *out)
+{
+	return hdlc_unescape_with(in, end, out, hdlc_first_of_avx2, 32);
+}
+
+static __attribute__((target("avx2"))) char *
+hdlc_escape_avx2(const uint8_t *in, size_t len, char *out)
+{
+	return hdlc_escape_with(in, len, out, hdlc_first_of_avx2, 32);
+}
+#elif defined(__aarch64__)
+static inline __attribute__((always_inline)) size_t
+hdlc_first_of_neon(const uint8_t *p, uint8_t a, uint8_t b)
+{
+	uint8x16_t v = vld1q_u8(p);
+	uint8x16_t match = vorrq_u8(vceqq_u8(v, vdupq_n_u8(a)), vceqq_u8(v, vdupq_n_u8(b)));
+	// 4 bits per byte, since there is no movemask
+	uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+
+	return mask ? __builtin_ctzll(mask) >> 2 : 16;
+}
+
+static uint8_t *hdlc_unescape_neon(const uint8_t *in, const uint8_t *end, uint8_t *out)
+{
+	return hdlc_unescape_with(in, end, out, hdlc_first_of_neon, 16);
+}
+
+static char *hdlc_escape_neon(const uint8_t *in, size_t len, char *out)
+{
+	return hdlc_escape_with(in, len, out, hdlc_first_of_neon, 16);
+}
+#endif
+
+struct hdlc_kernel_t {
+	const char *name;
+	uint8_t *(*unescape)(const uint8_t *in, const uint8_t *end, uint8_t *out);
+	char *(*escape)(const uint8_t *in, size_t len, char *out);
+	int available;
+};
+
+// From the slowest to the fastest, the last available one is used
+static struct hdlc_kernel_t hdlc_kernels[] = {
+	{ "scalar", hdlc_unescape_scalar, hdlc_escape_scalar, 1 },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "sse2", hdlc_unescape_sse2, hdlc_escape_sse2, 0 },
+	{ "avx2", hdlc_unescape_avx2, hdlc_escape_avx2, 0 },
+#elif defined(__aarch64__)
+	{ "neon", hdlc_unescape_neon, hdlc_escape_neon, 1 },
+#endif
+};
+
+#define HDLC_NR_KERNELS (sizeof(hdlc_kernels) / sizeof(hdlc_kernels[0]))
+
+/*
+ * Unescape the bytes of a frame, without its delimiter, into out, and return
+ * the end of the output. An escape at the very end is dropped.
+ */
+static uint8_t *(*hdlc_unescape)(const uint8_t *in, const uint8_t *end, uint8_t *out) =
+	hdlc_unescape_scalar;
+// Escape len bytes into out, which must have room for 2 * len bytes
+static char *(*hdlc_escape)(const uint8_t *in, size_t len, char *out) = hdlc_escape_scalar;
+
+static inline void hdlc_select(const struct hdlc_kernel_t *kernel)
+{
+	hdlc_unescape = kernel->unescape;
+	hdlc_escape = kernel->escape;
+}
+
+__attribute__((constructor)) static void hdlc_init(void)
+{
+	size_t i;
+
+#if defined(__x86_64__) || defined(__i386__)
+	hdlc_kernels[1].available = __builtin_cpu_supports("sse2");
+	hdlc_kernels[2].available = __builtin_cpu_supports("avx2");
+#endif
+	for (i = 0; i < HDLC_NR_KERNELS; ++i)
+		if (hdlc_kernels[i].available)
+			hdlc_select(&hdlc_kernels[i]);
+}
+
+/*
+ * Encode len bytes with their CRC into out, which must have room for
+ * 2 * (len + 2) + 1 bytes. The end of the frame is returned.
+ */
+static inline char *hdlc_encode(const uint8_t *data, size_t len, char *out)
+{
+	uint16_t crc = hdlc_crc(data, len);
+
+	out = hdlc_escape(data, len, out);
+	out = hdlc_put(out, crc & 0xff);
+	out = hdlc_put(out, crc >> 8);
+	*out++ = 0x7e;
+	return out;
+}
@@ -0,0 +1,335 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+/*
+ * A minimal LZ4 frame decompressor for the logs compressed by diag_logcat.
+ * It also accepts the frames produced by the lz4 command line tool, but the
+ * checksums are not verified.
+ */
+
+#define LZ4_MAGIC		0x184d2204
+#define LZ4_SKIPPABLE_MAGIC	0x184d2a50
+#define LZ4_SKIPPABLE_MASK	0xfffffff0
+// Linked blocks may refer to this much of the previous ones
+#define LZ4_HISTORY_SIZE	65536
+
+static inline uint32_t lz4_read_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline int lz4_is_compressed(const void *buf, size_t len)
+{
+	return len >= 4 && lz4_read_le32(buf) == LZ4_MAGIC;
+}
+
+/*
+ * Decompress one block to out, which must be within [out_start, out_end).
+ * Matches may refer to anything after out_start, so linked blocks work as
+ * long as all of them are decompressed into one buffer.
+ * The end of the output is returned, or NULL if the block is corrupted.
+ */
+static inline uint8_t *lz4_decompress_block(const uint8_t *in, size_t len, uint8_t *out,
+					    uint8_t *out_start, uint8_t *out_end)
+{
+	const uint8_t *in_end = in + len;
+	const uint8_t *ref;
+	size_t literal_len, match_len, offset;
+	uint8_t token, c;
+
+	while (in < in_end) {
+		token = *in++;
+
+		literal_len = token >> 4;
+		if (literal_len == 15) {
+			do {
+				if (in >= in_end)
+					return NULL;
+				c = *in++;
+				literal_len += c;
+			} while (c == 255);
+		}
+		if (literal_len > in_end - in || literal_len > out_end - out)
+			return NULL;
+		memcpy(out, in, literal_len);
+		in += literal_len;
+		out += literal_len;
+
+		// The last sequence has no match
+		if (in == in_end)
+			break;
+
+		if (in_end - in < 2)
+			return NULL;
+		offset = in[0] | (in[1] << 8);
+		in += 2;
+		if (offset == 0 || offset > out - out_start)
+			return NULL;
+
+		match_len = token & 15;
+		if (match_len == 15) {
+			do {
+				if (in >= in_end)
+					return NULL;
+				c = *in++;
+				match_len += c;
+			} while (c == 255);
+		}
+		match_len += 4;
+		if (match_len > out_end - out)
+			return NULL;
+
+		// Overlapping copies are allowed, so it must go byte by byte
+		ref = out - offset;
+		while (match_len--)
+			*out++ = *ref++;
+	}
+	return out;
+}
+
+/*
+ * Get an upper bound of the decompressed length of all the frames, so that
+ * the output buffer can be allocated at once. -1 is returned if the frames
+ * are malformed.
+ */
+static inline ssize_t lz4_decompressed_bound(const uint8_t *in, size_t len)
+{
+	const uint8_t *in_end = in + len;
+	size_t total = 0, block_len, block_max;
+	uint8_t flg, bd;
+	uint32_t magic;
+
+	while (in < in_end) {
+		if (in_end - in < 4)
+			return -1;
+		magic = lz4_read_le32(in);
+		if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+			if (in_end - in < 8 || lz4_read_le32(in + 4) > in_end - in - 8)
+				return -1;
+			in += 8 + lz4_read_le32(in + 4);
+			continue;
+		}
+		if (magic != LZ4_MAGIC || in_end - in < 7)
+			return -1;
+
+		flg = in[4];
+		bd = in[5];
+		in += 7 + (flg & 0x08 ? 8 : 0) + (flg & 0x01 ? 4 : 0);
+		block_max = 1 << (2 * ((bd >> 4) & 7) + 8);
+
+		for (;;) {
+			if (in_end - in < 4)
+				return -1;
+			block_len = lz4_read_le32(in) & 0x7fffffffu;
+			in += 4;
+			if (block_len == 0)
+				break;
+			if (block_len > in_end - in)
+				return -1;
+			in += block_len + (flg & 0x10 ? 4 : 0);
+			total += block_max;
+		}
+		in += flg & 0x04 ? 4 : 0;
+	}
+	return in == in_end ? total : -1;
+}
+
+/*
+ * Decompress all the frames into out, which has the size returned by
+ * lz4_decompressed_bound(). The decompressed length is returned, or -1
+ * if the frames are corrupted.
+ */
+static inline ssize_t lz4_decompress_frames(const uint8_t *in, size_t len, uint8_t *out, size_t out_len)
+{
+	const uint8_t *in_end = in + len;
+	uint8_t *out_start = out, *out_end = out + out_len;
+	size_t block_len;
+	uint32_t raw;
+	uint8_t flg;
+
+	while (in < in_end) {
+		if ((lz4_read_le32(in) & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+			in += 8 + lz4_read_le32(in + 4);
+			continue;
+		}
+
+		flg = in[4];
+		in += 7 + (flg & 0x08 ? 8 : 0) + (flg & 0x01 ? 4 : 0);
+		for (;;) {
+			raw = lz4_read_le32(in);
+			block_len = raw & 0x7fffffffu;
+			in += 4;
+			if (block_len == 0)
+				break;
+			if (raw & 0x80000000u) {
+				if (block_len > out_end - out)
+					return -1;
+				memcpy(out, in, block_len);
+				out += block_len;
+			} else {
+				out = lz4_decompress_block(in, block_len, out, out_start, out_end);
+				if (!out)
+					return -1;
+			}
+			in += block_len + (flg & 0x10 ? 4 : 0);
+		}
+		in += flg & 0x04 ? 4 : 0;
+	}
+	return out - out_start;
+}
+
+/*
+ * Decompress the frames of a file block by block, so that the memory used
+ * is bounded by the block size instead of the size of the file.
+ */
+struct lz4_stream_t {
+	FILE *fp;
+	uint8_t flg;
+	int in_frame;
+	uint8_t *in;
+	size_t in_size;
+	// The history of the linked blocks, followed by the current block
+	uint8_t *buf;
+	size_t buf_size;
+	size_t pos;
+	size_t len;
+};
+
+static inline void lz4_stream_init(struct lz4_stream_t *s, FILE *fp)
+{
+	memset(s, 0, sizeof(*s));
+	s->fp = fp;
+}
+
+static inline void lz4_stream_free(struct lz4_stream_t *s)
+{
+	free(s->in);
+	free(s->buf);
+}
+
+static inline int lz4_stream_read_exact(struct lz4_stream_t *s, void *buf, size_t len)
+{
+	return fread(buf, 1, len, s->fp) == len ? 0 : -1;
+}
+
+static inline int lz4_stream_open_frame(struct lz4_stream_t *s, uint32_t magic)
+{
+	uint8_t header[15];
+	size_t block_max, extra;
+	void *p;
+
+	if (magic != LZ4_MAGIC || lz4_stream_read_exact(s, header, 2) < 0)
+		return -1;
+	s->flg = header[0];
+	block_max = 1 << (2 * ((header[1] >> 4) & 7) + 8);
+	// The content size and the dictionary id, then the header checksum
+	extra = (s->flg & 0x08 ? 8 : 0) + (s->flg & 0x01 ? 4 : 0) + 1;
+	if (lz4_stream_read_exact(s, header + 2, extra) < 0)
+		return -1;
+
+	if (block_max > s->in_size) {
+		p = realloc(s->in, block_max);
+		if (!p)
+			return -1;
+		s->in = p;
+		s->in_size = block_max;
+	}
+	if (LZ4_HISTORY_SIZE + block_max > s->buf_size) {
+		p = realloc(s->buf, LZ4_HISTORY_SIZE + block_max);
+		if (!p)
+			return -1;
+		s->buf = p;
+		s->buf_size = LZ4_HISTORY_SIZE + block_max;
+	}
+	s->pos = s->len = 0;
+	s->in_frame = 1;
+	return 0;
+}
+
+/*
+ * Decompress the next block. 1 is returned if there is more data, 0 at the
+ * end of the file, or -1 if the frames are corrupted.
+ */
+static inline int lz4_stream_next_block(struct lz4_stream_t *s)
+{
+	uint8_t word[4];
+	uint32_t raw, block_len;
+	uint8_t *out;
+
+	for (;;) {
+		if (!s->in_frame) {
+			if (fread(word, 1, 4, s->fp) != 4)
+				return 0;
+			if ((lz4_read_le32(word) & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+				if (lz4_stream_read_exact(s, word, 4) < 0 ||
+				    fseek(s->fp, lz4_read_le32(word), SEEK_CUR) < 0)
+					return -1;
+				continue;
+			}
+			if (lz4_stream_open_frame(s, lz4_read_le32(word)) < 0)
+				return -1;
+		}
+
+		if (lz4_stream_read_exact(s, word, 4) < 0)
+			return -1;
+		raw = lz4_read_le32(word);
+		block_len = raw & 0x7fffffffu;
+		if (block_len == 0) {
+			if ((s->flg & 0x04) && lz4_stream_read_exact(s, word, 4) < 0)
+				return -1;
+			s->in_frame = 0;
+			continue;
+		}
+		if (block_len > s->in_size || lz4_stream_read_exact(s, s->in, block_len) < 0)
+			return -1;
+		if ((s->flg & 0x10) && lz4_stream_read_exact(s, word, 4) < 0)
+			return -1;
+
+		if (s->len > LZ4_HISTORY_SIZE) {
+			memmove(s->buf, s->buf + s->len - LZ4_HISTORY_SIZE, LZ4_HISTORY_SIZE);
+			s->len = LZ4_HISTORY_SIZE;
+		}
+		s->pos = s->len;
+		if (raw & 0x80000000u) {
+			if (block_len > s->buf_size - s->len)
+				return -1;
+			memcpy(s->buf + s->len, s->in, block_len);
+			s->len += block_len;
+		} else {
+			out = lz4_decompress_block(s->in, block_len, s->buf + s->len, s->buf,
+						   s->buf + s->buf_size);
+			if (!out)
+				return -1;
+			s->len = out - s->buf;
+		}
+		if (s->len > s->pos)
+			return 1;
+	}
+}
+
+/*
+ * Read up to len decompressed bytes. Fewer are returned only at the end of
+ * the file, and -1 is returned if the frames are corrupted.
+ */
+static inline ssize_t lz4_stream_read(struct lz4_stream_t *s, void *out, size_t len)
+{
+	size_t done = 0, n;
+	int ret;
+
+	while (done < len) {
+		if (s->pos == s->len) {
+			ret = lz4_stream_next_block(s);
+			if (ret <= 0)
+				return ret < 0 ? -1 : done;
+		}
+		n = s->len - s->pos < len - done ? s->len - s->pos : len - done;
+		memcpy((uint8_t *) out + done, s->buf + s->pos, n);
+		s->pos += n;
+		done += n;
+	}
+	return done;
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "diag_log.h"
+
+/*
+ * Merge corrected logs, such as the ones of two phones or of the modem and
+ * an MDM, into one log ordered by the corrected stamps. The logs are read
+ * frame by frame, and a heap of their next frames gives the earliest one,
+ * so memory is bounded by a buffer per log however long they are. The
+ * frames of each log stay in their order, since a corrected log may be
+ * slightly out of order itself.
+ */
+
+#define READ_SIZE (1 << 20)
+#define WRITE_BUF_SIZE (1 << 20)
+
+struct input_t {
+	const char *path;
+	FILE *fp;
+	uint8_t *buf;
+	size_t size, len;
+	// The next frame, from pos to its delimiter at end
+	size_t pos, end;
+	uint64_t stamp;
+	int eof;
+	uint64_t nr_frames;
+};
+
+static struct input_t *inputs;
+static int nr_inputs;
+// The inputs which have a next frame, the earliest one first
+static int *heap;
+static int heap_len;
+
+static uint64_t get_monotonic_timestamp(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+/*
+ * Move to the next frame of the input. 1 is returned if there is one, 0 at
+ * the end of the log, and -1 on failure. What follows the last delimiter is
+ * not a complete frame, and is dropped.
+ */
+static int next_frame(struct input_t *input)
+{
+	uint8_t *delim, *buf;
+	uint64_t stamp;
+	size_t ret;
+
+	input->pos = input->end;
+	for (;;) {
+		delim = memchr(input->buf + input->pos, 0x7e, input->len - input->pos);
+		if (delim)
+			break;
+		if (input->eof)
+			return 0;
+
+		// Keep the partial frame, and grow for one longer than the buffer
+		memmove(input->buf, input->buf + input->pos, input->len - input->pos);
+		input->len -= input->pos;
+		input->pos = 0;
+		if (input->len == input->size) {
+			buf = realloc(input->buf, input->size * 2);
+			if (!buf) {
+				printf("Cannot allocate memory for reading %s\n", input->path);
+				return -1;
+			}
+			input->buf = buf;
+			input->size *= 2;
+		}
+		ret = fread(input->buf + input->len, 1, input->size - input->len, input->fp);
+		if (ret < input->size - input->len) {
+			if (ferror(input->fp)) {
+				printf("Failed to read from %s\n", input->path);
+				return -1;
+			}
+			input->eof = 1;
+		}
+		input->len += ret;
+	}
+
+	input->end = delim + 1 - input->buf;
+	// A frame without a stamp stays next to the one before it
+	stamp = diag_frame_stamp(input->buf + input->pos, delim);
+	if (stamp != UINT64_MAX)
+		input->stamp = stamp;
+	return 1;
+}
+
+// Earlier stamps first, and the inputs in their order for the same stamp
+static int input_before(int a, int b)
+{
+	if (inputs[a].stamp != inputs[b].stamp)
+		return inputs[a].stamp < inputs[b].stamp;
+	return a < b;
+}
+
+static void heap_down(int i)
+{
+	int child, tmp;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap_len)
+			break;
+		if (child + 1 < heap_len && input_before(heap[child + 1], heap[child]))
+			++child;
+		if (!input_before(heap[child], heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static int open_inputs(char **paths)
+{
+	struct input_t *input;
+	int i, ret;
+
+	inputs = calloc(nr_inputs, sizeof(struct input_t));
+	heap = calloc(nr_inputs, sizeof(int));
+	if (!inputs || !heap) {
+		printf("Cannot allocate memory for reading logs\n");
+		return -5;
+	}
+	for (i = 0; i < nr_inputs; ++i) {
+		input = &inputs[i];
+		input->path = paths[i];
+		input->fp = fopen(input->path, "rb");
+		if (!input->fp) {
+			printf("Cannot open log %s for reading\n", input->path);
+			return -2;
+		}
+		input->size = READ_SIZE;
+		input->buf = malloc(input->size);
+		if (!input->buf) {
+			printf("Cannot allocate memory for reading logs\n");
+			return -5;
+		}
+		ret = next_frame(input);
+		if (ret < 0)
+			return -4;
+		if (ret > 0)
+			heap[heap_len++] = i;
+	}
+	for (i = heap_len / 2 - 1; i >= 0; --i)
+		heap_down(i);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [output log] [corrected log]...\n"
+	       "Merge logs corrected by stamp_corrector into one, ordered by their stamps.\n",
+	       name);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t start = get_monotonic_timestamp(), nr_frames = 0;
+	struct input_t *input;
+	FILE *out_fp;
+	int i, ret;
+
+	if (argc < 3 || argv[1][0] == '-') {
+		usage(argv[0]);
+		return -1;
+	}
+	nr_inputs = argc - 2;
+	ret = open_inputs(argv + 2);
+	if (ret < 0)
+		return ret;
+	out_fp = fopen(argv[1], "wb");
+	if (!out_fp) {
+		printf("Cannot open output log %s for writing\n", argv[1]);
+		return -2;
+	}
+	setvbuf(out_fp, NULL, _IOFBF, WRITE_BUF_SIZE);
+
+	while (heap_len > 0) {
+		input = &inputs[heap[0]];
+		if (fwrite(input->buf + input->pos, 1, input->end - input->pos, out_fp) !=
+		    input->end - input->pos) {
+			printf("Failed to write into output log %s\n", argv[1]);
+			return -3;
+		}
+		++input->nr_frames;
+		++nr_frames;
+
+		ret = next_frame(input);
+		if (ret < 0)
+			return -4;
+		if (ret == 0)
+			heap[0] = heap[--heap_len];
+		heap_down(0);
+	}
+	if (fclose(out_fp) != 0) {
+		printf("Failed to write into output log %s\n", argv[1]);
+		return -3;
+	}
+
+	for (i = 0; i < nr_inputs; ++i)
+		printf("%s: %llu frames\n", inputs[i].path, (unsigned long long) inputs[i].nr_frames);
+	printf("Merged %llu frames in %.3f s\n", (unsigned long long) nr_frames,
+	       (get_monotonic_timestamp() - start) / 1e9);
+	return 0;
+}
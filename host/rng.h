@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * xorshift64*, so that the same seed gives the same numbers on every
+ * platform. The state must never be 0.
+ */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static inline uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dull;
+}
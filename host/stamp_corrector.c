@@ -1,276 +1,1714 @@
 #include <stdio.h>
-#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "lz4.h"
+#include "hdlc.h"
+#include "diag_log.h"
+#include "stamp_index.h"
+#include "../jni/stamp.h"
 
-struct stamp_log_t {
-	uint64_t offset;
+/*
+ * The data log is cut into chunks of about CHUNK_SIZE bytes, right after the
+ * first frame starting at a stamp record offset. The frames of a record are
+ * all corrected by the same difference, which is taken from the last one, so
+ * each chunk can be corrected on its own, by as many threads as wanted. The
+ * output is the same as if the whole log was corrected at once, and memory
+ * is bounded by the chunks in flight instead of the size of the log.
+ */
+#define CHUNK_SIZE (2 << 20)
+#define READ_SIZE (1 << 20)
+// No valid frame is that long, so a chunk is cut there if it has no delimiter
+#define MAX_FRAME_LEN (16 << 20)
+
+/*
+ * A log which may be compressed by diag_logcat -z. It is decompressed block
+ * by block while being read.
+ */
+struct log_reader_t {
+	FILE *fp;
+	int compressed;
+	struct lz4_stream_t lz4;
+};
+
+/*
+ * The index of an output log, see stamp_index.h. Each entry is written once
+ * its block ends, with the earliest stamp of the block only, and they are
+ * turned into the earliest stamps from each block on when it is closed, so
+ * that the output of any size is indexed in constant memory.
+ */
+struct out_index_t {
+	FILE *fp;
+	char path[FILENAME_MAX];
+	struct stamp_index_header_t header;
+	struct stamp_index_entry_t entry;
+	int has_entry;
+	uint64_t nr_entries;
+	// The bytes in the output log, and where the next block may start
+	uint64_t offset, next;
+};
+
+// Where a corrected frame is in the output of its chunk
+struct out_frame_t {
+	size_t pos;
 	uint64_t stamp;
+	uint32_t len;
+	uint16_t code;
+};
+
+/*
+ * With -s, the frames go into one file per log code instead, or per group
+ * of codes given by -c, all in the output directory.
+ */
+#define MAX_SPLIT_GROUPS 256
+#define SPLIT_BUF_SIZE (64 << 10)
+
+struct split_out_t {
+	char path[FILENAME_MAX];
+	FILE *fp;
+	struct out_index_t *index;
+};
+
+struct split_group_t {
+	uint16_t first, last;
+	const char *name;
+};
+
+/*
+ * With -S, nothing is corrected into output logs. Instead, the corrected
+ * frames are counted by log code and by second, and the discarded ones by
+ * why, then written out as CSV or JSON.
+ */
+enum discard_reason {
+	DISCARD_CORRUPTED,
+	DISCARD_UNSUPPORTED,
+	DISCARD_SHORT,
+	DISCARD_TAILING,
+	NR_DISCARDS,
+};
+
+static const char *discard_names[NR_DISCARDS] = {
+	"corrupted", "unsupported", "too_short", "tailing",
+};
+
+enum stats_format {
+	STATS_NONE,
+	STATS_CSV,
+	STATS_JSON,
+};
+
+// The time series is cut there, so that a wild stamp cannot take all memory
+#define MAX_STATS_SECONDS (31 * 86400)
+
+struct stats_count_t {
+	uint64_t frames;
+	uint64_t bytes;
+};
+
+/*
+ * A pair of data and stamp logs. diag_logcat writes a capture as segments
+ * named PREFIX.NNNN.dlog and PREFIX.NNNN.tlog, which may be reused in turn.
+ */
+struct segment_t {
+	char data_path[FILENAME_MAX];
+	char stamp_path[FILENAME_MAX];
+	char out_path[FILENAME_MAX];
+	unsigned int index;
+	uint64_t first_stamp;
+	FILE *out_fp;
+	struct out_index_t *stamp_index;
+	int reported;
+};
+
+struct chunk_t {
+	struct segment_t *segment;
+	// The last chunk of its segment
+	int last;
+	uint64_t base;
+	uint8_t *data;
+	// Only the first len bytes belong to the chunk, the rest to the next one
+	size_t len, filled, size;
+	struct stamp_log_t *stamps;
+	size_t nr_stamps, max_stamps;
+	// The corrected frames and the warnings, written out in order
+	char *out;
+	size_t out_len, out_size;
+	struct out_frame_t *out_frames;
+	size_t nr_out_frames, max_out_frames;
+	char *log;
+	size_t log_len, log_size;
+	uint64_t discarded[NR_DISCARDS];
+	int done;
+};
+
+struct frame_t {
+	size_t pos;
+	size_t len;
+	size_t stamp_pos;
+};
+
+// The frames of the current stamp record, decoded by a worker
+struct worker_t {
+	pthread_t thread;
+	uint8_t *buf;
+	size_t len, size;
+	struct frame_t *frames;
+	size_t nr_frames, max_frames;
 };
 
 static FILE *data_fp, *stamp_fp, *out_fp;
-static char *data, *out_start, *out_current, *out_end;
-static struct stamp_log_t *stamps;
-static size_t data_len, nr_stamps, out_remained;
-
-static uint16_t calc_crc(const uint8_t *data, size_t len)
-{
-	static const uint16_t table[256] = {
-		0x0000U, 0x1189U, 0x2312U, 0x329BU, 0x4624U, 0x57ADU, 0x6536U, 0x74BFU,
-		0x8C48U, 0x9DC1U, 0xAF5AU, 0xBED3U, 0xCA6CU, 0xDBE5U, 0xE97EU, 0xF8F7U,
-		0x1081U, 0x0108U, 0x3393U, 0x221AU, 0x56A5U, 0x472CU, 0x75B7U, 0x643EU,
-		0x9CC9U, 0x8D40U, 0xBFDBU, 0xAE52U, 0xDAEDU, 0xCB64U, 0xF9FFU, 0xE876U,
-		0x2102U, 0x308BU, 0x0210U, 0x1399U, 0x6726U, 0x76AFU, 0x4434U, 0x55BDU,
-		0xAD4AU, 0xBCC3U, 0x8E58U, 0x9FD1U, 0xEB6EU, 0xFAE7U, 0xC87CU, 0xD9F5U,
-		0x3183U, 0x200AU, 0x1291U, 0x0318U, 0x77A7U, 0x662EU, 0x54B5U, 0x453CU,
-		0xBDCBU, 0xAC42U, 0x9ED9U, 0x8F50U, 0xFBEFU, 0xEA66U, 0xD8FDU, 0xC974U,
-		0x4204U, 0x538DU, 0x6116U, 0x709FU, 0x0420U, 0x15A9U, 0x2732U, 0x36BBU,
-		0xCE4CU, 0xDFC5U, 0xED5EU, 0xFCD7U, 0x8868U, 0x99E1U, 0xAB7AU, 0xBAF3U,
-		0x5285U, 0x430CU, 0x7197U, 0x601EU, 0x14A1U, 0x0528U, 0x37B3U, 0x263AU,
-		0xDECDU, 0xCF44U, 0xFDDFU, 0xEC56U, 0x98E9U, 0x8960U, 0xBBFBU, 0xAA72U,
-		0x6306U, 0x728FU, 0x4014U, 0x519DU, 0x2522U, 0x34ABU, 0x0630U, 0x17B9U,
-		0xEF4EU, 0xFEC7U, 0xCC5CU, 0xDDD5U, 0xA96AU, 0xB8E3U, 0x8A78U, 0x9BF1U,
-		0x7387U, 0x620EU, 0x5095U, 0x411CU, 0x35A3U, 0x242AU, 0x16B1U, 0x0738U,
-		0xFFCFU, 0xEE46U, 0xDCDDU, 0xCD54U, 0xB9EBU, 0xA862U, 0x9AF9U, 0x8B70U,
-		0x8408U, 0x9581U, 0xA71AU, 0xB693U, 0xC22CU, 0xD3A5U, 0xE13EU, 0xF0B7U,
-		0x0840U, 0x19C9U, 0x2B52U, 0x3ADBU, 0x4E64U, 0x5FEDU, 0x6D76U, 0x7CFFU,
-		0x9489U, 0x8500U, 0xB79BU, 0xA612U, 0xD2ADU, 0xC324U, 0xF1BFU, 0xE036U,
-		0x18C1U, 0x0948U, 0x3BD3U, 0x2A5AU, 0x5EE5U, 0x4F6CU, 0x7DF7U, 0x6C7EU,
-		0xA50AU, 0xB483U, 0x8618U, 0x9791U, 0xE32EU, 0xF2A7U, 0xC03CU, 0xD1B5U,
-		0x2942U, 0x38CBU, 0x0A50U, 0x1BD9U, 0x6F66U, 0x7EEFU, 0x4C74U, 0x5DFDU,
-		0xB58BU, 0xA402U, 0x9699U, 0x8710U, 0xF3AFU, 0xE226U, 0xD0BDU, 0xC134U,
-		0x39C3U, 0x284AU, 0x1AD1U, 0x0B58U, 0x7FE7U, 0x6E6EU, 0x5CF5U, 0x4D7CU,
-		0xC60CU, 0xD785U, 0xE51EU, 0xF497U, 0x8028U, 0x91A1U, 0xA33AU, 0xB2B3U,
-		0x4A44U, 0x5BCDU, 0x6956U, 0x78DFU, 0x0C60U, 0x1DE9U, 0x2F72U, 0x3EFBU,
-		0xD68DU, 0xC704U, 0xF59FU, 0xE416U, 0x90A9U, 0x8120U, 0xB3BBU, 0xA232U,
-		0x5AC5U, 0x4B4CU, 0x79D7U, 0x685EU, 0x1CE1U, 0x0D68U, 0x3FF3U, 0x2E7AU,
-		0xE70EU, 0xF687U, 0xC41CU, 0xD595U, 0xA12AU, 0xB0A3U, 0x8238U, 0x93B1U,
-		0x6B46U, 0x7ACFU, 0x4854U, 0x59DDU, 0x2D62U, 0x3CEBU, 0x0E70U, 0x1FF9U,
-		0xF78FU, 0xE606U, 0xD49DU, 0xC514U, 0xB1ABU, 0xA022U, 0x92B9U, 0x8330U,
-		0x7BC7U, 0x6A4EU, 0x58D5U, 0x495CU, 0x3DE3U, 0x2C6AU, 0x1EF1U, 0x0F78U,
-	};
-
-	uint16_t crc = 0xffff;
-	for (--len; ~len; --len)
-		crc = table[*data++ ^ (uint8_t) crc] ^ (crc >> 8);
-	return crc ^ 0xffff;
-}
-
-static char *decode_inplace(char *start)
-{
-	char c;
-	char *out = start;
-	char *front = start;
-	int esc = 0;
-	while ((c = *front++) != 0x7e) {
-		if (esc) {
-			*out++ = c ^ 0x20;
-			esc = 0;
-		} else if (c == 0x7d) {
-			esc = 1;
-		} else {
-			*out++ = c;
+static struct log_reader_t data_reader, stamp_reader;
+static struct segment_t *segments;
+static size_t nr_segments;
+// Where the segments are corrected to in batch mode, either one file or a directory
+static const char *batch_out_path, *batch_out_dir;
+static int data_eof;
+// The output logs are indexed with -i, one index per output
+static int indexing;
+static uint32_t index_granularity = 65536;
+static struct out_index_t out_index;
+
+static int splitting;
+static const char *split_dir;
+static struct split_group_t split_groups[MAX_SPLIT_GROUPS];
+static size_t nr_split_groups;
+// By log code, and all of them to be closed in the end
+static struct split_out_t *split_outs[65536];
+static struct split_out_t **split_list;
+static size_t nr_split_outs, max_split_outs;
+
+static int stats_format;
+static const char *stats_path;
+static struct stats_count_t stats_codes[65536];
+static uint64_t stats_discarded[NR_DISCARDS];
+static uint64_t stats_min_stamp = UINT64_MAX, stats_max_stamp;
+// Counts by POSIX second from stats_base, and those out of the series
+static struct stats_count_t *stats_seconds, stats_outside;
+static uint64_t stats_base;
+static size_t nr_stats_seconds, max_stats_seconds;
+
+// The next stamp record to be given to a chunk
+static struct stamp_log_t stamp;
+static int stamp_valid, message_stamps;
+static struct stamp_batch_t stamp_batch;
+static uint32_t stamp_msg_id;
+static uint64_t stamp_msg_offset;
+
+/*
+ * With -f, the logs are followed as they grow, as tail -f does. The frames
+ * are corrected as soon as a stamp record covers them, until the writer
+ * closes the stamp log, either log goes away, or we are interrupted.
+ */
+static int following;
+static volatile sig_atomic_t follow_stopping;
+#define FOLLOW_POLL_MS 1000
+
+static int nr_threads = 1;
+static struct worker_t *workers;
+static struct chunk_t *chunks;
+static size_t nr_chunks;
+static size_t chunks_queued, chunks_taken;
+static int workers_stopping;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t chunk_done = PTHREAD_COND_INITIALIZER;
+
+static int reader_open(struct log_reader_t *reader, FILE *fp)
+{
+	uint8_t magic[4];
+	size_t len;
+
+	reader->fp = fp;
+	len = fread(magic, 1, sizeof(magic), fp);
+	reader->compressed = lz4_is_compressed(magic, len);
+	if (reader->compressed)
+		lz4_stream_init(&reader->lz4, fp);
+	return fseek(fp, 0, SEEK_SET);
+}
+
+/*
+ * Read up to len bytes, fewer only at the end of the log. -1 is returned if
+ * the compressed log is corrupted.
+ */
+static ssize_t reader_read(struct log_reader_t *reader, void *buf, size_t len)
+{
+	if (reader->compressed)
+		return lz4_stream_read(&reader->lz4, buf, len);
+	return fread(buf, 1, len, reader->fp);
+}
+
+/*
+ * Move to the next stamp record. The per-message stamps are expanded into
+ * one stamp_log_t per message, so that the rest does not need to care about
+ * the format. 1 is returned if there is one, 0 at the end of the stamp log,
+ * and -1 if it is malformed.
+ */
+static int read_stamp(void)
+{
+	struct stamp_msg_t msg;
+	ssize_t ret;
+
+	stamp_valid = 0;
+	if (!message_stamps) {
+		ret = reader_read(&stamp_reader, &stamp, sizeof(stamp));
+		if (ret < 0)
+			return -1;
+		stamp_valid = ret == sizeof(stamp);
+		return stamp_valid;
+	}
+
+	for (;;) {
+		while (stamp_msg_id == stamp_batch.nr_msgs) {
+			ret = reader_read(&stamp_reader, &stamp_batch, sizeof(stamp_batch));
+			if (ret == 0)
+				return 0;
+			if (ret != sizeof(stamp_batch))
+				return -1;
+			stamp_msg_id = 0;
+			stamp_msg_offset = stamp_batch.offset;
 		}
+		if (reader_read(&stamp_reader, &msg, sizeof(msg)) != sizeof(msg))
+			return -1;
+		++stamp_msg_id;
+		if (msg.len == 0)
+			continue;
+		stamp_msg_offset += msg.len;
+		stamp.offset = stamp_msg_offset;
+		stamp.stamp = stamp_batch.stamp + msg.delta;
+		stamp_valid = 1;
+		return 1;
 	}
-	if (out - start <= 2)
-		return NULL;
-	if (calc_crc(start, out - start - 2) != *(uint16_t *)(out - 2))
-		return NULL;
-	return out;
 }
 
-static char *encode_reversed(const char *start, const char *end, char *out)
+/*
+ * A record still being written when followed is read again once it is
+ * complete, so there it only means that there are no more records yet.
+ */
+static int next_stamp(void)
 {
-	ssize_t len = end - start;
-	uint16_t crc = calc_crc(start, len);
-	ssize_t i;
-	char c;
+	struct stamp_batch_t batch = stamp_batch;
+	uint32_t msg_id = stamp_msg_id;
+	uint64_t msg_offset = stamp_msg_offset;
+	off_t pos;
+	int ret;
 
-	*--out = 0x7e;
-	for (i = -1; i <= len; ++i) {
-		switch (i) {
-		case -1:
-			c = (crc & 0xff00u) >> 8;
-			break;
-		case 0:
-			c = crc & 0x00ffu;
-			break;
-		default:
-			c = end[-i];
+	if (!following)
+		return read_stamp();
+	pos = ftello(stamp_fp);
+	ret = read_stamp();
+	if (ret <= 0) {
+		fseeko(stamp_fp, pos, SEEK_SET);
+		stamp_batch = batch;
+		stamp_msg_id = msg_id;
+		stamp_msg_offset = msg_offset;
+		ret = 0;
+	}
+	return ret;
+}
+
+static int open_stamps(void)
+{
+	int ret;
+
+	if (reader_open(&stamp_reader, stamp_fp) < 0)
+		return -1;
+	ret = next_stamp();
+	if (ret > 0 && stamp.offset == STAMP_LOG_MAGIC_OFFSET && stamp.stamp == STAMP_LOG_MAGIC_V2) {
+		message_stamps = 1;
+		ret = next_stamp();
+	}
+	return ret > 0 || (following && ret == 0) ? 0 : -1;
+}
+
+static void *grow(void *buf, size_t *size, size_t needed, size_t unit)
+{
+	size_t new_size = *size ? *size : 4096;
+
+	if (needed <= *size)
+		return buf;
+	while (new_size < needed)
+		new_size *= 2;
+	buf = realloc(buf, new_size * unit);
+	if (!buf) {
+		printf("Cannot allocate memory for generating output log\n");
+		exit(-5);
+	}
+	*size = new_size;
+	return buf;
+}
+
+static void chunk_log(struct chunk_t *chunk, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(chunk->log + chunk->log_len, chunk->log_size - chunk->log_len, fmt, ap);
+		va_end(ap);
+		if (len < chunk->log_size - chunk->log_len)
 			break;
+		chunk->log = grow(chunk->log, &chunk->log_size, chunk->log_len + len + 1, 1);
+	}
+	chunk->log_len += len;
+}
+
+/*
+ * Correct the frames of a stamp record by the difference between the record
+ * and the last one. The old CRC stays in the frame, and the new one is
+ * appended after it.
+ */
+static void flush_group(struct worker_t *worker, struct chunk_t *chunk,
+			const struct stamp_log_t *slog)
+{
+	const struct frame_t *frame;
+	struct out_frame_t *out_frame;
+	uint64_t qcom_stamp, sdiff;
+	size_t i;
+
+	if (worker->nr_frames == 0)
+		return;
+
+	frame = &worker->frames[worker->nr_frames - 1];
+	memcpy(&qcom_stamp, worker->buf + frame->stamp_pos, sizeof(qcom_stamp));
+	sdiff = diag_stamp_from_posix(slog->stamp) - qcom_stamp;
+
+	for (i = 0, frame = worker->frames; i < worker->nr_frames; ++i, ++frame) {
+		memcpy(&qcom_stamp, worker->buf + frame->stamp_pos, sizeof(qcom_stamp));
+		qcom_stamp += sdiff;
+		memcpy(worker->buf + frame->stamp_pos, &qcom_stamp, sizeof(qcom_stamp));
+
+		if (indexing || splitting || stats_format) {
+			chunk->out_frames = grow(chunk->out_frames, &chunk->max_out_frames,
+						 chunk->nr_out_frames + 1, sizeof(struct out_frame_t));
+			out_frame = &chunk->out_frames[chunk->nr_out_frames++];
+			out_frame->pos = chunk->out_len;
+			out_frame->stamp = qcom_stamp;
+			out_frame->len = frame->len - 2;
+			out_frame->code = diag_log_code(worker->buf + frame->stamp_pos -
+							DIAG_LOG_STAMP_OFFSET);
 		}
-		switch (c) {
-		case 0x7e:
-		case 0x7d:
-			*--out = c ^ 0x20;
-			*--out = 0x7d;
-			break;
-		default:
-			*--out = c;
+		if (stats_format)
+			continue;
+		chunk->out = grow(chunk->out, &chunk->out_size,
+				  chunk->out_len + 2 * (frame->len + 2) + 1, 1);
+		chunk->out_len = hdlc_encode(worker->buf + frame->pos, frame->len,
+					     chunk->out + chunk->out_len) - chunk->out;
+	}
+	worker->len = worker->nr_frames = 0;
+}
+
+/*
+ * Decode a frame into the current group, and keep it if it is a log packet
+ * which can be corrected.
+ */
+static void add_frame(struct worker_t *worker, struct chunk_t *chunk, const uint8_t *in,
+		      const uint8_t *end, int has_stamp)
+{
+	long start = chunk->base + (in - chunk->data);
+	size_t pos = worker->len, len;
+	uint8_t *frame, *out;
+	ssize_t offset;
+	uint16_t crc;
+
+	// There are no more decoded bytes than encoded ones
+	worker->buf = grow(worker->buf, &worker->size, pos + (end - in), 1);
+	frame = worker->buf + pos;
+	out = hdlc_unescape(in, end, frame);
+	len = out - frame;
+
+	if (len > 2)
+		memcpy(&crc, frame + len - 2, sizeof(crc));
+	if (len <= 2 || hdlc_crc(frame, len - 2) != crc) {
+		chunk_log(chunk, "Warning: discarding corrupted frame at %ld\n", start);
+		++chunk->discarded[DISCARD_CORRUPTED];
+		return;
+	}
+
+	offset = diag_log_offset(frame, len);
+	if (offset < 0) {
+		chunk_log(chunk, "Warning: discarding unsupported frame at %ld\n", start);
+		++chunk->discarded[DISCARD_UNSUPPORTED];
+		return;
+	}
+	if (len < offset + DIAG_LOG_HEADER_LEN) {
+		chunk_log(chunk, "Warning: frame at %ld is too short, which should never happen\n",
+			  start);
+		++chunk->discarded[DISCARD_SHORT];
+		return;
+	}
+	if (!has_stamp) {
+		chunk_log(chunk, "Warning: discarding tailing frame at %ld\n", start);
+		++chunk->discarded[DISCARD_TAILING];
+		return;
+	}
+
+	worker->frames = grow(worker->frames, &worker->max_frames, worker->nr_frames + 1,
+			      sizeof(struct frame_t));
+	worker->frames[worker->nr_frames].pos = pos;
+	worker->frames[worker->nr_frames].len = len;
+	worker->frames[worker->nr_frames].stamp_pos = pos + offset + DIAG_LOG_STAMP_OFFSET;
+	++worker->nr_frames;
+	worker->len = pos + len;
+}
+
+/*
+ * A frame is corrected with the first stamp record ending after its start.
+ * Once a frame belongs to a later record, no more frames will belong to the
+ * current one, so it can be written out. Anything after the last delimiter
+ * is not a complete frame.
+ */
+static void correct_chunk(struct worker_t *worker, struct chunk_t *chunk)
+{
+	const uint8_t *in = chunk->data, *end = chunk->data + chunk->len, *delim;
+	size_t next = 0;
+	uint64_t start;
+
+	chunk->out_len = chunk->nr_out_frames = 0;
+	memset(chunk->discarded, 0, sizeof(chunk->discarded));
+	worker->len = worker->nr_frames = 0;
+	while ((delim = memchr(in, 0x7e, end - in)) != NULL) {
+		start = chunk->base + (in - chunk->data);
+		while (next < chunk->nr_stamps && chunk->stamps[next].offset <= start)
+			flush_group(worker, chunk, &chunk->stamps[next++]);
+		add_frame(worker, chunk, in, delim, next < chunk->nr_stamps);
+		in = delim + 1;
+	}
+	if (next < chunk->nr_stamps)
+		flush_group(worker, chunk, &chunk->stamps[next]);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker_t *worker = arg;
+	struct chunk_t *chunk;
+
+	pthread_mutex_lock(&chunk_lock);
+	for (;;) {
+		while (chunks_taken == chunks_queued && !workers_stopping)
+			pthread_cond_wait(&chunk_queued, &chunk_lock);
+		if (chunks_taken == chunks_queued)
 			break;
+		chunk = &chunks[chunks_taken++ % nr_chunks];
+		pthread_mutex_unlock(&chunk_lock);
+
+		correct_chunk(worker, chunk);
+
+		pthread_mutex_lock(&chunk_lock);
+		chunk->done = 1;
+		pthread_cond_broadcast(&chunk_done);
+	}
+	pthread_mutex_unlock(&chunk_lock);
+	return NULL;
+}
+
+// Read until the chunk has at least len bytes, or the data log ends
+static int fill_chunk(struct chunk_t *chunk, size_t len)
+{
+	ssize_t ret;
+
+	while (chunk->filled < len && !data_eof) {
+		chunk->data = grow(chunk->data, &chunk->size, chunk->filled + READ_SIZE, 1);
+		ret = reader_read(&data_reader, chunk->data + chunk->filled,
+				  chunk->size - chunk->filled);
+		if (ret < 0) {
+			printf("Corrupted LZ4 frames\n");
+			return -1;
 		}
+		data_eof = ret < chunk->size - chunk->filled;
+		chunk->filled += ret;
+	}
+	return 0;
+}
+
+static int add_stamp(struct chunk_t *chunk)
+{
+	chunk->stamps = grow(chunk->stamps, &chunk->max_stamps, chunk->nr_stamps + 1,
+			     sizeof(struct stamp_log_t));
+	chunk->stamps[chunk->nr_stamps++] = stamp;
+	if (next_stamp() < 0) {
+		printf("Malformed per-message stamp log\n");
+		return -1;
 	}
-	return out;
+	return 0;
 }
 
-static ssize_t get_file_size(FILE *fp)
+// Start the chunk with what the previous one left, or empty without one
+static void start_chunk(struct chunk_t *chunk, const struct chunk_t *prev)
 {
-	ssize_t ret, len;
+	chunk->base = prev ? prev->base + prev->len : 0;
+	chunk->filled = chunk->len = chunk->nr_stamps = chunk->log_len = 0;
+	if (prev && prev->filled > prev->len) {
+		chunk->data = grow(chunk->data, &chunk->size, prev->filled - prev->len, 1);
+		memcpy(chunk->data, prev->data + prev->len, prev->filled - prev->len);
+		chunk->filled = prev->filled - prev->len;
+	}
+}
 
-	ret = fseek(fp, 0, SEEK_END);
-	if (ret < 0)
-		return ret;
-	len = ftell(fp);
-	if (ret < 0)
-		return ret;
-	ret = fseek(fp, 0, SEEK_SET);
-	if (ret < 0)
-		return ret;
+/*
+ * Make the next chunk, which starts with what the previous one left. 1 is
+ * returned if it has any data, 0 at the end of the data log, and -1 on
+ * failure.
+ */
+static int make_chunk(struct chunk_t *chunk, const struct chunk_t *prev)
+{
+	uint64_t split, target;
+	size_t from;
+	uint8_t *delim;
+
+	start_chunk(chunk, prev);
 
-	return len;
+	// The chunk ends with the frames of the first record after the target
+	target = chunk->base + CHUNK_SIZE;
+	while (stamp_valid && stamp.offset < target)
+		if (add_stamp(chunk) < 0)
+			return -1;
+	split = target;
+	if (stamp_valid) {
+		split = stamp.offset;
+		if (add_stamp(chunk) < 0)
+			return -1;
+	}
+
+	// Right after the delimiter before the first frame starting from there
+	from = split > chunk->base ? split - 1 - chunk->base : 0;
+	for (;;) {
+		if (fill_chunk(chunk, from + READ_SIZE) < 0)
+			return -1;
+		delim = from < chunk->filled ? memchr(chunk->data + from, 0x7e, chunk->filled - from) :
+			NULL;
+		if (delim) {
+			chunk->len = delim + 1 - chunk->data;
+			break;
+		}
+		if (data_eof || chunk->filled - from > MAX_FRAME_LEN) {
+			chunk->len = chunk->filled;
+			break;
+		}
+		if (from < chunk->filled)
+			from = chunk->filled;
+	}
+	chunk->last = data_eof && chunk->len == chunk->filled;
+	return chunk->len > 0;
 }
 
-static size_t count_characters(const char *start, const char *end, char c)
+static int index_open(struct out_index_t *index, const char *out_path)
 {
-	size_t i = 0;
-	while (start != end)
-		i += (*start++ == c);
-	return i;
+	memset(index, 0, sizeof(*index));
+	snprintf(index->path, sizeof(index->path), "%s.idx", out_path);
+	index->fp = fopen(index->path, "w+b");
+	if (!index->fp) {
+		printf("Cannot open index %s for writing\n", index->path);
+		return -2;
+	}
+	index->header.magic = STAMP_INDEX_MAGIC;
+	index->header.version = STAMP_INDEX_VERSION;
+	index->header.granularity = index_granularity;
+	index->header.min_stamp = UINT64_MAX;
+	// Written again once the stamps are known
+	fwrite(&index->header, sizeof(index->header), 1, index->fp);
+	return 0;
 }
 
-static uint64_t stamp_posix2qualcomm(uint64_t posix)
+static void index_add(struct out_index_t *index, uint64_t offset, uint64_t stamp)
 {
-	uint64_t seconds = posix / 1000000000;
-	uint64_t remained = posix % 1000000000;
-	seconds -= 315936000;
-	remained *= 52428800;
-	remained /= 1000000000;
-	return seconds * 52428800 + remained;
+	if (!index->has_entry || offset >= index->next) {
+		if (index->has_entry) {
+			fwrite(&index->entry, sizeof(index->entry), 1, index->fp);
+			++index->nr_entries;
+		}
+		index->entry.offset = offset;
+		index->entry.max_before = index->header.max_stamp;
+		index->entry.min_after = stamp;
+		index->has_entry = 1;
+		index->next = offset + index->header.granularity;
+	}
+	if (stamp < index->entry.min_after)
+		index->entry.min_after = stamp;
+	if (stamp < index->header.min_stamp)
+		index->header.min_stamp = stamp;
+	if (stamp > index->header.max_stamp)
+		index->header.max_stamp = stamp;
 }
 
-static int work(void)
+// Take the earliest stamps from each block on, going backwards
+static int index_close(struct out_index_t *index)
 {
-	ssize_t end, start, len, offset;
-	char *tmp;
-	struct stamp_log_t *stamp_log = stamps + nr_stamps;
-	uint64_t *qcom_stamp, sdiff, start_bytes;
-	int need_update;
-
-	end = data_len - 1;
-	while (end >= 0 && data[end] != 0x7e)
-		--end;
-	for (; end >= 0; end = start - 1) {
-		start = end - 1;
-		while (start >= 0 && data[start] != 0x7e)
-			--start;
-		++start;
-
-		tmp = decode_inplace(data + start);
-		if (!tmp) {
-			printf("Warning: discarding corrupted frame at %ld\n", start);
-			continue;
+	static struct stamp_index_entry_t entries[4096];
+	uint64_t min_stamp = UINT64_MAX, start, end, i;
+	size_t len;
+	off_t pos;
+	int fd, failed = 0;
+
+	if (index->has_entry) {
+		fwrite(&index->entry, sizeof(index->entry), 1, index->fp);
+		++index->nr_entries;
+	}
+	failed |= fflush(index->fp) != 0;
+	fd = fileno(index->fp);
+	for (end = index->nr_entries; end > 0 && !failed; end = start) {
+		start = end > 4096 ? end - 4096 : 0;
+		len = (end - start) * sizeof(entries[0]);
+		pos = sizeof(index->header) + start * sizeof(entries[0]);
+		if (pread(fd, entries, len, pos) != len) {
+			failed = 1;
+			break;
 		}
-		end = tmp - data;
-		len = end - start;
-
-		offset = 0;
-		if (len >= 8) {
-			start_bytes = *(uint64_t *)&data[start];
-			if (start_bytes == 0x200000198 || start_bytes == 0x100000198)
-				offset = 8;
+		for (i = end - start; i-- > 0;) {
+			if (entries[i].min_after < min_stamp)
+				min_stamp = entries[i].min_after;
+			entries[i].min_after = min_stamp;
 		}
-		if (len < offset + 2 || data[start + offset] != 0x10) {
-			printf("Warning: discarding unsupported frame at %ld\n", start);
-			continue;
+		failed |= pwrite(fd, entries, len, pos) != len;
+	}
+	if (!failed)
+		failed |= pwrite(fd, &index->header, sizeof(index->header), 0) != sizeof(index->header);
+	failed |= fclose(index->fp) != 0;
+	index->fp = NULL;
+	if (failed) {
+		printf("Failed to write into index %s\n", index->path);
+		return -1;
+	}
+	return 0;
+}
+
+// The output of each segment is closed once its last chunk is written
+static int close_output(struct segment_t *segment)
+{
+	int ret = 0, failed = 0;
+
+	if (segment->out_fp && segment->out_fp != out_fp)
+		failed = fclose(segment->out_fp) != 0;
+	else if (segment->out_fp)
+		failed = fflush(segment->out_fp) != 0;
+	segment->out_fp = NULL;
+	if (failed) {
+		printf("Failed to write into output log %s\n", segment->out_path);
+		ret = -1;
+	}
+	if (segment->stamp_index && segment->stamp_index != &out_index) {
+		if (index_close(segment->stamp_index) < 0)
+			ret = -1;
+		free(segment->stamp_index);
+	}
+	segment->stamp_index = NULL;
+	return ret;
+}
+
+static struct split_out_t *split_open(uint16_t code)
+{
+	struct split_out_t *split;
+	char name[16];
+	size_t i;
+
+	snprintf(name, sizeof(name), "0x%04x", code);
+	for (i = 0; i < nr_split_groups; ++i) {
+		if (code >= split_groups[i].first && code <= split_groups[i].last)
+			break;
+	}
+	split = malloc(sizeof(struct split_out_t));
+	if (!split) {
+		printf("Cannot allocate memory for generating output log\n");
+		return NULL;
+	}
+	snprintf(split->path, sizeof(split->path), "%s/%s.dlog", split_dir,
+		 i < nr_split_groups ? split_groups[i].name : name);
+	// The codes of a group share the file of the first one seen
+	for (i = 0; i < nr_split_outs; ++i) {
+		if (!strcmp(split_list[i]->path, split->path)) {
+			free(split);
+			return split_list[i];
 		}
-		offset += 2;
+	}
 
-		if (len < offset + 6 + 8) {
-			printf("Warning: frame at %ld is too short, which should never happen\n", start);
-			continue;
+	split->index = NULL;
+	split->fp = fopen(split->path, "wb");
+	if (!split->fp) {
+		printf("Cannot open output log %s for writing\n", split->path);
+		free(split);
+		return NULL;
+	}
+	setvbuf(split->fp, NULL, _IOFBF, SPLIT_BUF_SIZE);
+	split_list = grow(split_list, &max_split_outs, nr_split_outs + 1,
+			  sizeof(struct split_out_t *));
+	split_list[nr_split_outs++] = split;
+	if (indexing) {
+		split->index = malloc(sizeof(struct out_index_t));
+		if (!split->index || index_open(split->index, split->path) < 0) {
+			free(split->index);
+			split->index = NULL;
+			return NULL;
 		}
-		qcom_stamp = (uint64_t *)&data[start + offset + 6];
+	}
+	return split;
+}
+
+// Route the corrected frames of the chunk by their log codes
+static int split_chunk(struct chunk_t *chunk)
+{
+	const struct out_frame_t *frame;
+	struct split_out_t *split;
+	size_t i, len;
 
-		need_update = 0;
-		while (stamp_log != stamps && stamp_log[-1].offset > start) {
-			--stamp_log;
-			need_update = 1;
+	for (i = 0, frame = chunk->out_frames; i < chunk->nr_out_frames; ++i, ++frame) {
+		len = (i + 1 < chunk->nr_out_frames ? frame[1].pos : chunk->out_len) - frame->pos;
+		split = split_outs[frame->code];
+		if (!split) {
+			split = split_open(frame->code);
+			if (!split)
+				return -1;
+			split_outs[frame->code] = split;
 		}
-		if (stamp_log == stamps + nr_stamps) {
-			printf("Warning: discarding tailing frame at %ld\n", start);
-			continue;
+		if (fwrite(chunk->out + frame->pos, 1, len, split->fp) != len) {
+			printf("Failed to write into output log %s\n", split->path);
+			return -1;
+		}
+		if (split->index) {
+			index_add(split->index, split->index->offset, frame->stamp);
+			split->index->offset += len;
+		}
+	}
+	return 0;
+}
+
+static int close_splits(void)
+{
+	struct split_out_t *split;
+	int ret = 0;
+	size_t i;
+
+	for (i = 0; i < nr_split_outs; ++i) {
+		split = split_list[i];
+		if (fclose(split->fp) != 0) {
+			printf("Failed to write into output log %s\n", split->path);
+			ret = -1;
 		}
-		if (need_update)
-			sdiff = stamp_posix2qualcomm(stamp_log->stamp) - *qcom_stamp;
-		*qcom_stamp += sdiff;
+		if (split->index && index_close(split->index) < 0)
+			ret = -1;
+		free(split->index);
+		free(split);
+	}
+	nr_split_outs = 0;
+	return ret;
+}
+
+static int open_split_dir(const char *path)
+{
+	struct stat st;
 
-		out_current = encode_reversed(data + start, data + end, out_current);
+	if (mkdir(path, 0755) < 0 && (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))) {
+		printf("Cannot create output directory %s\n", path);
+		return -2;
 	}
+	split_dir = path;
+	return 0;
+}
 
-	len = out_end - out_current;
-	if (len != fwrite(out_current, 1, len, out_fp)) {
-		printf("Failed to write into output log\n");
-		return 1;
+/*
+ * Parse CODES=NAME of -c, where CODES is a comma separated list of log codes
+ * and ranges of them, such as 0xb0c0-0xb0cf,0xb193=lte_rrc.
+ */
+static int parse_split_group(char *spec)
+{
+	char *name = strrchr(spec, '='), *range, *end;
+	unsigned long first, last;
+
+	if (!name || name == spec || !name[1] || strchr(name, '/'))
+		return -1;
+	*name++ = '\0';
+	for (range = strtok(spec, ","); range; range = strtok(NULL, ",")) {
+		if (nr_split_groups == MAX_SPLIT_GROUPS)
+			return -1;
+		first = last = strtoul(range, &end, 0);
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 0);
+		if (end == range || *end != '\0' || last < first || last > UINT16_MAX)
+			return -1;
+		split_groups[nr_split_groups].first = first;
+		split_groups[nr_split_groups].last = last;
+		split_groups[nr_split_groups++].name = name;
 	}
 	return 0;
 }
 
-int main(int argc, char **argv)
+static void stats_add_second(uint64_t stamp, uint32_t len)
+{
+	uint64_t second = diag_stamp_to_posix(stamp) / 1000000000;
+	struct stats_count_t *count = &stats_outside;
+	size_t shift, needed;
+
+	if (nr_stats_seconds == 0)
+		stats_base = second;
+	if (second < stats_base && stats_base - second + nr_stats_seconds <= MAX_STATS_SECONDS) {
+		shift = stats_base - second;
+		stats_seconds = grow(stats_seconds, &max_stats_seconds, nr_stats_seconds + shift,
+				     sizeof(struct stats_count_t));
+		memmove(stats_seconds + shift, stats_seconds,
+			nr_stats_seconds * sizeof(struct stats_count_t));
+		memset(stats_seconds, 0, shift * sizeof(struct stats_count_t));
+		nr_stats_seconds += shift;
+		stats_base = second;
+	} else if (second >= stats_base && second - stats_base >= nr_stats_seconds &&
+		   second - stats_base < MAX_STATS_SECONDS) {
+		needed = second - stats_base + 1;
+		stats_seconds = grow(stats_seconds, &max_stats_seconds, needed,
+				     sizeof(struct stats_count_t));
+		memset(stats_seconds + nr_stats_seconds, 0,
+		       (needed - nr_stats_seconds) * sizeof(struct stats_count_t));
+		nr_stats_seconds = needed;
+	}
+	if (second >= stats_base && second - stats_base < nr_stats_seconds)
+		count = &stats_seconds[second - stats_base];
+	++count->frames;
+	count->bytes += len;
+}
+
+static int stats_chunk(struct chunk_t *chunk)
+{
+	const struct out_frame_t *frame;
+	size_t i;
+
+	for (i = 0; i < NR_DISCARDS; ++i)
+		stats_discarded[i] += chunk->discarded[i];
+	for (i = 0, frame = chunk->out_frames; i < chunk->nr_out_frames; ++i, ++frame) {
+		++stats_codes[frame->code].frames;
+		stats_codes[frame->code].bytes += frame->len;
+		if (frame->stamp < stats_min_stamp)
+			stats_min_stamp = frame->stamp;
+		if (frame->stamp > stats_max_stamp)
+			stats_max_stamp = frame->stamp;
+		stats_add_second(frame->stamp, frame->len);
+	}
+	return 0;
+}
+
+// The busiest log codes first
+static int compare_codes(const void *a, const void *b)
+{
+	const struct stats_count_t *x = &stats_codes[*(const uint16_t *) a];
+	const struct stats_count_t *y = &stats_codes[*(const uint16_t *) b];
+
+	if (x->bytes != y->bytes)
+		return x->bytes > y->bytes ? -1 : 1;
+	return *(const uint16_t *) a - *(const uint16_t *) b;
+}
+
+// The rate of a code, or all of them, over the span of the stamps
+static double stats_rate(uint64_t frames)
+{
+	uint64_t span = stats_max_stamp - stats_min_stamp;
+
+	return span > 0 ? frames / ((double) span / DIAG_STAMP_PER_SECOND) : 0;
+}
+
+static void write_stats_csv(FILE *fp, const uint16_t *codes, size_t nr_codes,
+			    const struct stats_count_t *total, uint64_t first, uint64_t last)
+{
+	const struct stats_count_t *count;
+	size_t i;
+
+	fprintf(fp, "type,key,frames,bytes,rate\n");
+	fprintf(fp, "total,,%llu,%llu,%.3f\n", (unsigned long long) total->frames,
+		(unsigned long long) total->bytes, stats_rate(total->frames));
+	fprintf(fp, "first,%llu.%09llu,,,\n", (unsigned long long) (first / 1000000000),
+		(unsigned long long) (first % 1000000000));
+	fprintf(fp, "last,%llu.%09llu,,,\n", (unsigned long long) (last / 1000000000),
+		(unsigned long long) (last % 1000000000));
+	for (i = 0; i < NR_DISCARDS; ++i)
+		fprintf(fp, "discarded,%s,%llu,,\n", discard_names[i],
+			(unsigned long long) stats_discarded[i]);
+	for (i = 0; i < nr_codes; ++i) {
+		count = &stats_codes[codes[i]];
+		fprintf(fp, "code,0x%04x,%llu,%llu,%.3f\n", codes[i], (unsigned long long) count->frames,
+			(unsigned long long) count->bytes, stats_rate(count->frames));
+	}
+	for (i = 0; i < nr_stats_seconds; ++i)
+		fprintf(fp, "second,%llu,%llu,%llu,\n", (unsigned long long) (stats_base + i),
+			(unsigned long long) stats_seconds[i].frames,
+			(unsigned long long) stats_seconds[i].bytes);
+	if (stats_outside.frames > 0)
+		fprintf(fp, "second,outside,%llu,%llu,\n", (unsigned long long) stats_outside.frames,
+			(unsigned long long) stats_outside.bytes);
+}
+
+static void write_stats_json(FILE *fp, const uint16_t *codes, size_t nr_codes,
+			     const struct stats_count_t *total, uint64_t first, uint64_t last)
 {
+	const struct stats_count_t *count;
+	size_t i;
+
+	fprintf(fp, "{\n  \"frames\": %llu,\n  \"bytes\": %llu,\n  \"rate\": %.3f,\n",
+		(unsigned long long) total->frames, (unsigned long long) total->bytes,
+		stats_rate(total->frames));
+	fprintf(fp, "  \"first\": %llu.%09llu,\n", (unsigned long long) (first / 1000000000),
+		(unsigned long long) (first % 1000000000));
+	fprintf(fp, "  \"last\": %llu.%09llu,\n", (unsigned long long) (last / 1000000000),
+		(unsigned long long) (last % 1000000000));
+	fprintf(fp, "  \"discarded\": {");
+	for (i = 0; i < NR_DISCARDS; ++i)
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", discard_names[i],
+			(unsigned long long) stats_discarded[i]);
+	fprintf(fp, "},\n  \"codes\": [");
+	for (i = 0; i < nr_codes; ++i) {
+		count = &stats_codes[codes[i]];
+		fprintf(fp, "%s\n    {\"code\": \"0x%04x\", \"frames\": %llu, \"bytes\": %llu, "
+			"\"rate\": %.3f}", i ? "," : "", codes[i], (unsigned long long) count->frames,
+			(unsigned long long) count->bytes, stats_rate(count->frames));
+	}
+	fprintf(fp, "\n  ],\n  \"seconds\": [");
+	for (i = 0; i < nr_stats_seconds; ++i)
+		fprintf(fp, "%s\n    {\"time\": %llu, \"frames\": %llu, \"bytes\": %llu}",
+			i ? "," : "", (unsigned long long) (stats_base + i),
+			(unsigned long long) stats_seconds[i].frames,
+			(unsigned long long) stats_seconds[i].bytes);
+	fprintf(fp, "\n  ],\n  \"outside\": {\"frames\": %llu, \"bytes\": %llu}\n}\n",
+		(unsigned long long) stats_outside.frames, (unsigned long long) stats_outside.bytes);
+}
+
+static int write_stats(void)
+{
+	static uint16_t codes[65536];
+	struct stats_count_t total = { 0, 0 };
+	uint64_t first = 0, last = 0;
+	size_t nr_codes = 0, i;
+	FILE *fp;
 	int ret;
 
-	if (argc != 4) {
-		printf("Usage: %s [data log] [stamp log] [output log]\n", argv[0]);
+	for (i = 0; i < 65536; ++i) {
+		if (stats_codes[i].frames == 0)
+			continue;
+		codes[nr_codes++] = i;
+		total.frames += stats_codes[i].frames;
+		total.bytes += stats_codes[i].bytes;
+	}
+	qsort(codes, nr_codes, sizeof(codes[0]), compare_codes);
+	if (total.frames > 0) {
+		first = diag_stamp_to_posix(stats_min_stamp);
+		last = diag_stamp_to_posix(stats_max_stamp);
+	}
+
+	fp = strcmp(stats_path, "-") ? fopen(stats_path, "w") : stdout;
+	if (!fp) {
+		printf("Cannot open statistics %s for writing\n", stats_path);
+		return -2;
+	}
+	if (stats_format == STATS_CSV)
+		write_stats_csv(fp, codes, nr_codes, &total, first, last);
+	else
+		write_stats_json(fp, codes, nr_codes, &total, first, last);
+	ret = fp == stdout ? fflush(fp) : fclose(fp);
+	if (ret != 0) {
+		printf("Failed to write into statistics %s\n", stats_path);
+		return -3;
+	}
+	return 0;
+}
+
+static int write_chunk(struct chunk_t *chunk)
+{
+	struct segment_t *segment = chunk->segment;
+	struct out_index_t *index = segment->stamp_index;
+	size_t i;
+
+	// The warnings are only counted then
+	if (stats_format)
+		return stats_chunk(chunk);
+
+	// The warnings of a batch are under the segment they are about
+	if (batch_out_path || batch_out_dir) {
+		if (chunk->log_len > 0 && !segment->reported)
+			printf("%s:\n", segment->data_path);
+		segment->reported |= chunk->log_len > 0;
+	}
+	fwrite(chunk->log, 1, chunk->log_len, stdout);
+	if (splitting)
+		return split_chunk(chunk);
+	if (fwrite(chunk->out, 1, chunk->out_len, segment->out_fp) != chunk->out_len) {
+		printf("Failed to write into output log %s\n", segment->out_path);
 		return -1;
 	}
+	if (index) {
+		for (i = 0; i < chunk->nr_out_frames; ++i)
+			index_add(index, index->offset + chunk->out_frames[i].pos,
+				  chunk->out_frames[i].stamp);
+		index->offset += chunk->out_len;
+	}
+	return chunk->last ? close_output(segment) : 0;
+}
 
-	data_fp = fopen(argv[1], "rb");
+static int start_workers(void)
+{
+	int i, ret;
+
+	// Enough chunks to keep the workers busy while the oldest one is written
+	nr_chunks = 2 * nr_threads;
+	chunks = calloc(nr_chunks, sizeof(struct chunk_t));
+	workers = calloc(nr_threads, sizeof(struct worker_t));
+	if (!chunks || !workers) {
+		printf("Cannot allocate memory for generating output log\n");
+		return -5;
+	}
+	if (nr_threads == 1)
+		return 0;
+	for (i = 0; i < nr_threads; ++i) {
+		ret = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+		if (ret != 0) {
+			printf("Failed to create worker thread (%s)\n", strerror(ret));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void stop_workers(void)
+{
+	int i;
+
+	if (nr_threads == 1)
+		return;
+	pthread_mutex_lock(&chunk_lock);
+	workers_stopping = 1;
+	pthread_cond_broadcast(&chunk_queued);
+	pthread_mutex_unlock(&chunk_lock);
+	for (i = 0; i < nr_threads; ++i)
+		pthread_join(workers[i].thread, NULL);
+}
+
+static void wait_chunk(struct chunk_t *chunk)
+{
+	pthread_mutex_lock(&chunk_lock);
+	while (!chunk->done)
+		pthread_cond_wait(&chunk_done, &chunk_lock);
+	pthread_mutex_unlock(&chunk_lock);
+}
+
+static void close_segment(void)
+{
+	if (data_reader.compressed)
+		lz4_stream_free(&data_reader.lz4);
+	if (stamp_reader.compressed)
+		lz4_stream_free(&stamp_reader.lz4);
+	data_reader.compressed = stamp_reader.compressed = 0;
+	if (data_fp)
+		fclose(data_fp);
+	if (stamp_fp)
+		fclose(stamp_fp);
+	data_fp = stamp_fp = NULL;
+}
+
+static int open_segment(struct segment_t *segment)
+{
+	close_segment();
+	data_eof = stamp_valid = message_stamps = 0;
+	memset(&stamp_batch, 0, sizeof(stamp_batch));
+	stamp_msg_id = 0;
+
+	data_fp = fopen(segment->data_path, "rb");
 	if (!data_fp) {
-		printf("Cannot open data log %s for reading\n", argv[1]);
+		printf("Cannot open data log %s for reading\n", segment->data_path);
 		return -2;
 	}
-	stamp_fp = fopen(argv[2], "rb");
+	stamp_fp = fopen(segment->stamp_path, "rb");
 	if (!stamp_fp) {
-		printf("Cannot open stamp log %s for reading\n", argv[2]);
+		printf("Cannot open stamp log %s for reading\n", segment->stamp_path);
 		return -2;
 	}
-	out_fp = fopen(argv[3], "wb");
-	if (!out_fp) {
-		printf("Cannot open output log %s for writing\n", argv[3]);
+	if (splitting || stats_format)
+		goto out;
+	segment->out_fp = out_fp ? out_fp : fopen(segment->out_path, "wb");
+	if (!segment->out_fp) {
+		printf("Cannot open output log %s for writing\n", segment->out_path);
 		return -2;
 	}
+	if (indexing && out_fp) {
+		segment->stamp_index = &out_index;
+	} else if (indexing) {
+		segment->stamp_index = malloc(sizeof(struct out_index_t));
+		if (!segment->stamp_index) {
+			printf("Cannot allocate memory for generating output log\n");
+			return -5;
+		}
+		if (index_open(segment->stamp_index, segment->out_path) < 0) {
+			free(segment->stamp_index);
+			segment->stamp_index = NULL;
+			return -2;
+		}
+	}
 
-	data_len = get_file_size(data_fp);
-	if (data_len <= 0) {
-		printf("Cannot get file size for data log %s\n", argv[1]);
-		return -3;
+out:
+	// The logs may still be empty, so they are opened once they are not
+	if (following)
+		return 0;
+	if (reader_open(&data_reader, data_fp) < 0) {
+		printf("Failed to read from data log %s\n", segment->data_path);
+		return -4;
 	}
+	if (open_stamps() < 0) {
+		printf("Failed to read from stamp log %s\n", segment->stamp_path);
+		return -4;
+	}
+	return 0;
+}
 
-	nr_stamps = get_file_size(stamp_fp) / sizeof(struct stamp_log_t);
-	if (nr_stamps <= 0) {
-		printf("Cannot get file size for stamp log %s\n", argv[2]);
-		return -3;
+// Wait for the oldest chunk to be corrected, or correct it without workers
+static int finish_chunk(struct chunk_t *chunk)
+{
+	if (nr_threads > 1)
+		wait_chunk(chunk);
+	else
+		correct_chunk(&workers[0], chunk);
+	return write_chunk(chunk);
+}
+
+static void follow_stop(int sig)
+{
+	follow_stopping = 1;
+}
+
+/*
+ * Open the readers once the logs have anything, since it takes the start of
+ * each to tell its format. 1 is returned once they are open, 0 if the logs
+ * are not there yet, and -4 if they cannot be followed.
+ */
+static int follow_open(struct segment_t *segment)
+{
+	struct stat data_st, stamp_st;
+
+	if (fstat(fileno(data_fp), &data_st) < 0 || fstat(fileno(stamp_fp), &stamp_st) < 0) {
+		printf("Failed to read from data log %s\n", segment->data_path);
+		return -4;
+	}
+	if (data_st.st_size < 4 || stamp_st.st_size < sizeof(struct stamp_log_t))
+		return 0;
+	if (reader_open(&data_reader, data_fp) < 0 || reader_open(&stamp_reader, stamp_fp) < 0 ||
+	    open_stamps() < 0) {
+		printf("Failed to read from data log %s\n", segment->data_path);
+		return -4;
 	}
+	if (data_reader.compressed || stamp_reader.compressed) {
+		printf("Compressed logs cannot be followed\n");
+		return -4;
+	}
+	return 1;
+}
 
-	data = malloc(data_len);
-	stamps = malloc(nr_stamps * sizeof(struct stamp_log_t));
-	if (!data || !stamps) {
-		printf("Cannot allocate enough memory for reading data log or stamp log\n");
-		return -3;
+// Read what has been appended, up to about a chunk at a time
+static int follow_fill(struct chunk_t *chunk)
+{
+	size_t filled = chunk->filled, ret;
+
+	do {
+		chunk->data = grow(chunk->data, &chunk->size, chunk->filled + READ_SIZE, 1);
+		ret = fread(chunk->data + chunk->filled, 1, chunk->size - chunk->filled, data_fp);
+		chunk->filled += ret;
+	} while (ret > 0 && chunk->filled - filled < CHUNK_SIZE);
+	clearerr(data_fp);
+	return chunk->filled > filled;
+}
+
+/*
+ * Cut the chunk as make_chunk() does, after the frames of the last stamp
+ * record which is complete in both logs so far.
+ */
+static int follow_cut(struct chunk_t *chunk)
+{
+	uint8_t *delim;
+	size_t from;
+
+	for (;;) {
+		if (!stamp_valid && next_stamp() <= 0)
+			return 0;
+		from = stamp.offset > chunk->base ? stamp.offset - 1 - chunk->base : 0;
+		delim = from < chunk->filled ? memchr(chunk->data + from, 0x7e, chunk->filled - from) :
+			NULL;
+		if (!delim)
+			return 0;
+		if (add_stamp(chunk) < 0)
+			return -1;
+		chunk->len = delim + 1 - chunk->data;
 	}
+}
 
-	if ((data_len != fread(data, 1, data_len, data_fp)) ||
-	    (nr_stamps != fread(stamps, sizeof(struct stamp_log_t), nr_stamps, stamp_fp))) {
-		printf("Failed to read from data log or stamp log\n");
-		return -4;
+static int follow_watch(const struct segment_t *segment, int *stamp_wd)
+{
+	uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+	int fd;
+
+	fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd < 0 || inotify_add_watch(fd, segment->data_path, mask) < 0 ||
+	    (*stamp_wd = inotify_add_watch(fd, segment->stamp_path, mask)) < 0) {
+		printf("Cannot watch %s and %s\n", segment->data_path, segment->stamp_path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
 	}
+	return fd;
+}
 
-	out_remained = count_characters(data, data + data_len, 0x7e) * 8;
-	out_start = malloc(data_len + out_remained);
-	if (!out_start) {
-		printf("Cannot allocate memory for generating output log\n");
-		return -5;
+/*
+ * Wait for the logs to change. They are finished once the stamp log, which
+ * diag_logcat closes after the data log, is closed by a writer, or either
+ * one is removed or renamed.
+ */
+static void follow_wait(int fd, int stamp_wd, int *finishing)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	ssize_t len;
+	char *p;
+
+	if (poll(&pfd, 1, FOLLOW_POLL_MS) <= 0)
+		return;
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) p;
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+				*finishing = 1;
+			if ((event->mask & IN_CLOSE_WRITE) && event->wd == stamp_wd)
+				*finishing = 1;
+		}
+	}
+}
+
+static void follow_flush(struct segment_t *segment)
+{
+	size_t i;
+
+	fflush(stdout);
+	if (segment->out_fp)
+		fflush(segment->out_fp);
+	for (i = 0; i < nr_split_outs; ++i)
+		fflush(split_list[i]->fp);
+}
+
+/*
+ * Correct the logs as they grow, with two chunks in turn on the main thread,
+ * so that each frame is written out as soon as a stamp record covers it.
+ * What no record covers in the end is left as the tail of a complete log is.
+ */
+static int follow(struct segment_t *segment)
+{
+	struct chunk_t *chunk = &chunks[0], *prev = &chunks[1], *tmp;
+	struct sigaction sa;
+	int fd = -1, stamp_wd, opened = 0, finishing = 0, progress, ret;
+
+	ret = open_segment(segment);
+	if (ret < 0)
+		goto fail;
+	fd = follow_watch(segment, &stamp_wd);
+	if (fd < 0) {
+		ret = -1;
+		goto fail;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = follow_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	start_chunk(chunk, NULL);
+	chunk->segment = segment;
+	for (;;) {
+		finishing |= follow_stopping;
+		if (!opened) {
+			ret = follow_open(segment);
+			if (ret < 0)
+				goto fail;
+			opened = ret;
+		}
+		for (progress = opened; progress;) {
+			progress = follow_fill(chunk);
+			if (follow_cut(chunk) < 0) {
+				ret = -1;
+				goto fail;
+			}
+			if (chunk->len == 0)
+				continue;
+			correct_chunk(&workers[0], chunk);
+			ret = write_chunk(chunk);
+			if (ret < 0)
+				goto fail;
+			follow_flush(segment);
+			tmp = prev;
+			prev = chunk;
+			chunk = tmp;
+			start_chunk(chunk, prev);
+			chunk->segment = segment;
+			progress = 1;
+		}
+		if (finishing)
+			break;
+		follow_wait(fd, stamp_wd, &finishing);
 	}
-	out_end = out_current = out_start + data_len + out_remained;
+	close(fd);
+
+	if (!opened)
+		return close_output(segment);
+	while (stamp_valid)
+		if (add_stamp(chunk) < 0)
+			return -1;
+	chunk->len = chunk->filled;
+	chunk->last = 1;
+	correct_chunk(&workers[0], chunk);
+	return write_chunk(chunk);
+fail:
+	if (fd >= 0)
+		close(fd);
+	close_output(segment);
+	return ret;
+}
+
+/*
+ * The chunks are made and written in order by the main thread, while the
+ * workers correct them in between. The segments go through one after the
+ * other, so the workers are kept busy across them. A segment which cannot
+ * be read is skipped, and its error is returned at the end.
+ */
+static int work(void)
+{
+	struct chunk_t *chunk, *prev;
+	size_t made = 0, written = 0, i;
+	int ret, failed = 0;
+
+	ret = start_workers();
+	if (ret < 0)
+		return ret;
+	if (following) {
+		ret = follow(&segments[0]);
+		goto out;
+	}
+
+	for (i = 0; i < nr_segments; ++i) {
+		ret = open_segment(&segments[i]);
+		if (ret < 0) {
+			failed = ret;
+			if (segments[i].out_fp)
+				close_output(&segments[i]);
+			continue;
+		}
 
+		for (prev = NULL;; prev = chunk) {
+			chunk = &chunks[made % nr_chunks];
+			// A slot is reused once its chunk is written
+			if (made - written == nr_chunks) {
+				ret = finish_chunk(chunk);
+				++written;
+				if (ret < 0)
+					goto out;
+			}
+			ret = make_chunk(chunk, prev);
+			if (ret <= 0)
+				break;
+			chunk->segment = &segments[i];
+			++made;
+
+			pthread_mutex_lock(&chunk_lock);
+			chunk->done = 0;
+			if (nr_threads > 1) {
+				++chunks_queued;
+				pthread_cond_signal(&chunk_queued);
+			}
+			pthread_mutex_unlock(&chunk_lock);
+		}
+		if (ret < 0)
+			failed = 1;
+		// The end of the log may only be found after its last chunk
+		if (prev)
+			prev->last = 1;
+		else
+			close_output(&segments[i]);
+	}
+	ret = 0;
+
+out:
+	for (; written < made; ++written) {
+		if (ret >= 0)
+			ret = finish_chunk(&chunks[written % nr_chunks]);
+		else if (nr_threads > 1)
+			wait_chunk(&chunks[written % nr_chunks]);
+	}
+	stop_workers();
+	close_segment();
+
+	if (ret < 0)
+		return 1;
+	if (out_fp && fclose(out_fp) != 0) {
+		printf("Failed to write into output log %s\n", batch_out_path);
+		return 1;
+	}
+	if (out_index.fp && index_close(&out_index) < 0)
+		return 1;
+	if (close_splits() < 0)
+		return 1;
+	if (stats_format && write_stats() < 0)
+		return 1;
+	return failed;
+}
+
+/*
+ * Parse a data log name, PREFIX.NNNN.dlog, into its prefix and its index,
+ * which may have more than 4 digits. 0 is returned if it is not one.
+ */
+static int parse_segment_name(const char *name, char *prefix, const char **digits)
+{
+	size_t len = strlen(name);
+	const char *end, *p;
+
+	if (len < 5 || strcmp(name + len - 5, ".dlog"))
+		return 0;
+	end = p = name + len - 5;
+	while (p > name && isdigit((unsigned char) p[-1]))
+		--p;
+	if (end - p < 4 || p - name < 2 || p[-1] != '.')
+		return 0;
+	memcpy(prefix, name, p - 1 - name);
+	prefix[p - 1 - name] = '\0';
+	*digits = p;
+	return 1;
+}
+
+// The stamp of the first record, to sort the segments by, or UINT64_MAX
+static uint64_t read_first_stamp(const char *path)
+{
+	struct log_reader_t reader;
+	struct stamp_log_t first;
+	struct stamp_batch_t batch;
+	uint64_t ret = UINT64_MAX;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return ret;
+	if (reader_open(&reader, fp) < 0 || reader_read(&reader, &first, sizeof(first)) != sizeof(first))
+		goto out;
+	ret = first.stamp;
+	if (first.offset == STAMP_LOG_MAGIC_OFFSET && first.stamp == STAMP_LOG_MAGIC_V2)
+		ret = reader_read(&reader, &batch, sizeof(batch)) == sizeof(batch) ? batch.stamp : UINT64_MAX;
+out:
+	if (reader.compressed)
+		lz4_stream_free(&reader.lz4);
+	fclose(fp);
+	return ret;
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+	const struct segment_t *x = a, *y = b;
+
+	if (x->first_stamp != y->first_stamp)
+		return x->first_stamp < y->first_stamp ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Find the segments of a capture, either all the ones in a directory or the
+ * ones of a data log prefix, with their stamp logs next to them or under
+ * their own prefix. They are sorted by their first stamp, since diag_logcat
+ * may reuse the segments in turn.
+ */
+static int find_segments(const char *path, const char *stamp_prefix)
+{
+	char dir_buf[FILENAME_MAX], base_buf[FILENAME_MAX], prefix[FILENAME_MAX];
+	const char *dir = path, *base = NULL, *digits;
+	struct segment_t *segment;
+	struct dirent *entry;
+	struct stat st, out_st;
+	size_t max_segments = 0;
+	DIR *d;
+
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+		snprintf(base_buf, sizeof(base_buf), "%s", path);
+		dir = dirname(dir_buf);
+		base = basename(base_buf);
+	}
+	if (batch_out_dir && stat(dir, &st) == 0 && stat(batch_out_dir, &out_st) == 0 &&
+	    st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino) {
+		printf("The corrected segments cannot be written next to the data logs\n");
+		return -1;
+	}
+	d = opendir(dir);
+	if (!d) {
+		printf("Cannot open directory %s\n", dir);
+		return -2;
+	}
+
+	while ((entry = readdir(d)) != NULL) {
+		if (!parse_segment_name(entry->d_name, prefix, &digits))
+			continue;
+		if (base && strcmp(base, prefix))
+			continue;
+
+		segments = grow(segments, &max_segments, nr_segments + 1, sizeof(struct segment_t));
+		segment = &segments[nr_segments];
+		memset(segment, 0, sizeof(*segment));
+		segment->index = strtoul(digits, NULL, 10);
+		snprintf(segment->data_path, FILENAME_MAX, "%s/%s", dir, entry->d_name);
+		strcpy(segment->stamp_path, segment->data_path);
+		if (stamp_prefix)
+			snprintf(segment->stamp_path, FILENAME_MAX, "%s.%.*s.tlog", stamp_prefix,
+				 (int) strcspn(digits, "."), digits);
+		else
+			memcpy(segment->stamp_path + strlen(segment->data_path) - 4, "tlog", 4);
+		if (access(segment->stamp_path, R_OK) < 0) {
+			printf("Warning: skipping %s, which has no stamp log %s\n",
+			       segment->data_path, segment->stamp_path);
+			continue;
+		}
+		if (batch_out_dir)
+			snprintf(segment->out_path, FILENAME_MAX, "%s/%s", batch_out_dir, entry->d_name);
+		else
+			snprintf(segment->out_path, FILENAME_MAX, "%s", batch_out_path);
+		segment->first_stamp = read_first_stamp(segment->stamp_path);
+		++nr_segments;
+	}
+	closedir(d);
+
+	if (nr_segments == 0) {
+		printf("No segments found in %s\n", path);
+		return -2;
+	}
+	qsort(segments, nr_segments, sizeof(struct segment_t), compare_segments);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [OPTIONS] [data log] [stamp log] [output log]\n"
+	       "       %s [OPTIONS] -o OUTPUT|-O DIR [DIRECTORY|DLOG PREFIX [TLOG PREFIX]]\n"
+	       "  -j THREADS  correct with this many threads, 0 for one per CPU (default: 1)\n"
+	       "  -i          index each output log by stamp into OUTPUT.idx, for extract_log\n"
+	       "  -g BYTES    bytes of output log per index entry (default: 65536)\n"
+	       "  -s          split the frames by log code into OUTPUT/0xCODE.dlog, where\n"
+	       "              OUTPUT is a directory\n"
+	       "  -c CODES=NAME\n"
+	       "              with -s, put the log codes of CODES, such as 0xb0c0-0xb0cf,0xb193,\n"
+	       "              together into OUTPUT/NAME.dlog, can be repeated\n"
+	       "  -S FORMAT   instead of correcting into OUTPUT, write the frames and bytes by\n"
+	       "              log code and by second, and the discarded frames by reason,\n"
+	       "              into it as csv or json, - for the standard output\n"
+	       "  -f          follow the logs as they grow, as tail -f does, until the stamp log\n"
+	       "              is closed by its writer, either log goes away, or interrupted\n"
+	       "  -o OUTPUT   correct all the segments of a capture, found in DIRECTORY or\n"
+	       "              by their prefixes, in order into OUTPUT\n"
+	       "  -O DIR      same, but into one file per segment in DIR, named as its data log\n",
+	       name, name);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "j:ig:sc:S:fo:O:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nr_threads = strtol(optarg, NULL, 10);
+			if (nr_threads <= 0)
+				nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+			if (nr_threads <= 0)
+				nr_threads = 1;
+			break;
+		case 'i':
+			indexing = 1;
+			break;
+		case 'g':
+			index_granularity = strtoul(optarg, NULL, 10);
+			if (index_granularity == 0)
+				index_granularity = 1;
+			break;
+		case 's':
+			splitting = 1;
+			break;
+		case 'c':
+			if (parse_split_group(optarg) < 0) {
+				printf("Invalid log code group %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'S':
+			if (!strcmp(optarg, "csv")) {
+				stats_format = STATS_CSV;
+			} else if (!strcmp(optarg, "json")) {
+				stats_format = STATS_JSON;
+			} else {
+				printf("Unknown statistics format %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'f':
+			following = 1;
+			break;
+		case 'o':
+			batch_out_path = optarg;
+			break;
+		case 'O':
+			batch_out_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (batch_out_path || batch_out_dir) {
+		if ((batch_out_path && batch_out_dir) || following ||
+		    ((splitting || stats_format) && batch_out_dir) ||
+		    argc - optind < 1 || argc - optind > 2) {
+			usage(argv[0]);
+			return -1;
+		}
+		ret = find_segments(argv[optind], argc - optind == 2 ? argv[optind + 1] : NULL);
+		if (ret < 0)
+			return ret;
+		if (stats_format) {
+			stats_path = batch_out_path;
+		} else if (splitting) {
+			ret = open_split_dir(batch_out_path);
+			if (ret < 0)
+				return ret;
+		} else if (batch_out_path) {
+			out_fp = fopen(batch_out_path, "wb");
+			if (!out_fp) {
+				printf("Cannot open output log %s for writing\n", batch_out_path);
+				return -2;
+			}
+			if (indexing && index_open(&out_index, batch_out_path) < 0)
+				return -2;
+		}
+		return work();
+	}
+
+	if (argc - optind != 3) {
+		usage(argv[0]);
+		return -1;
+	}
+	// The frames are corrected as they come, with no chunks to share out
+	if (following)
+		nr_threads = 1;
+	segments = calloc(1, sizeof(struct segment_t));
+	if (!segments)
+		return -5;
+	nr_segments = 1;
+	snprintf(segments->data_path, FILENAME_MAX, "%s", argv[optind]);
+	snprintf(segments->stamp_path, FILENAME_MAX, "%s", argv[optind + 1]);
+	snprintf(segments->out_path, FILENAME_MAX, "%s", argv[optind + 2]);
+	if (stats_format) {
+		stats_path = segments->out_path;
+	} else if (splitting) {
+		ret = open_split_dir(segments->out_path);
+		if (ret < 0)
+			return ret;
+	}
 	return work();
 }
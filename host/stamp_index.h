@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * The sidecar index of a corrected log, written by stamp_corrector -i. The
+ * log is split into blocks of whole frames, starting every granularity
+ * bytes or so, and each block has an entry. Both stamps of the entries only
+ * grow, so the blocks of a time range are found by binary search even if
+ * the frames are not quite in order.
+ */
+#define STAMP_INDEX_MAGIC	0x315844495453474cull	// "LGSTIDX1"
+#define STAMP_INDEX_VERSION	1
+
+struct stamp_index_header_t {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t granularity;
+	// The earliest and the latest stamps in the log
+	uint64_t min_stamp;
+	uint64_t max_stamp;
+};
+
+struct stamp_index_entry_t {
+	// Of the first frame of the block in the corrected log
+	uint64_t offset;
+	// The latest stamp of the frames before the block
+	uint64_t max_before;
+	// The earliest stamp of the frames from the block on
+	uint64_t min_after;
+};
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "hdlc.h"
+#include "rng.h"
+
+/*
+ * Check the CRC and HDLC kernels available on this CPU against the
+ * reference ones, and with -b show how fast they are. It is run by make test,
+ * and by make bench with -b.
+ */
+
+static uint64_t get_monotonic_timestamp(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+struct crc_engine_t {
+	const char *name;
+	uint16_t (*update)(uint16_t crc, const uint8_t *data, size_t len);
+	size_t min_len;
+};
+
+static double crc_throughput(const struct crc_engine_t *engine, const uint8_t *buf, size_t len)
+{
+	size_t total = 64 << 20, done;
+	uint64_t start = get_monotonic_timestamp();
+	volatile uint16_t sink = 0;
+
+	for (done = 0; done < total; done += len)
+		sink ^= engine->update(0xffff, buf, len);
+	return done / ((get_monotonic_timestamp() - start) / 1e9) / 1e6;
+}
+
+static const struct crc_engine_t crc_engines[] = {
+	{ "bytewise", crc16_update_bytewise, 0 },
+	{ "slice8", crc16_update_slice8, 0 },
+#ifdef CRC16_HAVE_CLMUL
+	{ "clmul", crc16_update_clmul, 16 },
+#endif
+};
+
+// The engines available on this CPU, i.e. all of them or only the first two
+static int crc_nr_engines(void)
+{
+	return crc16_has_clmul ? sizeof(crc_engines) / sizeof(crc_engines[0]) : 2;
+}
+
+/*
+ * Check every CRC engine available on this CPU against the known vectors
+ * and against the bytewise one on random data of every length and
+ * alignment.
+ */
+static int crc_self_test(void)
+{
+	static const struct {
+		const char *data;
+		uint16_t crc;
+	} vectors[] = {
+		{ "", 0x0000 },
+		{ "123456789", 0x906e },
+		{ "The quick brown fox jumps over the lazy dog", 0x9358 },
+	};
+	static uint8_t buf[65536 + 64];
+	const struct crc_engine_t *engine;
+	uint16_t expected, crc;
+	size_t i, len, offset;
+	int failed = 0, e;
+
+	printf("CRC engines:");
+	for (e = 0; e < crc_nr_engines(); ++e)
+		printf(" %s", crc_engines[e].name);
+	printf(", %s selected for %d bytes and more\n",
+	       crc16_has_clmul ? "clmul" : "slice8", CRC16_CLMUL_MIN);
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = rng_next() >> 56;
+
+	for (e = 0; e < crc_nr_engines(); ++e) {
+		engine = &crc_engines[e];
+		for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+			len = strlen(vectors[i].data);
+			if (len < engine->min_len)
+				continue;
+			crc = engine->update(0xffff, (const uint8_t *) vectors[i].data, len) ^ 0xffff;
+			if (crc != vectors[i].crc) {
+				printf("%s: \"%s\" gives %04x instead of %04x\n", engine->name,
+				       vectors[i].data, crc, vectors[i].crc);
+				++failed;
+			}
+		}
+
+		// A frame followed by its CRC always leaves the same residue
+		crc = engine->update(0xffff, buf, 1000) ^ 0xffff;
+		memcpy(buf + 2000, buf, 1000);
+		buf[3000] = crc & 0xff;
+		buf[3001] = crc >> 8;
+		if (engine->update(0xffff, buf + 2000, 1002) != 0xf0b8) {
+			printf("%s: wrong residue\n", engine->name);
+			++failed;
+		}
+
+		for (len = engine->min_len; len <= 4096 + 16; ++len) {
+			for (offset = 0; offset < 16; ++offset) {
+				expected = crc16_update_bytewise(len * 31, buf + offset, len);
+				crc = engine->update(len * 31, buf + offset, len);
+				if (crc != expected) {
+					printf("%s: %04x instead of %04x for %zu bytes at offset %zu\n",
+					       engine->name, crc, expected, len, offset);
+					++failed;
+				}
+			}
+		}
+		if (engine->update(0xffff, buf + 3, 65536 + 61) !=
+		    crc16_update_bytewise(0xffff, buf + 3, 65536 + 61)) {
+			printf("%s: wrong CRC for 64 KiB\n", engine->name);
+			++failed;
+		}
+	}
+	if (failed) {
+		printf("CRC self-test failed (%d errors)\n", failed);
+		return 1;
+	}
+	printf("CRC self-test passed\n");
+	return 0;
+}
+
+static void crc_bench(void)
+{
+	static uint8_t buf[65536];
+	size_t i;
+	int e;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = rng_next() >> 56;
+	printf("%-10s %14s %14s %14s\n", "engine", "64B_MB/s", "256B_MB/s", "64KiB_MB/s");
+	for (e = 0; e < crc_nr_engines(); ++e)
+		printf("%-10s %14.1f %14.1f %14.1f\n", crc_engines[e].name,
+		       crc_throughput(&crc_engines[e], buf, 64),
+		       crc_throughput(&crc_engines[e], buf, 256),
+		       crc_throughput(&crc_engines[e], buf, 65536));
+}
+
+static uint8_t *hdlc_unescape_reference(const uint8_t *in, const uint8_t *end, uint8_t *out)
+{
+	int esc = 0;
+
+	for (; in != end; ++in) {
+		if (esc) {
+			*out++ = *in ^ 0x20;
+			esc = 0;
+		} else if (*in == 0x7d) {
+			esc = 1;
+		} else {
+			*out++ = *in;
+		}
+	}
+	return out;
+}
+
+static char *hdlc_escape_reference(const uint8_t *in, size_t len, char *out)
+{
+	while (len--)
+		out = hdlc_put(out, *in++);
+	return out;
+}
+
+// Random bytes, each of which is 0x7e or 0x7d with the given probability
+static void hdlc_fill(uint8_t *buf, size_t len, unsigned int permille)
+{
+	uint64_t r;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		r = rng_next();
+		buf[i] = r >> 56;
+		if ((r >> 8) % 1000 < permille)
+			buf[i] = buf[i] & 1 ? 0x7e : 0x7d;
+		else if (buf[i] == 0x7e || buf[i] == 0x7d)
+			buf[i] = 0;
+	}
+}
+
+/*
+ * Time escaping and unescaping 64 MiB of frames of the given length, and
+ * return the MB/s of each.
+ */
+static void hdlc_throughput(const struct hdlc_kernel_t *kernel, const uint8_t *buf, size_t len,
+			    uint8_t *tmp, double *escape, double *unescape)
+{
+	size_t total = 64 << 20, done, escaped;
+	uint64_t start;
+
+	start = get_monotonic_timestamp();
+	for (done = 0; done < total; done += len)
+		escaped = kernel->escape(buf, len, (char *) tmp) - (char *) tmp;
+	*escape = done / ((get_monotonic_timestamp() - start) / 1e9) / 1e6;
+
+	start = get_monotonic_timestamp();
+	for (done = 0; done < total; done += len)
+		kernel->unescape(tmp, tmp + escaped, tmp + 2 * len);
+	*unescape = done / ((get_monotonic_timestamp() - start) / 1e9) / 1e6;
+}
+
+// Per mille of the bytes to escape
+static const unsigned int hdlc_densities[] = { 0, 8, 100, 500 };
+#define HDLC_NR_DENSITIES (sizeof(hdlc_densities) / sizeof(hdlc_densities[0]))
+
+// Check the escaping kernels available on this CPU against the byte by byte ones
+static int hdlc_self_test(void)
+{
+	static uint8_t in[4096 + 64], out[2 * sizeof(in)], ref[2 * sizeof(in)];
+	const struct hdlc_kernel_t *kernel, *selected = NULL;
+	size_t len, offset, i, d;
+	int failed = 0;
+	char *end, *ref_end;
+	uint8_t *uend, *uref_end;
+
+	printf("HDLC kernels:");
+	for (i = 0; i < HDLC_NR_KERNELS; ++i) {
+		if (!hdlc_kernels[i].available)
+			continue;
+		printf(" %s", hdlc_kernels[i].name);
+		if (hdlc_kernels[i].unescape == hdlc_unescape)
+			selected = &hdlc_kernels[i];
+	}
+	printf(", %s selected\n", selected ? selected->name : "none");
+
+	for (i = 0; i < HDLC_NR_KERNELS; ++i) {
+		kernel = &hdlc_kernels[i];
+		if (!kernel->available)
+			continue;
+		for (d = 0; d < HDLC_NR_DENSITIES; ++d) {
+			hdlc_fill(in, sizeof(in), hdlc_densities[d]);
+			for (len = 0; len <= 1100; ++len) {
+				for (offset = 0; offset < 32; ++offset) {
+					end = kernel->escape(in + offset, len, (char *) out);
+					ref_end = hdlc_escape_reference(in + offset, len, (char *) ref);
+					if (end - (char *) out != ref_end - (char *) ref ||
+					    memcmp(out, ref, end - (char *) out)) {
+						printf("%s: wrong escaping of %zu bytes\n", kernel->name, len);
+						++failed;
+					}
+					uend = kernel->unescape(in + offset, in + offset + len, out);
+					uref_end = hdlc_unescape_reference(in + offset, in + offset + len, ref);
+					if (uend - out != uref_end - ref || memcmp(out, ref, uend - out)) {
+						printf("%s: wrong unescaping of %zu bytes\n", kernel->name, len);
+						++failed;
+					}
+				}
+			}
+		}
+	}
+	if (failed) {
+		printf("HDLC self-test failed (%d errors)\n", failed);
+		return 1;
+	}
+	printf("HDLC self-test passed\n");
+	return 0;
+}
+
+// Compare how fast the kernels are for a few shares of bytes to escape
+static void hdlc_bench(void)
+{
+	static const struct hdlc_kernel_t reference = {
+		"bytewise", hdlc_unescape_reference, hdlc_escape_reference, 1
+	};
+	// Escaped into the first two thirds of out, and unescaped back into the last one
+	static uint8_t in[4096], out[3 * sizeof(in)];
+	const struct hdlc_kernel_t *kernel;
+	double escape, unescape;
+	size_t len, i, d;
+
+	printf("%-10s %10s %10s %14s %14s\n", "kernel", "frame_B", "escape_%", "escape_MB/s",
+	       "unescape_MB/s");
+	for (d = 0; d < HDLC_NR_DENSITIES - 1; ++d) {
+		hdlc_fill(in, sizeof(in), hdlc_densities[d]);
+		for (len = 256; len <= 4096; len *= 16) {
+			hdlc_throughput(&reference, in, len, out, &escape, &unescape);
+			printf("%-10s %10zu %10.1f %14.1f %14.1f\n", reference.name, len,
+			       hdlc_densities[d] / 10.0, escape, unescape);
+			for (i = 0; i < HDLC_NR_KERNELS; ++i) {
+				kernel = &hdlc_kernels[i];
+				if (!kernel->available)
+					continue;
+				hdlc_throughput(kernel, in, len, out, &escape, &unescape);
+				printf("%-10s %10zu %10.1f %14.1f %14.1f\n", kernel->name, len,
+				       hdlc_densities[d] / 10.0, escape, unescape);
+			}
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-b]\n"
+	       "Check the CRC and HDLC kernels available on this CPU against the reference ones.\n"
+	       "  -b  then show how fast they are\n",
+	       name);
+}
+
+int main(int argc, char **argv)
+{
+	int bench = 0, opt;
+
+	while ((opt = getopt(argc, argv, "b")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (crc_self_test() | hdlc_self_test())
+		return 1;
+	if (bench) {
+		crc_bench();
+		hdlc_bench();
+	}
+	return 0;
+}
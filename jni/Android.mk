@@ -3,7 +3,7 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := diag_logcat
-LOCAL_SRC_FILES := main.c diag_serial.c diag_char.c
+LOCAL_SRC_FILES := main.c common.c capture.c segment.c compress.c lz4.c stream.c filter.c correct.c command.c drain.c stats.c diag_serial.c diag_char.c diag_replay.c
 LOCAL_LDLIBS := -ldl
 
 include $(BUILD_EXECUTABLE)
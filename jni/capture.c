@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "common.h"
+#include "capture.h"
+#include "ring.h"
+#include "stream.h"
+#include "filter.h"
+#include "stats.h"
+
+static const struct diag_interface_t *capture_interface;
+static diag_handle_t capture_handle;
+
+static struct ring_t capture_ring;
+// The buffer in each slot of the ring, and the ones not in any slot
+static struct capture_buf_t **capture_slots;
+static struct capture_buf_t **capture_free;
+static unsigned int capture_nr_free;
+static size_t capture_reclaimed;
+// Used when the ring is full, so that its content is simply dropped
+static struct capture_buf_t *capture_spare;
+static sem_t capture_filled;
+// Posted for every released buffer when the capture waits instead of dropping
+static sem_t capture_released;
+static int capture_lossless;
+
+static size_t capture_buf_size, capture_max_buf_size;
+static unsigned int capture_nr_bufs, capture_max_nr_bufs;
+
+static pthread_t capture_thread;
+static volatile sig_atomic_t capture_stopping;
+static _Atomic int capture_finished;
+static int capture_error;
+
+static struct capture_buf_t *capture_alloc(size_t size)
+{
+	struct capture_buf_t *cbuf;
+
+	cbuf = malloc(sizeof(struct capture_buf_t));
+	if (!cbuf)
+		return NULL;
+	cbuf->data = malloc(size);
+	if (!cbuf->data) {
+		free(cbuf);
+		return NULL;
+	}
+	// Touch all the pages now to avoid page faults while reading
+	memset(cbuf->iov, 0, sizeof(cbuf->iov));
+	memset(cbuf->data, 0, size);
+	cbuf->size = size;
+	return cbuf;
+}
+
+/*
+ * Bring the buffer up to the current size. The old content is not needed,
+ * and the old size is kept if there is no memory for the new one.
+ */
+static void capture_resize(struct capture_buf_t *cbuf)
+{
+	char *data;
+
+	if (cbuf->size >= capture_buf_size)
+		return;
+	data = malloc(capture_buf_size);
+	if (!data)
+		return;
+	memset(data, 0, capture_buf_size);
+	free(cbuf->data);
+	cbuf->data = data;
+	cbuf->size = capture_buf_size;
+}
+
+/*
+ * Take back the buffers of the slots consumed since the last call, since
+ * the consumer is done with them.
+ */
+static void capture_reclaim(void)
+{
+	size_t consumed = ring_consumed(&capture_ring);
+	size_t idx;
+
+	for (; capture_reclaimed != consumed; ++capture_reclaimed) {
+		idx = capture_reclaimed & (capture_ring.size - 1);
+		capture_free[capture_nr_free++] = capture_slots[idx];
+		capture_slots[idx] = NULL;
+	}
+}
+
+/*
+ * Publish the filled buffer if it is in the ring. Otherwise it is the spare
+ * buffer, whose content will be simply dropped.
+ */
+static void capture_push(struct capture_buf_t *cbuf)
+{
+	if (cbuf == capture_spare)
+		return;
+	ring_produce_end(&capture_ring);
+	sem_post(&capture_filled);
+}
+
+/*
+ * Wait until the ring is not full, or the capture is stopped. The released
+ * buffers posted before the check are dropped first, so that the semaphore
+ * does not count them up forever.
+ */
+static void capture_wait_space(void)
+{
+	for (;;) {
+		while (sem_trywait(&capture_released) == 0)
+			;
+		if (ring_used(&capture_ring) < capture_ring.limit || capture_stopping)
+			return;
+		while (sem_wait(&capture_released) < 0 && errno == EINTR)
+			;
+	}
+}
+
+static struct capture_buf_t *capture_get(void)
+{
+	static int overflowing, alloc_failed;
+	struct capture_buf_t *cbuf;
+	ssize_t idx;
+
+	if (capture_lossless)
+		capture_wait_space();
+	idx = ring_produce_begin(&capture_ring);
+
+	// Only warn and grow once when the ring becomes full, not for every dropped batch
+	if (idx < 0) {
+		stats_drop();
+		if (!overflowing) {
+			LOGW("The writer is too slow, dropping logs (%zu batches dropped)\n",
+			     atomic_load_explicit(&capture_ring.overflow, memory_order_relaxed));
+			if (capture_nr_bufs < capture_max_nr_bufs) {
+				capture_nr_bufs = capture_nr_bufs * 2 < capture_max_nr_bufs ?
+						  capture_nr_bufs * 2 : capture_max_nr_bufs;
+				ring_set_limit(&capture_ring, capture_nr_bufs);
+				stats_buffers(capture_buf_size, capture_nr_bufs);
+				LOGI("Growing the capture ring to %u buffers\n", capture_nr_bufs);
+			}
+		}
+		overflowing = 1;
+		cbuf = capture_spare;
+		goto out;
+	}
+	overflowing = 0;
+
+	/*
+	 * The ring is reclaimed after it is found not full, so there are
+	 * fewer buffers in use than its limit, and new ones are allocated
+	 * only up to the limit.
+	 */
+	capture_reclaim();
+	if (capture_nr_free > 0) {
+		cbuf = capture_free[--capture_nr_free];
+	} else {
+		cbuf = capture_alloc(capture_buf_size);
+		if (!cbuf) {
+			if (!alloc_failed)
+				LOGW("Cannot allocate memory for more capture buffers\n");
+			alloc_failed = 1;
+			cbuf = capture_spare;
+			goto out;
+		}
+	}
+	capture_slots[idx] = cbuf;
+out:
+	capture_resize(cbuf);
+	return cbuf;
+}
+
+/*
+ * Grow the read buffers when the reads are saturated, since the kernel
+ * keeps the logs which do not fit, and drops them once its own buffers are
+ * full. Also report the gaps found in the message stream, which mean that
+ * it has already happened.
+ */
+static void capture_check(const struct diag_batch_t *batch)
+{
+	static int saturated, gapping;
+
+	if (batch->saturated && capture_buf_size < capture_max_buf_size) {
+		capture_buf_size = capture_buf_size * 2 < capture_max_buf_size ?
+				   capture_buf_size * 2 : capture_max_buf_size;
+		stats_buffers(capture_buf_size, capture_nr_bufs);
+		LOGI("The reads are saturated, growing the read buffers to %zu KiB\n",
+		     capture_buf_size >> 10);
+	} else if (batch->saturated && !saturated) {
+		LOGW("The reads are saturated with %zu KiB buffers, logs may be lost\n",
+		     capture_buf_size >> 10);
+	}
+	saturated = batch->saturated;
+
+	if (batch->nr_gaps > 0) {
+		stats_gap(batch->nr_gaps);
+		if (!gapping)
+			LOGW("Logs were lost before the read (%d gaps in the message stream)\n",
+			     batch->nr_gaps);
+	}
+	gapping = batch->nr_gaps > 0;
+}
+
+/*
+ * The offset from CLOCK_MONOTONIC_RAW to CLOCK_REALTIME. It is sampled at
+ * most once per second, so that the reads are timed by the raw clock via
+ * vDSO, while NTP adjustments are still followed.
+ */
+static long capture_realtime_offset(long raw)
+{
+	static long anchor = LONG_MIN, offset;
+	long before, realtime, after;
+
+	if (anchor != LONG_MIN && raw - anchor < 1000000000)
+		return offset;
+
+	before = get_monotonic_raw_timestamp();
+	realtime = get_posix_timestamp();
+	after = get_monotonic_raw_timestamp();
+	offset = realtime - before - (after - before) / 2;
+	anchor = after;
+	return offset;
+}
+
+/*
+ * The capture thread does nothing but draining the diag interface, so that
+ * storage stalls in the writer never stop the kernel buffers from being read.
+ * Each batch is read directly into a buffer of the pool, and the messages are
+ * described by its iovec array, so nothing is copied.
+ */
+static void *capture_main(void *arg)
+{
+	struct capture_buf_t *cbuf;
+	struct diag_batch_t batch;
+	ssize_t len;
+	long offset;
+
+	batch.max_iov = CAPTURE_MAX_IOV;
+	while (!capture_stopping) {
+		cbuf = capture_get();
+		batch.buf = cbuf->data;
+		batch.size = cbuf->size;
+		batch.iov = cbuf->iov;
+
+		len = (*capture_interface->read_batch)(capture_handle, &batch);
+		// The end of a replay
+		if (len == 0)
+			break;
+		if (len < 0) {
+			capture_error = -1;
+			break;
+		}
+
+		stats_read(batch.raw_len, batch.saturated, batch.nr_iov);
+		capture_check(&batch);
+		offset = capture_realtime_offset(batch.read_end);
+		cbuf->len = len;
+		cbuf->nr_iov = batch.nr_iov;
+		cbuf->stamp = batch.stamp;
+		cbuf->raw_len = batch.raw_len;
+		cbuf->read_start = batch.read_start + offset;
+		cbuf->read_end = batch.read_end + offset;
+		capture_push(cbuf);
+	}
+
+	atomic_store(&capture_finished, 1);
+	sem_post(&capture_filled);
+	return NULL;
+}
+
+int capture_start(const struct diag_interface_t *interface, diag_handle_t handle,
+		  size_t max_buf_size, unsigned int max_nr_bufs)
+{
+	size_t ring_size = 1;
+	int ret;
+
+	capture_interface = interface;
+	capture_handle = handle;
+	capture_buf_size = CAPTURE_BUF_SIZE < max_buf_size ? CAPTURE_BUF_SIZE : max_buf_size;
+	capture_max_buf_size = max_buf_size;
+	capture_nr_bufs = CAPTURE_NR_BUFS < max_nr_bufs ? CAPTURE_NR_BUFS : max_nr_bufs;
+	capture_max_nr_bufs = max_nr_bufs;
+
+	// The ring has room for the most buffers, but only uses the current number
+	while (ring_size < max_nr_bufs)
+		ring_size *= 2;
+	capture_slots = calloc(ring_size, sizeof(struct capture_buf_t *));
+	capture_free = malloc(max_nr_bufs * sizeof(struct capture_buf_t *));
+	capture_spare = capture_alloc(capture_buf_size);
+	if (!capture_slots || !capture_free || !capture_spare)
+		goto fail;
+	for (capture_nr_free = 0; capture_nr_free < capture_nr_bufs; ++capture_nr_free) {
+		capture_free[capture_nr_free] = capture_alloc(capture_buf_size);
+		if (!capture_free[capture_nr_free])
+			goto fail;
+	}
+
+	ring_init(&capture_ring, ring_size);
+	ring_set_limit(&capture_ring, capture_nr_bufs);
+	sem_init(&capture_filled, 0, 0);
+	sem_init(&capture_released, 0, 0);
+	stats_buffers(capture_buf_size, capture_nr_bufs);
+
+	ret = pthread_create(&capture_thread, NULL, &capture_main, NULL);
+	if (ret != 0) {
+		LOGE("Failed to create the capture thread (%s)\n", strerror(ret));
+		return -1;
+	}
+	return 0;
+fail:
+	LOGE("Cannot allocate memory for capture buffers\n");
+	return -1;
+}
+
+void capture_set_lossless(void)
+{
+	capture_lossless = 1;
+}
+
+void capture_stop(void)
+{
+	capture_stopping = 1;
+	if (capture_lossless)
+		sem_post(&capture_released);
+}
+
+struct capture_buf_t *capture_next(void)
+{
+	struct capture_buf_t *cbuf;
+	ssize_t idx;
+
+	for (;;) {
+		idx = ring_consume_begin(&capture_ring);
+		if (idx >= 0) {
+			stats_queue(ring_used(&capture_ring));
+			cbuf = capture_slots[idx];
+			filter_apply(cbuf);
+			stream_publish(cbuf->iov, cbuf->nr_iov, cbuf->len, cbuf->stamp);
+			return cbuf;
+		}
+		if (atomic_load(&capture_finished))
+			return NULL;
+		while (sem_wait(&capture_filled) < 0 && errno == EINTR)
+			;
+	}
+}
+
+long capture_message_stamps(const struct capture_buf_t *cbuf, struct stamp_msg_t *msgs)
+{
+	long duration = cbuf->read_end - cbuf->read_start;
+	size_t end;
+	int i;
+
+	if (duration > UINT32_MAX)
+		duration = UINT32_MAX;
+	for (i = 0; i < cbuf->nr_iov; ++i) {
+		end = (char *) cbuf->iov[i].iov_base + cbuf->iov[i].iov_len - cbuf->data;
+		msgs[i].len = cbuf->iov[i].iov_len;
+		msgs[i].delta = cbuf->raw_len ? duration * end / cbuf->raw_len : duration;
+	}
+	return cbuf->read_end - duration;
+}
+
+void capture_release(void)
+{
+	ring_consume_end(&capture_ring);
+	if (capture_lossless)
+		sem_post(&capture_released);
+}
+
+int capture_join(void)
+{
+	pthread_join(capture_thread, NULL);
+	LOGI("Capture finished: ring high-water mark %zu/%u, %zu KiB buffers, %zu batches dropped\n",
+	     atomic_load(&capture_ring.high_water), capture_nr_bufs, capture_buf_size >> 10,
+	     atomic_load(&capture_ring.overflow));
+	return capture_error;
+}
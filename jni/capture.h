@@ -0,0 +1,84 @@
+#pragma once
+#include <stddef.h>
+#include "diag_interface.h"
+#include "stamp.h"
+
+// The initial size and number of the read buffers
+#define CAPTURE_BUF_SIZE 65536
+#define CAPTURE_NR_BUFS 64
+// They grow up to the configured caps, which are at most these
+#define CAPTURE_MAX_BUF_SIZE (1 << 20)
+#define CAPTURE_MAX_NR_BUFS 1024
+#define CAPTURE_DEFAULT_MAX_BUF_SIZE (256 << 10)
+#define CAPTURE_DEFAULT_MAX_NR_BUFS 256
+// UIO_MAXIOV of Linux, so that one batch can always be written by one writev
+#define CAPTURE_MAX_IOV 1024
+
+/*
+ * A batch of messages read from the diag interface.
+ * iov points into data (of size bytes), and len is the total length of the
+ * messages.
+ * stamp is the timestamp of the last message. raw_len, read_start and
+ * read_end are taken from diag_batch_t, but the times are converted to
+ * CLOCK_REALTIME.
+ */
+struct capture_buf_t {
+	size_t len;
+	long stamp;
+	size_t raw_len;
+	long read_start;
+	long read_end;
+	int nr_iov;
+	struct iovec iov[CAPTURE_MAX_IOV];
+	size_t size;
+	char *data;
+};
+
+/*
+ * Start the capture thread, which keeps reading from the diag interface
+ * into a pool of pre-allocated buffers.
+ *
+ * When the reads are saturated, the buffers grow up to max_buf_size bytes,
+ * and when the ring is full, more buffers are added up to max_nr_bufs.
+ */
+int capture_start(const struct diag_interface_t *interface, diag_handle_t handle,
+		  size_t max_buf_size, unsigned int max_nr_bufs);
+
+/*
+ * Wait for the consumer when the ring is full, instead of dropping batches,
+ * for inputs which can be paused such as a replay as fast as possible. It
+ * must be set before the capture is started.
+ */
+void capture_set_lossless(void);
+
+/*
+ * Ask the capture thread to stop after the current read.
+ * It is safe to call it from a signal handler.
+ */
+void capture_stop(void);
+
+/*
+ * Wait for the next filled buffer.
+ * NULL will be returned after the capture thread stops and all the buffers
+ * have been consumed. The buffer must be released by capture_release()
+ * before the next call.
+ *
+ * The unwanted log packets are filtered out and the batch is published to
+ * the stream subscribers here, so that it happens on the consumer's thread
+ * instead of the capture thread.
+ */
+struct capture_buf_t *capture_next(void);
+void capture_release(void);
+
+/*
+ * Get the stamp of every message in the batch, interpolated between the
+ * start and the end of the read by its position in the read buffer.
+ * msgs must have nr_iov entries. The stamp of the batch is returned.
+ */
+long capture_message_stamps(const struct capture_buf_t *cbuf, struct stamp_msg_t *msgs);
+
+/*
+ * Wait for the capture thread to exit.
+ * A negative value will be returned if it stops due to a read failure.
+ */
+int capture_join(void);
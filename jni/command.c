@@ -0,0 +1,216 @@
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "command.h"
+
+#define COMMAND_BUF_SIZE 65536
+// Enough to identify a command, including the subsystem id and command code
+#define COMMAND_HEAD_LEN 4
+
+#define DIAG_BAD_CMD_F		0x13
+#define DIAG_BAD_PARM_F		0x14
+#define DIAG_BAD_LEN_F		0x15
+#define DIAG_SUBSYS_CMD_F	0x4b
+#define DIAG_SUBSYS_CMD_VER_2_F	0x80
+
+struct command_t {
+	int index;
+	size_t len;
+	uint8_t head[COMMAND_HEAD_LEN];
+};
+
+static struct command_t command_inflight[COMMAND_MAX_WINDOW];
+static int command_nr_inflight;
+
+static char command_rbuf[COMMAND_BUF_SIZE];
+
+/*
+ * The response being decoded. Only its head is kept, since nothing else
+ * is needed to match it.
+ */
+static uint8_t command_resp[COMMAND_HEAD_LEN + 1];
+static size_t command_resp_len;
+static int command_escaped;
+
+static const char *command_error(uint8_t code)
+{
+	switch (code) {
+	case DIAG_BAD_CMD_F:
+		return "bad command";
+	case DIAG_BAD_PARM_F:
+		return "bad parameters";
+	case DIAG_BAD_LEN_F:
+		return "bad length";
+	default:
+		return NULL;
+	}
+}
+
+// Keep the first max bytes of the unescaped frame, and return its full length
+static size_t command_decode_head(const char *buf, size_t len, uint8_t *head, size_t max)
+{
+	size_t i, n = 0;
+	int escaped = 0;
+	char c;
+
+	for (i = 0; i < len; ++i) {
+		c = buf[i];
+		if (escaped) {
+			c ^= 0x20;
+			escaped = 0;
+		} else if (c == 0x7d) {
+			escaped = 1;
+			continue;
+		} else if (c == 0x7e) {
+			continue;
+		}
+		if (n < max)
+			head[n] = c;
+		++n;
+	}
+	return n;
+}
+
+/*
+ * A normal response echoes the command code (and the subsystem id and
+ * command code of subsystem commands), while an error response echoes the
+ * whole command after the error code.
+ */
+static int command_match(const struct command_t *cmd, const uint8_t *head, size_t len)
+{
+	size_t n = cmd->len < COMMAND_HEAD_LEN ? cmd->len : COMMAND_HEAD_LEN;
+
+	if (command_error(head[0]))
+		return len > 1 && memcmp(cmd->head, head + 1,
+					 n < len - 1 ? n : len - 1) == 0;
+	if (head[0] != DIAG_SUBSYS_CMD_F && head[0] != DIAG_SUBSYS_CMD_VER_2_F)
+		n = 1;
+	return len >= n && memcmp(cmd->head, head, n) == 0;
+}
+
+/*
+ * Match the response to the oldest command waiting for it. Responses to
+ * nothing in flight (e.g. log packets) are ignored. The device responds in
+ * order, so the older commands will never get their responses.
+ * The number of rejected commands (0 or 1) is returned.
+ */
+static int command_handle_response(const uint8_t *head, size_t len)
+{
+	const char *error = command_error(head[0]);
+	int i;
+
+	for (i = 0; i < command_nr_inflight; ++i)
+		if (command_match(&command_inflight[i], head, len))
+			break;
+	if (i == command_nr_inflight)
+		return 0;
+
+	if (i > 0)
+		LOGW("No responses to config commands #%d to #%d\n",
+		     command_inflight[0].index, command_inflight[i - 1].index);
+	if (error)
+		LOGE("Config command #%d (0x%02x) was rejected by the device (%s)\n",
+		     command_inflight[i].index, command_inflight[i].head[0], error);
+	command_nr_inflight -= i + 1;
+	memmove(&command_inflight[0], &command_inflight[i + 1],
+		command_nr_inflight * sizeof(struct command_t));
+	return error ? 1 : 0;
+}
+
+static int command_receive(const char *buf, size_t len, int *nr_matched)
+{
+	int failed = 0, before;
+	size_t i;
+	char c;
+
+	for (i = 0; i < len; ++i) {
+		c = buf[i];
+		if (c == 0x7e) {
+			// The CRC is not needed, but the frame must be long enough to have it
+			if (command_resp_len > 2) {
+				before = command_nr_inflight;
+				failed += command_handle_response(command_resp,
+					command_resp_len - 2 < sizeof(command_resp) ?
+					command_resp_len - 2 : sizeof(command_resp));
+				*nr_matched += before - command_nr_inflight;
+			}
+			command_resp_len = 0;
+			command_escaped = 0;
+			continue;
+		}
+		if (command_escaped) {
+			c ^= 0x20;
+			command_escaped = 0;
+		} else if (c == 0x7d) {
+			command_escaped = 1;
+			continue;
+		}
+		if (command_resp_len < sizeof(command_resp))
+			command_resp[command_resp_len] = c;
+		++command_resp_len;
+	}
+	return failed;
+}
+
+int command_submit(const struct diag_interface_t *interface, diag_handle_t handle,
+		   const char *buf, size_t len, int window)
+{
+	const char *now = buf, *end = buf + len, *next;
+	struct command_t *cmd;
+	int index = 0, failed = 0, matched;
+	long last_progress;
+	ssize_t ret;
+
+	if (window > COMMAND_MAX_WINDOW)
+		window = COMMAND_MAX_WINDOW;
+	command_nr_inflight = 0;
+	command_resp_len = 0;
+	command_escaped = 0;
+	last_progress = get_monotonic_raw_timestamp();
+
+	while (now < end || command_nr_inflight) {
+		if (now < end && command_nr_inflight < window) {
+			next = memchr(now, 0x7e, end - now);
+			if (!next) {
+				now = end;
+				continue;
+			}
+			++next;
+			if (next - now >= 3) {
+				ret = (*interface->send)(handle, now, next - now);
+				if (ret != next - now)
+					return -1;
+				cmd = &command_inflight[command_nr_inflight];
+				cmd->index = ++index;
+				cmd->len = command_decode_head(now, next - now, cmd->head,
+							       COMMAND_HEAD_LEN);
+				// Nothing but the CRC, no response is expected
+				if (cmd->len > 2) {
+					cmd->len -= 2;
+					++command_nr_inflight;
+				}
+				last_progress = get_monotonic_raw_timestamp();
+			}
+			now = next;
+			continue;
+		}
+
+		ret = (*interface->recv)(handle, command_rbuf, COMMAND_BUF_SIZE, COMMAND_TIMEOUT_MS);
+		if (ret < 0)
+			return -1;
+		matched = 0;
+		failed += command_receive(command_rbuf, ret, &matched);
+		if (matched) {
+			last_progress = get_monotonic_raw_timestamp();
+		} else if (get_monotonic_raw_timestamp() - last_progress >
+			   COMMAND_TIMEOUT_MS * 1000000l) {
+			LOGW("No responses to config commands #%d to #%d, giving up waiting\n",
+			     command_inflight[0].index,
+			     command_inflight[command_nr_inflight - 1].index);
+			command_nr_inflight = 0;
+		}
+	}
+
+	LOGI("Sent %d config commands, %d rejected\n", index, failed);
+	return failed;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stddef.h>
+#include "diag_interface.h"
+
+#define COMMAND_MAX_WINDOW 64
+// Give up on the commands in flight if nothing is matched for so long
+#define COMMAND_TIMEOUT_MS 2000
+
+/*
+ * Send the 0x7e-terminated commands in buf back-to-back, with at most
+ * window of them waiting for responses. The responses are matched to the
+ * commands as they arrive, and the commands rejected by the device (bad
+ * command, bad parameters or bad length) are reported.
+ * The number of rejected commands is returned, or -1 if sending fails.
+ */
+int command_submit(const struct diag_interface_t *interface, diag_handle_t handle,
+		   const char *buf, size_t len, int window);
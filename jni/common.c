@@ -0,0 +1,23 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <semaphore.h>
+#include "common.h"
+
+int sem_wait_monotonic(sem_t *sem, unsigned long timeout_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += timeout_ms % 1000 * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		++ts.tv_sec;
+	}
+	// Bionic only has sem_clockwait() from Android 11, but its own variant from Android 9
+#ifdef __ANDROID__
+	return sem_timedwait_monotonic_np(sem, &ts);
+#else
+	return sem_clockwait(sem, CLOCK_MONOTONIC, &ts);
+#endif
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <time.h>
+#include <semaphore.h>
 
 #define  LOGE(...)  ({ printf("[ERROR] " __VA_ARGS__); fflush(stdout); })
 #define  LOGW(...)  ({ printf("[WARN ] " __VA_ARGS__); fflush(stdout); })
@@ -14,3 +15,22 @@ static inline uint64_t get_posix_timestamp(void)
 	clock_gettime(CLOCK_REALTIME, &tp);
 	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
 }
+
+/*
+ * CLOCK_MONOTONIC_RAW is never adjusted by NTP, so it is used to measure
+ * intervals precisely.
+ */
+static inline uint64_t get_monotonic_raw_timestamp(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+/*
+ * Wait for a post to the semaphore for up to timeout_ms milliseconds. The
+ * deadline is on CLOCK_MONOTONIC, so that changing the wall clock, as NITZ
+ * or NTP does, neither delays nor hurries it. -1 is returned with errno set
+ * to ETIMEDOUT on timeout, as sem_timedwait() does.
+ */
+int sem_wait_monotonic(sem_t *sem, unsigned long timeout_ms);
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "common.h"
+#include "compress.h"
+#include "correct.h"
+#include "ring.h"
+
+static struct ring_t compress_ring;
+static struct compress_buf_t *compress_bufs;
+static sem_t compress_filled;
+static sem_t compress_free;
+
+static pthread_t compress_thread;
+static _Atomic int compress_finished;
+
+static void compress_wait(sem_t *sem)
+{
+	while (sem_wait(sem) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * The corrected frames are not bounded by one batch, so they are split into
+ * as many frames as needed. There are no per-message stamps for them.
+ */
+static void compress_corrected(const char *buf, size_t len, long stamp)
+{
+	struct compress_buf_t *zbuf;
+	size_t chunk;
+
+	while (len > 0) {
+		chunk = len < LZ4_MAX_BLOCK_SIZE ? len : LZ4_MAX_BLOCK_SIZE;
+		compress_wait(&compress_free);
+		zbuf = &compress_bufs[ring_produce_begin(&compress_ring)];
+		zbuf->raw_len = chunk;
+		zbuf->stamp = stamp;
+		zbuf->read_end = -1;
+		zbuf->msg_stamp = stamp;
+		zbuf->nr_msgs = 0;
+		zbuf->len = lz4_compress_frame(buf, chunk, zbuf->data);
+		ring_produce_end(&compress_ring);
+		sem_post(&compress_filled);
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Unlike the capture thread, the compression thread waits for the writer
+ * when all its buffers are in use. Then the capture ring fills up and the
+ * logs are dropped there, without blocking the capture thread.
+ */
+static void *compress_main(void *arg)
+{
+	static char raw[LZ4_MAX_BLOCK_SIZE];
+	struct capture_buf_t *cbuf;
+	struct compress_buf_t *zbuf;
+	const char *out, *msg;
+	long stamp = -1;
+	size_t len, total, msg_len, chunk;
+	int i;
+
+	while ((cbuf = capture_next()) != NULL) {
+		if (correct_enabled()) {
+			stamp = cbuf->stamp;
+			len = correct_batch(cbuf, &out);
+			capture_release();
+			compress_corrected(out, len, stamp);
+			continue;
+		}
+
+		compress_wait(&compress_free);
+		zbuf = &compress_bufs[ring_produce_begin(&compress_ring)];
+
+		/*
+		 * The messages are not contiguous, gather them for a better
+		 * ratio, and compress a frame whenever a block is full.
+		 */
+		len = total = 0;
+		zbuf->len = 0;
+		for (i = 0; i < cbuf->nr_iov; ++i) {
+			msg = cbuf->iov[i].iov_base;
+			msg_len = cbuf->iov[i].iov_len;
+			total += msg_len;
+			while (msg_len > 0) {
+				chunk = LZ4_MAX_BLOCK_SIZE - len < msg_len ? LZ4_MAX_BLOCK_SIZE - len : msg_len;
+				memcpy(raw + len, msg, chunk);
+				len += chunk;
+				msg += chunk;
+				msg_len -= chunk;
+				if (len == LZ4_MAX_BLOCK_SIZE) {
+					zbuf->len += lz4_compress_frame(raw, len, zbuf->data + zbuf->len);
+					len = 0;
+				}
+			}
+		}
+		if (len > 0)
+			zbuf->len += lz4_compress_frame(raw, len, zbuf->data + zbuf->len);
+		zbuf->raw_len = total;
+		zbuf->stamp = cbuf->stamp;
+		zbuf->read_end = cbuf->read_end;
+		zbuf->msg_stamp = capture_message_stamps(cbuf, zbuf->msgs);
+		zbuf->nr_msgs = cbuf->nr_iov;
+		capture_release();
+
+		ring_produce_end(&compress_ring);
+		sem_post(&compress_filled);
+	}
+
+	if (correct_enabled()) {
+		len = correct_finish(&out);
+		compress_corrected(out, len, stamp);
+	}
+
+	atomic_store(&compress_finished, 1);
+	sem_post(&compress_filled);
+	return NULL;
+}
+
+int compress_start(size_t max_batch_size)
+{
+	int ret, i;
+
+	// The corrected frames are compressed by blocks, so they need no more
+	if (max_batch_size < LZ4_MAX_BLOCK_SIZE)
+		max_batch_size = LZ4_MAX_BLOCK_SIZE;
+	compress_bufs = calloc(COMPRESS_NR_BUFS, sizeof(struct compress_buf_t));
+	if (!compress_bufs)
+		goto fail;
+	for (i = 0; i < COMPRESS_NR_BUFS; ++i) {
+		compress_bufs[i].data = malloc(COMPRESS_BOUND(max_batch_size));
+		if (!compress_bufs[i].data)
+			goto fail;
+	}
+
+	ring_init(&compress_ring, COMPRESS_NR_BUFS);
+	sem_init(&compress_filled, 0, 0);
+	sem_init(&compress_free, 0, COMPRESS_NR_BUFS);
+
+	ret = pthread_create(&compress_thread, NULL, &compress_main, NULL);
+	if (ret != 0) {
+		LOGE("Failed to create the compression thread (%s)\n", strerror(ret));
+		return -1;
+	}
+	return 0;
+fail:
+	LOGE("Cannot allocate memory for compression buffers\n");
+	return -1;
+}
+
+struct compress_buf_t *compress_next(void)
+{
+	ssize_t idx;
+
+	for (;;) {
+		idx = ring_consume_begin(&compress_ring);
+		if (idx >= 0)
+			return &compress_bufs[idx];
+		if (atomic_load(&compress_finished))
+			return NULL;
+		compress_wait(&compress_filled);
+	}
+}
+
+void compress_release(void)
+{
+	ring_consume_end(&compress_ring);
+	sem_post(&compress_free);
+}
+
+void compress_join(void)
+{
+	pthread_join(compress_thread, NULL);
+}
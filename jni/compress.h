@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include "capture.h"
+#include "lz4.h"
+
+#define COMPRESS_NR_BUFS 16
+// A batch is compressed into one frame per LZ4_MAX_BLOCK_SIZE bytes
+#define COMPRESS_BOUND(len) \
+	(((len) + LZ4_MAX_BLOCK_SIZE - 1) / LZ4_MAX_BLOCK_SIZE * LZ4_FRAME_BOUND(LZ4_MAX_BLOCK_SIZE))
+
+/*
+ * A batch compressed into LZ4 frames.
+ * raw_len is the length before compression, and len is the length of the frames.
+ * read_end is taken from the batch, to measure the latency of the writer.
+ * msgs are the per-message stamps relative to msg_stamp, which are taken
+ * before compression, since the message boundaries are lost after it.
+ */
+struct compress_buf_t {
+	size_t raw_len;
+	size_t len;
+	long stamp;
+	long read_end;
+	long msg_stamp;
+	int nr_msgs;
+	struct stamp_msg_t msgs[CAPTURE_MAX_IOV];
+	char *data;
+};
+
+/*
+ * Start the compression thread, which takes the batches from the capture
+ * thread and compresses them, so that the capture thread is never blocked.
+ * max_batch_size is the largest batch to be compressed.
+ */
+int compress_start(size_t max_batch_size);
+
+/*
+ * Wait for the next compressed batch.
+ * NULL will be returned after the capture thread stops and all the batches
+ * have been consumed. The buffer must be released by compress_release()
+ * before the next call.
+ */
+struct compress_buf_t *compress_next(void);
+void compress_release(void);
+
+void compress_join(void);
@@ -0,0 +1,314 @@
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "correct.h"
+#include "hdlc.h"
+
+// The frames of one range, which is at most one batch, plus the frames across it
+#define CORRECT_PENDING_SIZE (CAPTURE_MAX_BUF_SIZE + 2 * CORRECT_MAX_FRAME)
+// A valid log packet has at least 16 bytes before the CRC
+#define CORRECT_MAX_FRAMES (CORRECT_PENDING_SIZE / 16)
+#define CORRECT_MAX_RECORDS (2 * CAPTURE_MAX_IOV)
+/*
+ * Everything corrected by one call was either pending or in the batch, and
+ * an encoded frame is at most about twice as long as the decoded one.
+ */
+#define CORRECT_OUT_SIZE (3 * (CORRECT_PENDING_SIZE + CAPTURE_MAX_BUF_SIZE))
+
+/*
+ * The end of the range covered by a stamp record, in bytes since the
+ * capture started. A frame belongs to the first record ending after its
+ * first byte, the same as in stamp_corrector.
+ */
+struct correct_record_t {
+	uint64_t end;
+	long stamp;
+};
+
+struct correct_frame_t {
+	size_t start;
+	size_t len;
+	size_t stamp_pos;
+};
+
+static int correct_on;
+static int correct_message_stamps;
+
+static struct correct_record_t correct_records[CORRECT_MAX_RECORDS];
+static int correct_first_record, correct_nr_records;
+static uint64_t correct_total;
+
+/*
+ * The decoded frames of the current range, followed by the decoded part of
+ * the current frame, which starts at correct_frame_start of the capture.
+ */
+static char correct_pending[CORRECT_PENDING_SIZE];
+static struct correct_frame_t correct_frames[CORRECT_MAX_FRAMES];
+static int correct_nr_frames;
+static size_t correct_group_len;
+static uint64_t correct_group_end;
+static long correct_group_stamp;
+
+static uint64_t correct_frame_start;
+static size_t correct_frame_len;
+static int correct_escaped;
+static int correct_skipping;
+
+static char correct_out[CORRECT_OUT_SIZE];
+static size_t correct_out_len;
+
+static uint64_t correct_nr_corrected;
+static uint64_t correct_nr_corrupted;
+static uint64_t correct_nr_unsupported;
+static uint64_t correct_nr_too_long;
+
+static uint64_t correct_posix2qualcomm(uint64_t posix)
+{
+	uint64_t seconds = posix / 1000000000;
+	uint64_t remained = posix % 1000000000;
+	seconds -= 315936000;
+	remained *= 52428800;
+	remained /= 1000000000;
+	return seconds * 52428800 + remained;
+}
+
+void correct_enable(int message_stamps)
+{
+	correct_on = 1;
+	correct_message_stamps = message_stamps;
+}
+
+int correct_enabled(void)
+{
+	return correct_on;
+}
+
+static void correct_put(char c)
+{
+	if (c == 0x7e || c == 0x7d) {
+		correct_out[correct_out_len++] = 0x7d;
+		c ^= 0x20;
+	}
+	correct_out[correct_out_len++] = c;
+}
+
+/*
+ * Correct the held frames by the difference of the last one, encode them
+ * into the output, and move the current partial frame to the front.
+ */
+static void correct_flush_group(void)
+{
+	struct correct_frame_t *frame;
+	uint64_t qcom_stamp, sdiff;
+	const char *p, *end;
+	uint16_t crc;
+	int i;
+
+	if (correct_nr_frames == 0)
+		return;
+
+	frame = &correct_frames[correct_nr_frames - 1];
+	memcpy(&qcom_stamp, correct_pending + frame->stamp_pos, sizeof(qcom_stamp));
+	sdiff = correct_posix2qualcomm(correct_group_stamp) - qcom_stamp;
+
+	for (i = 0; i < correct_nr_frames; ++i) {
+		frame = &correct_frames[i];
+		memcpy(&qcom_stamp, correct_pending + frame->stamp_pos, sizeof(qcom_stamp));
+		qcom_stamp += sdiff;
+		memcpy(correct_pending + frame->stamp_pos, &qcom_stamp, sizeof(qcom_stamp));
+
+		p = correct_pending + frame->start;
+		end = p + frame->len;
+		crc = hdlc_crc((const uint8_t *) p, frame->len);
+		while (p < end)
+			correct_put(*p++);
+		correct_put(crc & 0xff);
+		correct_put(crc >> 8);
+		correct_out[correct_out_len++] = 0x7e;
+	}
+	correct_nr_corrected += correct_nr_frames;
+
+	memmove(correct_pending, correct_pending + correct_group_len, correct_frame_len);
+	correct_group_len = 0;
+	correct_nr_frames = 0;
+}
+
+// Drop the records that end before the start of the current frame
+static void correct_drop_records(void)
+{
+	while (correct_first_record < correct_nr_records &&
+	       correct_records[correct_first_record].end <= correct_frame_start)
+		++correct_first_record;
+}
+
+/*
+ * The frame is complete (without the delimiter). Check it in the same way
+ * as stamp_corrector, and hold it back in the group of its record.
+ */
+static void correct_end_frame(void)
+{
+	char *frame = correct_pending + correct_group_len;
+	size_t len = correct_frame_len, offset = 0;
+	struct correct_record_t *record;
+	uint64_t start_bytes;
+	uint16_t crc;
+
+	if (correct_skipping) {
+		++correct_nr_too_long;
+		return;
+	}
+	if (len <= 2) {
+		if (len)
+			++correct_nr_corrupted;
+		return;
+	}
+	len -= 2;
+	memcpy(&crc, frame + len, sizeof(crc));
+	if (hdlc_crc((const uint8_t *) frame, len) != crc) {
+		++correct_nr_corrupted;
+		return;
+	}
+
+	if (len >= 8) {
+		memcpy(&start_bytes, frame, sizeof(start_bytes));
+		if (start_bytes == 0x200000198 || start_bytes == 0x100000198)
+			offset = 8;
+	}
+	if (len < offset + 2 || frame[offset] != 0x10) {
+		++correct_nr_unsupported;
+		return;
+	}
+	offset += 2;
+	if (len < offset + 6 + 8) {
+		++correct_nr_unsupported;
+		return;
+	}
+
+	correct_drop_records();
+	record = &correct_records[correct_first_record];
+	if (correct_nr_frames && record->end != correct_group_end)
+		correct_flush_group();
+
+	correct_group_end = record->end;
+	correct_group_stamp = record->stamp;
+	/*
+	 * stamp_corrector encodes the old CRC as a part of the frame before the
+	 * new one, and so do we, so that the outputs are identical.
+	 */
+	correct_frames[correct_nr_frames].start = correct_group_len;
+	correct_frames[correct_nr_frames].len = correct_frame_len;
+	correct_frames[correct_nr_frames].stamp_pos = correct_group_len + offset + 6;
+	++correct_nr_frames;
+	correct_group_len += correct_frame_len;
+}
+
+static void correct_add_record(uint64_t end, long stamp)
+{
+	correct_records[correct_nr_records].end = end;
+	correct_records[correct_nr_records].stamp = stamp;
+	++correct_nr_records;
+}
+
+/*
+ * Add the records of the batch. If the current frame is so long that the
+ * records do not fit, it is discarded, and then none of the old records
+ * are needed any more.
+ */
+static void correct_add_records(const struct capture_buf_t *cbuf)
+{
+	static struct stamp_msg_t msgs[CAPTURE_MAX_IOV];
+	uint64_t end = correct_total;
+	long stamp;
+	int i;
+
+	correct_drop_records();
+	correct_nr_records -= correct_first_record;
+	memmove(correct_records, correct_records + correct_first_record,
+		correct_nr_records * sizeof(struct correct_record_t));
+	correct_first_record = 0;
+	if (correct_nr_records + cbuf->nr_iov > CORRECT_MAX_RECORDS) {
+		correct_nr_records = 0;
+		correct_skipping = 1;
+	}
+
+	if (!correct_message_stamps) {
+		correct_add_record(end + cbuf->len, cbuf->stamp);
+		return;
+	}
+	stamp = capture_message_stamps(cbuf, msgs);
+	for (i = 0; i < cbuf->nr_iov; ++i) {
+		if (msgs[i].len == 0)
+			continue;
+		end += msgs[i].len;
+		correct_add_record(end, stamp + msgs[i].delta);
+	}
+}
+
+size_t correct_batch(const struct capture_buf_t *cbuf, const char **out)
+{
+	const char *p, *end;
+	char c;
+	int i;
+
+	correct_out_len = 0;
+	correct_add_records(cbuf);
+
+	for (i = 0; i < cbuf->nr_iov; ++i) {
+		p = cbuf->iov[i].iov_base;
+		end = p + cbuf->iov[i].iov_len;
+		for (; p < end; ++p, ++correct_total) {
+			c = *p;
+			if (c == 0x7e) {
+				correct_end_frame();
+				correct_frame_start = correct_total + 1;
+				correct_frame_len = 0;
+				correct_escaped = 0;
+				correct_skipping = 0;
+				continue;
+			}
+			if (correct_skipping)
+				continue;
+			if (correct_escaped) {
+				c ^= 0x20;
+				correct_escaped = 0;
+			} else if (c == 0x7d) {
+				correct_escaped = 1;
+				continue;
+			}
+			if (correct_frame_len >= CORRECT_MAX_FRAME ||
+			    correct_group_len + correct_frame_len >= CORRECT_PENDING_SIZE) {
+				correct_skipping = 1;
+				continue;
+			}
+			correct_pending[correct_group_len + correct_frame_len++] = c;
+		}
+	}
+
+	// The range is over if the next frame belongs to another record
+	correct_drop_records();
+	if (correct_first_record == correct_nr_records ||
+	    correct_records[correct_first_record].end != correct_group_end)
+		correct_flush_group();
+
+	*out = correct_out;
+	return correct_out_len;
+}
+
+size_t correct_finish(const char **out)
+{
+	correct_out_len = 0;
+	correct_flush_group();
+	*out = correct_out;
+	return correct_out_len;
+}
+
+void correct_report(void)
+{
+	if (correct_on)
+		LOGI("Corrected %llu log packets, discarded %llu corrupted, %llu unsupported "
+		     "and %llu too long frames\n",
+		     (unsigned long long) correct_nr_corrected,
+		     (unsigned long long) correct_nr_corrupted,
+		     (unsigned long long) correct_nr_unsupported,
+		     (unsigned long long) correct_nr_too_long);
+}
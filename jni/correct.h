@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+#include "capture.h"
+
+// Longer frames are discarded, so that the pending data stays bounded
+#define CORRECT_MAX_FRAME CAPTURE_BUF_SIZE
+
+/*
+ * Correct the Qualcomm timestamps of the log packets on the fly, producing
+ * the same output as stamp_corrector. The frames are corrected in forward
+ * order, and all the frames started in the range of one stamp record are
+ * held back until the range is over, since they are corrected by the same
+ * difference, which comes from the last one of them.
+ *
+ * If message_stamps is set, each message has its own interpolated stamp,
+ * otherwise the stamp of the whole read is used.
+ */
+void correct_enable(int message_stamps);
+int correct_enabled(void);
+
+/*
+ * Feed the batch and get the corrected frames that are complete so far.
+ * The output is valid until the next call.
+ */
+size_t correct_batch(const struct capture_buf_t *cbuf, const char **out);
+
+/*
+ * Flush the held frames at the end of the capture. The partial frame at the
+ * end is dropped, as stamp_corrector does.
+ */
+size_t correct_finish(const char **out);
+
+void correct_report(void);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
@@ -6,11 +7,19 @@
 #include <dlfcn.h>
 #include <pthread.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
 #include "common.h"
 #include "diag_interface.h"
+#include "hdlc.h"
 
 #define BUFFER_SIZE 65536
 
@@ -25,6 +34,8 @@ struct diag_char_handle_t {
 
 	long stamp;
 	int msg_id;
+	// The last message read by read_batch() ended at a frame boundary
+	int aligned;
 	union {
 		int *msg_size;
 		char *msg_start;
@@ -267,7 +278,9 @@ static ssize_t probe_ioctl_arglen(int fd, int req, size_t maxlen)
  * in diag_switch_logging, three threads (disk_write_hdl, qsr4_db_parser_thread_hdl,
  * db_write_thread_hdl) will be created. But actually we don't need them at all.
  * Meanwhile we cannot call dlclose when these useless threads are still alive.
- * So the following fake pthread_create is used to prevent them from being created.
+ * So the following fake pthread_create is used to prevent them from being created
+ * while libdiag.so is loaded. Otherwise, the real pthread_create is called, since
+ * our own capture threads need it.
  *
  * Note this fake pthread_create may cause some unexpected side effects on another
  * untested version of libdiag.so. If so, futher modification is needed.
@@ -278,11 +291,24 @@ static ssize_t probe_ioctl_arglen(int fd, int req, size_t maxlen)
  *   Xiaomi Redmi Note 8     Android 10.0.0
  *   Samsung Galaxy A90 5G   Android 10.0.0
  */
+static int libdiag_loaded;
+
 int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
                    void *(*start_routine)(void *), void *arg)
 {
-	*thread = 1;
-	return 0;
+	static int (*real_pthread_create)(pthread_t *, const pthread_attr_t *,
+					  void *(*)(void *), void *);
+
+	if (libdiag_loaded) {
+		*thread = 1;
+		return 0;
+	}
+
+	if (!real_pthread_create)
+		real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+	if (!real_pthread_create)
+		return EAGAIN;
+	return (*real_pthread_create)(thread, attr, start_routine, arg);
 }
 
 static int enable_logging_libdiag(int fd, int mode)
@@ -308,6 +334,7 @@ static int enable_logging_libdiag(int fd, int mode)
 	 * Loading private libraries directly is only possible with the root privileges.
 	 */
 	handle = NULL;
+	libdiag_loaded = 1;
 	for (i = 0; i < sizeof(LIB_DIAG_PATH) / sizeof(LIB_DIAG_PATH[0]) && !handle; ++i) {
 		handle = dlopen(LIB_DIAG_PATH[i], RTLD_NOW);
 		if (!handle)
@@ -315,8 +342,10 @@ static int enable_logging_libdiag(int fd, int mode)
 		else
 			LOGI("dlopen %s succeeded\n", LIB_DIAG_PATH[i]);
 	}
-	if (!handle)
+	if (!handle) {
+		libdiag_loaded = 0;
 		return -1;
+	}
 
 	// Note diag_switch_logging does NOT have a return value in general.
 	err = "diag_switch_logging";
@@ -357,98 +386,304 @@ static int enable_logging_libdiag(int fd, int mode)
 
 	// We have never created new threads in libdiag.so, so we can close it.
 	dlclose(handle);
+	libdiag_loaded = 0;
 	return ret;
 fail:
 	LOGE("Missing symbol %s in libdiag.so\n", err);
 	dlclose(handle);
+	libdiag_loaded = 0;
 	return -1;
 }
 
-static int enable_logging(struct diag_char_handle_t *handle, int mode)
+/*
+ * The buffering mode of each peripheral. Without any of them configured,
+ * the modem is set to the streaming mode with the default watermarks.
+ */
+static struct diag_buffering_mode_t buffering_modes[NUM_PERIPHERALS];
+static unsigned int buffering_configured;
+
+static const char *peripheral_names[NUM_PERIPHERALS] = {
+	[PERIPHERAL_MODEM] = "modem",
+	[PERIPHERAL_LPASS] = "lpass",
+	[PERIPHERAL_WCNSS] = "wcnss",
+	[PERIPHERAL_SENSORS] = "sensors",
+	[PERIPHERAL_WDSP] = "wdsp",
+	[PERIPHERAL_CDSP] = "cdsp",
+	[PERIPHERAL_NPU] = "npu",
+};
+
+static const char *buffering_mode_names[] = {
+	[DIAG_BUFFERING_MODE_STREAMING] = "streaming",
+	[DIAG_BUFFERING_MODE_THRESHOLD] = "threshold",
+	[DIAG_BUFFERING_MODE_CIRCULAR] = "circular",
+};
+
+static int lookup_name(const char *name, size_t len, const char **names, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; ++i)
+		if (names[i] && strlen(names[i]) == len && strncmp(names[i], name, len) == 0)
+			return i;
+	return -1;
+}
+
+int diag_char_set_buffering(const char *spec)
+{
+	struct diag_buffering_mode_t *bm;
+	unsigned long high = DEFAULT_HIGH_WM_VAL, low = DEFAULT_LOW_WM_VAL;
+	const char *mode, *wm;
+	char *end;
+	int peripheral, i;
+
+	mode = strchr(spec, ':');
+	if (!mode)
+		goto fail;
+	peripheral = lookup_name(spec, mode - spec, peripheral_names, NUM_PERIPHERALS);
+	if (peripheral < 0)
+		goto fail;
+	++mode;
+	wm = strchr(mode, ':');
+	i = lookup_name(mode, wm ? wm - mode : strlen(mode), buffering_mode_names,
+			sizeof(buffering_mode_names) / sizeof(buffering_mode_names[0]));
+	if (i < 0)
+		goto fail;
+	if (wm) {
+		high = strtoul(wm + 1, &end, 10);
+		if (*end != ':')
+			goto fail;
+		low = strtoul(end + 1, &end, 10);
+		// The kernel rejects the watermarks otherwise
+		if (*end || high > 100 || low >= high)
+			goto fail;
+	}
+
+	bm = &buffering_modes[peripheral];
+	bm->peripheral = peripheral;
+	bm->mode = i;
+	bm->high_wm_val = high;
+	bm->low_wm_val = low;
+	buffering_configured |= 1u << peripheral;
+	return 0;
+fail:
+	LOGE("Invalid buffering mode %s\n", spec);
+	return -1;
+}
+
+static void set_buffering_modes(int fd)
 {
-	int ret = -1, fd = handle->fd;
+	struct diag_buffering_mode_t *bm;
+	int i;
+
+	// The modem streams unless told otherwise, as it always did
+	if (!(buffering_configured & (1u << PERIPHERAL_MODEM)))
+		diag_char_set_buffering("modem:streaming");
+
+	for (i = 0; i < NUM_PERIPHERALS; ++i) {
+		if (!(buffering_configured & (1u << i)))
+			continue;
+		bm = &buffering_modes[i];
+		if (ioctl(fd, DIAG_IOCTL_PERIPHERAL_BUF_CONFIG, bm) < 0)
+			LOGW("DIAG_IOCTL_PERIPHERAL_BUF_CONFIG ioctl failed for %s (%s)\n",
+			     peripheral_names[i], strerror(errno));
+		else if (bm->mode != DIAG_BUFFERING_MODE_STREAMING)
+			LOGI("Buffering %s in %s mode (watermarks %d%%/%d%%)\n", peripheral_names[i],
+			     buffering_mode_names[bm->mode], bm->high_wm_val, bm->low_wm_val);
+	}
+}
+
+/*
+ * Ask the peripherals that buffer the logs to send them now.
+ */
+static int diag_char_drain(diag_handle_t handle_)
+{
+	struct diag_char_handle_t *handle = (struct diag_char_handle_t *) handle_;
+	uint8_t peripheral;
+	int i, ret = 0;
+
+	for (i = 0; i < NUM_PERIPHERALS; ++i) {
+		if (!(buffering_configured & (1u << i)) ||
+		    buffering_modes[i].mode == DIAG_BUFFERING_MODE_STREAMING)
+			continue;
+		peripheral = i;
+		if (ioctl(handle->fd, DIAG_IOCTL_PERIPHERAL_BUF_DRAIN, &peripheral) < 0) {
+			LOGW("DIAG_IOCTL_PERIPHERAL_BUF_DRAIN ioctl failed for %s (%s)\n",
+			     peripheral_names[i], strerror(errno));
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/*
+ * The ways to switch the logging mode, in the order of probing.
+ */
+enum switch_method {
+	SWITCH_NONE,
+	SWITCH_PARAM_V10,
+	SWITCH_PARAM_V9,
+	SWITCH_PARAM_V7,
+	SWITCH_INT_PTR,
+	SWITCH_INT_PTR_EXTRA,
+	SWITCH_INT,
+	SWITCH_INT_EXTRA,
+	SWITCH_LIBDIAG,
+	SWITCH_METHOD_MAX,
+};
+
+static const char *switch_method_names[SWITCH_METHOD_MAX] = {
+	[SWITCH_NONE] = "none",
+	[SWITCH_PARAM_V10] = "Android 10.0 arguments",
+	[SWITCH_PARAM_V9] = "Android 9.0 arguments",
+	[SWITCH_PARAM_V7] = "Android 7.0 arguments",
+	[SWITCH_INT_PTR] = "Android 6.0 arguments",
+	[SWITCH_INT_PTR_EXTRA] = "Android 6.0 arguments with extra ones",
+	[SWITCH_INT] = "the mode as the argument",
+	[SWITCH_INT_EXTRA] = "the mode as the argument with extra ones",
+	[SWITCH_LIBDIAG] = "libdiag.so",
+};
+
+/*
+ * What has worked on this device, so that the next start can go straight to
+ * it instead of probing. It is only trusted on the same kernel build (and the
+ * same Android build), and it is probed again if it stops working.
+ */
+struct diag_profile_t {
+	int method;
+	int optimized_logging;
 	uint16_t remote_dev;
-	struct diag_dci_reg_tbl_t dci_reg_tbl;
-	struct diag_buffering_mode_t buffering_mode;
-	ssize_t arglen;
+	uint32_t peripheral_mask;
+};
 
-	// Get remote_dev
-	ret = ioctl(fd, DIAG_IOCTL_REMOTE_DEV, &remote_dev);
-	if (ret < 0) {
-		LOGW("DIAG_IOCTL_REMOTE_DEV ioctl failed (%s)\n", strerror(errno));
-		remote_dev = 0;
+#define PROFILE_KEY_MAX 512
+
+static const char *profile_path;
+
+void diag_char_set_profile_cache(const char *path)
+{
+	profile_path = path;
+}
+
+static const char *trace_path;
+static int trace_fd = -1;
+
+void diag_char_set_trace(const char *path)
+{
+	trace_path = path;
+}
+
+static int trace_open(void)
+{
+	uint64_t magic = DIAG_TRACE_MAGIC;
+
+	trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0) {
+		LOGE("Cannot open the read trace %s (%s)\n", trace_path, strerror(errno));
+		return -1;
 	}
-	handle->remote_dev = remote_dev;
+	if (write(trace_fd, &magic, sizeof(magic)) != sizeof(magic)) {
+		LOGE("Failed to write to the read trace %s (%s)\n", trace_path, strerror(errno));
+		close(trace_fd);
+		trace_fd = -1;
+		return -1;
+	}
+	return 0;
+}
 
-	// Register a DCI client
-	dci_reg_tbl.client_id = 0;
-	dci_reg_tbl.notification_list = 0;
-	dci_reg_tbl.signal_type = SIGPIPE;
-	dci_reg_tbl.token = remote_dev ? DCI_MDM_PROC : DCI_LOCAL_PROC;
-	ret = ioctl(fd, DIAG_IOCTL_DCI_REG, &dci_reg_tbl);
-	if (ret < 0)
-		LOGW("DIAG_IOCTL_DCI_REG ioctl failed (%s)\n", strerror(errno));
-	handle->dci_client = ret;
+static void profile_get_key(char *key, size_t size)
+{
+	char fingerprint[92] = "";
+	struct utsname uts;
 
-	/*
-	 * Nexus-6-only logging optimizations
-	 * It will fail on other devices (errno=EFAULT), since DIAG_IOCTL_OPTIMIZED_LOGGING is equal to DIAG_IOCTL_PERIPHERAL_BUF_CONFIG.
-	 * Reference: https://github.com/MotorolaMobilityLLC/kernel-msm/blob/kitkat-4.4.4-release-victara/drivers/char/diag/diagchar_core.c#L1189
-	 */
-	(void) ioctl(fd, DIAG_IOCTL_OPTIMIZED_LOGGING, (long) 1);
-
-	// Configure the buffering mode
-	buffering_mode.peripheral = PERIPHERAL_MODEM;
-	buffering_mode.mode = DIAG_BUFFERING_MODE_STREAMING;
-	buffering_mode.high_wm_val = DEFAULT_HIGH_WM_VAL;
-	buffering_mode.low_wm_val = DEFAULT_LOW_WM_VAL;
-	ret = ioctl(fd, DIAG_IOCTL_PERIPHERAL_BUF_CONFIG, &buffering_mode);
-	if (ret < 0)
-		LOGW("DIAG_IOCTL_PERIPHERAL_BUF_CONFIG ioctl failed (%s)\n", strerror(errno));
+	if (uname(&uts) < 0)
+		memset(&uts, 0, sizeof(uts));
+#ifdef __ANDROID__
+	__system_property_get("ro.build.fingerprint", fingerprint);
+#endif
+	snprintf(key, size, "%s %s %s %s", uts.machine, uts.release, uts.version, fingerprint);
+}
 
-	/*
-	 * Enable logging mode:
-	 *
-	 * DIAG_IOCTL_SWITCH_LOGGING has multiple versions. They require different arguments (which have
-	 * different fields and whose lengths are also different). However, it seems there is no way to
-	 * directly determine the version of DIAG_IOCTL_SWITCH_LOGGING. So some tricks can not be avoided
-	 * here.
-	 *
-	 * A traditional way is to try one by one. But it can cause undefined behaviour. Specially, when
-	 * a new verison of DIAG_IOCTL_SWITCH_LOGGING is introduced, it may not report an error. But some
-	 * new fields will be out of bounds. Consequently, it may cause random bugs, which is confusing.
-	 *
-	 * So a more elegant way is to explicitly probe the length of DIAG_IOCTL_SWITCH_LOGGING's argument.
-	 * And the version can be deduced from the length. It is not very precise, but it is enough at least
-	 * for now.
-	 */
-	arglen = probe_ioctl_arglen(handle->fd, DIAG_IOCTL_SWITCH_LOGGING, sizeof(struct diag_logging_mode_param_t));
-	switch (arglen) {
-	case sizeof(struct diag_logging_mode_param_t): {
+static int profile_load(struct diag_profile_t *profile)
+{
+	char key[PROFILE_KEY_MAX], line[PROFILE_KEY_MAX + 8];
+	FILE *fp;
+	int ret;
+
+	if (!profile_path)
+		return -1;
+	fp = fopen(profile_path, "r");
+	if (!fp)
+		return -1;
+
+	profile_get_key(key, sizeof(key));
+	ret = -1;
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, "key=", 4) != 0 ||
+	    strcspn(line + 4, "\n") != strlen(key) || strncmp(line + 4, key, strlen(key)) != 0) {
+		LOGI("The cached device profile is for another build, ignoring it\n");
+		goto out;
+	}
+	if (fscanf(fp, "method=%d optimized_logging=%d remote_dev=%hu peripheral_mask=%u",
+		   &profile->method, &profile->optimized_logging, &profile->remote_dev,
+		   &profile->peripheral_mask) != 4 ||
+	    profile->method <= SWITCH_NONE || profile->method >= SWITCH_METHOD_MAX) {
+		LOGW("Malformed device profile %s, ignoring it\n", profile_path);
+		goto out;
+	}
+	ret = 0;
+out:
+	fclose(fp);
+	return ret;
+}
+
+static void profile_save(const struct diag_profile_t *profile)
+{
+	char key[PROFILE_KEY_MAX], tmp_path[FILENAME_MAX];
+	FILE *fp;
+
+	if (!profile_path)
+		return;
+	profile_get_key(key, sizeof(key));
+
+	// Write a temporary file first, so that a broken profile is never seen
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", profile_path);
+	fp = fopen(tmp_path, "w");
+	if (!fp) {
+		LOGW("Failed to save the device profile to %s (%s)\n", tmp_path, strerror(errno));
+		return;
+	}
+	fprintf(fp, "key=%s\n", key);
+	fprintf(fp, "method=%d\noptimized_logging=%d\nremote_dev=%u\nperipheral_mask=%u\n",
+		profile->method, profile->optimized_logging, profile->remote_dev,
+		profile->peripheral_mask);
+	if (fclose(fp) != 0 || rename(tmp_path, profile_path) < 0) {
+		LOGW("Failed to save the device profile to %s (%s)\n", profile_path, strerror(errno));
+		unlink(tmp_path);
+		return;
+	}
+	LOGI("Saved the device profile to %s\n", profile_path);
+}
+
+static int switch_logging(int fd, int mode, const struct diag_profile_t *profile)
+{
+	switch (profile->method) {
+	case SWITCH_PARAM_V10: {
 		/* Android 10.0 mode
 		 * Reference:
 		 *   https://android.googlesource.com/kernel/msm.git/+/android-10.0.0_r0.87/drivers/char/diag/diagchar_core.c
 		 *   and the disassembly code of libdiag.so
 		 */
 		struct diag_logging_mode_param_t new_mode;
-		struct diag_con_all_param_t con_all;
-		con_all.diag_con_all = 0xff /* DIAG_CON_ALL */;
-		ret = ioctl(fd, DIAG_IOCTL_QUERY_CON_ALL, &con_all);
-		if (ret == 0)
-			new_mode.peripheral_mask = con_all.diag_con_all;
-		else
-			new_mode.peripheral_mask = 0x7f;
+		new_mode.peripheral_mask = profile->peripheral_mask;
 		new_mode.req_mode = mode;
 		new_mode.pd_mask = 0;
 		new_mode.mode_param = 1;
 		new_mode.diag_id = 0;
 		new_mode.pd_val = 0;
 		new_mode.peripheral = -22;
-		new_mode.device_mask = (1 << DIAG_MD_LOCAL) | ((remote_dev & 0x3ff) << 1);
-		ret = ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &new_mode);
-		break;
+		new_mode.device_mask = (1 << DIAG_MD_LOCAL) | ((profile->remote_dev & 0x3ff) << 1);
+		return ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &new_mode);
 	}
-	case sizeof(struct diag_logging_mode_param_v9): {
+	case SWITCH_PARAM_V9: {
 		/* Android 9.0 mode
 		 * Reference: https://android.googlesource.com/kernel/msm.git/+/android-9.0.0_r0.31/drivers/char/diag/diagchar_core.c
 		 */
@@ -457,10 +692,9 @@ static int enable_logging(struct diag_char_handle_t *handle, int mode)
 		new_mode.mode_param = 0;
 		new_mode.pd_mask = 0;
 		new_mode.peripheral_mask = DIAG_CON_ALL;
-		ret = ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &new_mode);
-		break;
+		return ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &new_mode);
 	}
-	case sizeof(struct diag_logging_mode_param_v7): {
+	case SWITCH_PARAM_V7: {
 		/* Android 7.0 mode
 		 * Reference: https://android.googlesource.com/kernel/msm.git/+/android-7.1.0_r0.3/drivers/char/diag/diagchar_core.c
 		 */
@@ -468,31 +702,91 @@ static int enable_logging(struct diag_char_handle_t *handle, int mode)
 		new_mode.req_mode = mode;
 		new_mode.peripheral_mask = DIAG_CON_ALL;
 		new_mode.mode_param = 0;
-		ret = ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &new_mode);
-		break;
+		return ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &new_mode);
 	}
-	case sizeof(int):
+	case SWITCH_INT_PTR:
 		/* Android 6.0 mode
 		 * Reference: https://android.googlesource.com/kernel/msm.git/+/android-6.0.0_r0.9/drivers/char/diag/diagchar_core.c
 		 */
-		ret = ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &mode);
-		if (ret >= 0)
-			break;
+		return ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &mode);
+	case SWITCH_INT_PTR_EXTRA:
 		/*
 		 * Is it really necessary? It seems that the kernel will simply ignore all the fourth and subsequent
 		 * arguments of ioctl. But similar lines do exist in libdiag.so. Why?
 		 * Reference: https://android.googlesource.com/kernel/msm.git/+/android-10.0.0_r0.87/fs/ioctl.c#692
 		 */
-		ret = ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &mode, 12, 0, 0, 0, 0);
+		return ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, &mode, 12, 0, 0, 0, 0);
+	case SWITCH_INT:
+		// Yuanjie: the following works for Samsung S5
+		return ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, (long) mode);
+	case SWITCH_INT_EXTRA:
+		// Same question as above: Is it really necessary?
+		// Yuanjie: the following is used for Xiaomi RedMi 4
+		return ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, (long) mode, 12, 0, 0, 0, 0);
+	case SWITCH_LIBDIAG:
+		return enable_logging_libdiag(fd, mode);
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Enable logging mode:
+ *
+ * DIAG_IOCTL_SWITCH_LOGGING has multiple versions. They require different arguments (which have
+ * different fields and whose lengths are also different). However, it seems there is no way to
+ * directly determine the version of DIAG_IOCTL_SWITCH_LOGGING. So some tricks can not be avoided
+ * here.
+ *
+ * A traditional way is to try one by one. But it can cause undefined behaviour. Specially, when
+ * a new verison of DIAG_IOCTL_SWITCH_LOGGING is introduced, it may not report an error. But some
+ * new fields will be out of bounds. Consequently, it may cause random bugs, which is confusing.
+ *
+ * So a more elegant way is to explicitly probe the length of DIAG_IOCTL_SWITCH_LOGGING's argument.
+ * And the version can be deduced from the length. It is not very precise, but it is enough at least
+ * for now.
+ */
+static int probe_switch_logging(int fd, int mode, struct diag_profile_t *profile)
+{
+	struct diag_con_all_param_t con_all;
+	ssize_t arglen;
+	int ret;
+
+	arglen = probe_ioctl_arglen(fd, DIAG_IOCTL_SWITCH_LOGGING, sizeof(struct diag_logging_mode_param_t));
+	switch (arglen) {
+	case sizeof(struct diag_logging_mode_param_t):
+		con_all.diag_con_all = 0xff /* DIAG_CON_ALL */;
+		ret = ioctl(fd, DIAG_IOCTL_QUERY_CON_ALL, &con_all);
+		if (ret == 0)
+			profile->peripheral_mask = con_all.diag_con_all;
+		else
+			profile->peripheral_mask = 0x7f;
+		profile->method = SWITCH_PARAM_V10;
+		ret = switch_logging(fd, mode, profile);
+		break;
+	case sizeof(struct diag_logging_mode_param_v9):
+		profile->method = SWITCH_PARAM_V9;
+		ret = switch_logging(fd, mode, profile);
+		break;
+	case sizeof(struct diag_logging_mode_param_v7):
+		profile->method = SWITCH_PARAM_V7;
+		ret = switch_logging(fd, mode, profile);
+		break;
+	case sizeof(int):
+		profile->method = SWITCH_INT_PTR;
+		ret = switch_logging(fd, mode, profile);
+		if (ret >= 0)
+			break;
+		profile->method = SWITCH_INT_PTR_EXTRA;
+		ret = switch_logging(fd, mode, profile);
 		break;
 	case 0:
-		// Yuanjie: the following works for Samsung S5
-		ret = ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, (long) mode);
+		profile->method = SWITCH_INT;
+		ret = switch_logging(fd, mode, profile);
 		if (ret >= 0)
 			break;
-		// Same question as above: Is it really necessary?
-		// Yuanjie: the following is used for Xiaomi RedMi 4
-		ret = ioctl(fd, DIAG_IOCTL_SWITCH_LOGGING, (long) mode, 12, 0, 0, 0, 0);
+		profile->method = SWITCH_INT_EXTRA;
+		ret = switch_logging(fd, mode, profile);
 		break;
 	default:
 		LOGW("ioctl DIAG_IOCTL_SWITCH_LOGGING with arglen=%ld is not supported\n", arglen);
@@ -508,12 +802,74 @@ static int enable_logging(struct diag_char_handle_t *handle, int mode)
 		return ret;
 
 	// Ultimate approach: use libdiag.so
-	ret = enable_logging_libdiag(handle->fd, mode);
+	profile->method = SWITCH_LIBDIAG;
+	ret = switch_logging(fd, mode, profile);
 	if (ret >= 0)
 		LOGI("Using libdiag.so to switch logging succeeded\n");
 	return ret;
 }
 
+static int enable_logging(struct diag_char_handle_t *handle, int mode)
+{
+	int ret = -1, fd = handle->fd, cached;
+	struct diag_dci_reg_tbl_t dci_reg_tbl;
+	struct diag_profile_t profile;
+
+	cached = profile_load(&profile) == 0;
+	if (!cached) {
+		profile.peripheral_mask = 0;
+		// Get remote_dev
+		ret = ioctl(fd, DIAG_IOCTL_REMOTE_DEV, &profile.remote_dev);
+		if (ret < 0) {
+			LOGW("DIAG_IOCTL_REMOTE_DEV ioctl failed (%s)\n", strerror(errno));
+			profile.remote_dev = 0;
+		}
+	}
+	handle->remote_dev = profile.remote_dev;
+
+	// Register a DCI client
+	dci_reg_tbl.client_id = 0;
+	dci_reg_tbl.notification_list = 0;
+	dci_reg_tbl.signal_type = SIGPIPE;
+	dci_reg_tbl.token = profile.remote_dev ? DCI_MDM_PROC : DCI_LOCAL_PROC;
+	ret = ioctl(fd, DIAG_IOCTL_DCI_REG, &dci_reg_tbl);
+	if (ret < 0)
+		LOGW("DIAG_IOCTL_DCI_REG ioctl failed (%s)\n", strerror(errno));
+	handle->dci_client = ret;
+
+	/*
+	 * Nexus-6-only logging optimizations
+	 * It will fail on other devices (errno=EFAULT), since DIAG_IOCTL_OPTIMIZED_LOGGING is equal to DIAG_IOCTL_PERIPHERAL_BUF_CONFIG.
+	 * Reference: https://github.com/MotorolaMobilityLLC/kernel-msm/blob/kitkat-4.4.4-release-victara/drivers/char/diag/diagchar_core.c#L1189
+	 */
+	if (!cached)
+		profile.optimized_logging = ioctl(fd, DIAG_IOCTL_OPTIMIZED_LOGGING, (long) 1) >= 0;
+	else if (profile.optimized_logging)
+		(void) ioctl(fd, DIAG_IOCTL_OPTIMIZED_LOGGING, (long) 1);
+
+	// Configure the buffering modes
+	set_buffering_modes(fd);
+
+	if (cached) {
+		ret = switch_logging(fd, mode, &profile);
+		if (ret >= 0) {
+			LOGI("Switching logging with %s from the cached profile succeeded\n",
+			     switch_method_names[profile.method]);
+			return ret;
+		}
+		LOGW("Switching logging with %s from the cached profile failed, probing again\n",
+		     switch_method_names[profile.method]);
+		if (ioctl(fd, DIAG_IOCTL_REMOTE_DEV, &profile.remote_dev) < 0)
+			profile.remote_dev = 0;
+		handle->remote_dev = profile.remote_dev;
+	}
+
+	ret = probe_switch_logging(fd, mode, &profile);
+	if (ret >= 0)
+		profile_save(&profile);
+	return ret;
+}
+
 static diag_handle_t diag_char_open(void)
 {
 	struct diag_char_handle_t *handle;
@@ -530,8 +886,11 @@ static diag_handle_t diag_char_open(void)
 	}
 	if (enable_logging(handle, MEMORY_DEVICE_MODE) < 0)
 		goto fail;
+	if (trace_path && trace_open() < 0)
+		goto fail;
 
 	handle->msg_id = handle->msg_num = 0;
+	handle->aligned = 0;
 	return (diag_handle_t) handle;
 fail:
 	if (handle->fd >= 0)
@@ -580,6 +939,180 @@ static ssize_t diag_char_read(diag_handle_t handle_, const void **buf, long *sta
 	return len;
 }
 
+ssize_t diag_char_parse_batch(struct diag_batch_t *batch, size_t raw_len, int *aligned)
+{
+	char *buf = batch->buf, *msg, *end, *data;
+	struct iovec *last;
+	uint32_t msg_num, i;
+	int *msg_size;
+	ssize_t total, largest;
+	int len;
+
+	if (raw_len < 8 || *(uint32_t *) buf != USER_SPACE_DATA_TYPE)
+		return 0;
+	batch->raw_len = raw_len;
+
+	msg_num = ((uint32_t *) buf)[1];
+	msg = buf + 8;
+	end = buf + raw_len;
+	last = NULL;
+	total = largest = 0;
+	batch->nr_iov = 0;
+	batch->nr_gaps = 0;
+	for (i = 0; i < msg_num; ++i) {
+		msg_size = (int *) msg;
+		if (msg + 4 > end)
+			break;
+		if (msg_size[0] >= 0) {
+			data = msg + 4;
+			len = msg_size[0];
+		} else {
+			data = msg + 8;
+			len = data <= end ? msg_size[1] : -1;
+		}
+		if (len < 0 || len > end - data)
+			break;
+		if (data + len - msg > largest)
+			largest = data + len - msg;
+		msg = data + len;
+
+		/*
+		 * A message following a complete frame must start with
+		 * another one, or something was lost in between.
+		 */
+		if (*aligned && hdlc_check_first((uint8_t *) data, len) == 0)
+			++batch->nr_gaps;
+		if (len > 0)
+			*aligned = data[len - 1] == 0x7e;
+
+		if (batch->nr_iov < batch->max_iov) {
+			last = &batch->iov[batch->nr_iov++];
+			last->iov_base = data;
+			last->iov_len = len;
+		} else {
+			memmove((char *) last->iov_base + last->iov_len, data, len);
+			last->iov_len += len;
+		}
+		total += len;
+	}
+	if (i < msg_num) {
+		LOGW("Malformed read from /dev/diag (%u of %u messages parsed)\n", i, msg_num);
+		*aligned = 0;
+	}
+	/*
+	 * The kernel stops copying at the first message that does not fit, so
+	 * it likely had more if the space left is less than the largest message.
+	 */
+	batch->saturated = (ssize_t) (batch->size - raw_len) < largest;
+	return total;
+}
+
+static void trace_record(const void *buf, size_t len, long stamp)
+{
+	struct diag_trace_record_t record = { .stamp = stamp, .len = len };
+	struct iovec iov[2] = {
+		{ .iov_base = &record, .iov_len = sizeof(record) },
+		{ .iov_base = (void *) buf, .iov_len = len },
+	};
+
+	if (writev(trace_fd, iov, 2) != sizeof(record) + len) {
+		LOGW("Failed to write to the read trace, stop recording (%s)\n", strerror(errno));
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+static ssize_t diag_char_read_batch(diag_handle_t handle_, struct diag_batch_t *batch)
+{
+	struct diag_char_handle_t *handle = (struct diag_char_handle_t *) handle_;
+	ssize_t ret, total;
+
+	for (;;) {
+		batch->read_start = get_monotonic_raw_timestamp();
+		ret = read(handle->fd, batch->buf, batch->size);
+		batch->read_end = get_monotonic_raw_timestamp();
+		if (ret < 8) {
+			LOGW("Failed to read from /dev/diag (%s)\n",
+			     ret >= 0 ? "Read incompletely" : strerror(errno));
+			continue;
+		}
+		batch->stamp = get_posix_timestamp();
+		if (trace_fd >= 0)
+			trace_record(batch->buf, ret, batch->stamp);
+
+		total = diag_char_parse_batch(batch, ret, &handle->aligned);
+		if (total > 0)
+			return total;
+	}
+}
+
+static ssize_t diag_char_send(diag_handle_t handle_, const void *buf, size_t len)
+{
+	struct diag_char_handle_t *handle = (struct diag_char_handle_t *) handle_;
+	ssize_t ret, offset;
+
+	handle->msg_type = USER_SPACE_DATA_TYPE;
+	if (handle->remote_dev) {
+		handle->msg_dev = -MDM;
+		offset = 8;
+	} else {
+		offset = 4;
+	}
+	memcpy(handle->buf + offset, buf, len);
+
+	ret = write(handle->fd, handle->buf, len + offset);
+	if (ret < 0)
+		LOGE("Failed to write into /dev/diag (%s)\n", strerror(errno));
+	handle->msg_id = handle->msg_num = 0;
+	return ret < 0 ? ret : len;
+}
+
+/*
+ * The messages of one read are concatenated into buf, so that the caller
+ * sees a stream of HDLC frames as with the serial device. Reads of other
+ * types (e.g. masks updated by other clients) are skipped.
+ */
+static ssize_t diag_char_recv(diag_handle_t handle_, void *buf, size_t size, int timeout)
+{
+	struct diag_char_handle_t *handle = (struct diag_char_handle_t *) handle_;
+	struct pollfd pfd = { .fd = handle->fd, .events = POLLIN };
+	char *msg, *end, *data, *out = buf;
+	uint32_t msg_num, i;
+	int len;
+	ssize_t ret;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret <= 0)
+		return ret;
+	ret = read(handle->fd, handle->buf, BUFFER_SIZE);
+	if (ret < 8) {
+		LOGE("Failed to receive responses from /dev/diag (%s)\n",
+		     ret >= 0 ? "Read incompletely" : strerror(errno));
+		handle->msg_id = handle->msg_num = 0;
+		return -1;
+	}
+	msg_num = handle->msg_type == USER_SPACE_DATA_TYPE ? handle->msg_num : 0;
+
+	msg = handle->buf + 8;
+	end = handle->buf + ret;
+	for (i = 0; i < msg_num && msg + 4 <= end; ++i) {
+		if (*(int *) msg >= 0) {
+			data = msg + 4;
+			len = *(int *) msg;
+		} else {
+			data = msg + 8;
+			len = data <= end ? ((int *) msg)[1] : -1;
+		}
+		if (len < 0 || len > end - data || len > (char *) buf + size - out)
+			break;
+		memcpy(out, data, len);
+		out += len;
+		msg = data + len;
+	}
+	handle->msg_id = handle->msg_num = 0;
+	return out - (char *) buf;
+}
+
 static ssize_t diag_char_write(diag_handle_t handle_, const void *buf, size_t len)
 {
 	struct diag_char_handle_t *handle = (struct diag_char_handle_t *) handle_;
@@ -636,6 +1169,10 @@ static void diag_char_close(diag_handle_t handle_)
 const struct diag_interface_t diag_char_interface = {
 	.open = &diag_char_open,
 	.read = &diag_char_read,
+	.read_batch = &diag_char_read_batch,
 	.write = &diag_char_write,
+	.send = &diag_char_send,
+	.recv = &diag_char_recv,
+	.drain = &diag_char_drain,
 	.close = &diag_char_close,
 };
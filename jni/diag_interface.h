@@ -1,14 +1,110 @@
 #pragma once
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef uintptr_t diag_handle_t;
 
+/*
+ * All the messages returned by one read from the device.
+ *
+ * buf (of size bytes) and iov (of max_iov entries) are provided by the caller.
+ * The backend reads into buf, and fills iov with the messages found in it.
+ * If there are more than max_iov messages, the remaining ones are moved to
+ * follow the last entry, which is extended to cover them.
+ *
+ * raw_len is the number of bytes returned by read(). read_start and read_end
+ * are CLOCK_MONOTONIC_RAW timestamps taken around it, while stamp is the
+ * CLOCK_REALTIME timestamp taken after it.
+ *
+ * saturated is set if the device likely had more than what fit in buf,
+ * i.e. the reads are falling behind. nr_gaps is the number of messages
+ * which do not continue the HDLC stream correctly, i.e. some logs were lost
+ * before them.
+ */
+struct diag_batch_t {
+	void *buf;
+	size_t size;
+	struct iovec *iov;
+	int max_iov;
+	int nr_iov;
+	size_t raw_len;
+	long read_start;
+	long read_end;
+	long stamp;
+	int saturated;
+	int nr_gaps;
+};
+
+/*
+ * write() sends a command and waits for its response, which is discarded.
+ * send() only sends the command, and recv() gets whatever the device sends
+ * back within timeout milliseconds, i.e. the HDLC frames of the responses
+ * without any message headers. recv() returns 0 on timeout, or if there
+ * is nothing but unrelated data.
+ *
+ * read_batch() returns 0 at the end of the input, which only happens when
+ * replaying, or a negative value on failure.
+ */
 struct diag_interface_t {
 	diag_handle_t (*open)(void);
 	ssize_t (*write)(diag_handle_t handle, const void *buf, size_t len);
+	ssize_t (*send)(diag_handle_t handle, const void *buf, size_t len);
+	ssize_t (*recv)(diag_handle_t handle, void *buf, size_t size, int timeout);
 	ssize_t (*read)(diag_handle_t handle, const void **buf, long *stamp);
+	ssize_t (*read_batch)(diag_handle_t handle, struct diag_batch_t *batch);
+	// Flush the buffers of the peripherals, NULL if there are none
+	int (*drain)(diag_handle_t handle);
 	void (*close)(diag_handle_t handle);
 };
 
 extern const struct diag_interface_t diag_char_interface;
 extern const struct diag_interface_t diag_serial_interface;
+extern const struct diag_interface_t diag_replay_interface;
+
+/*
+ * A trace of the raw reads from /dev/diag starts with DIAG_TRACE_MAGIC.
+ * Then every read has a record followed by the len bytes returned by read().
+ * stamp is the CLOCK_REALTIME timestamp taken after the read.
+ */
+#define DIAG_TRACE_MAGIC 0x45434152545f4744ull
+
+struct diag_trace_record_t {
+	int64_t stamp;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/*
+ * Cache what is found by probing /dev/diag in the file, so that the next
+ * start skips the probing. It must be set before the interface is opened.
+ */
+void diag_char_set_profile_cache(const char *path);
+
+/*
+ * Set the buffering mode of a peripheral by PERIPHERAL:MODE[:HIGH:LOW],
+ * e.g. modem:threshold:80:20, where MODE is streaming, threshold or circular,
+ * and the watermarks are percentages of the peripheral buffer.
+ */
+int diag_char_set_buffering(const char *spec);
+
+/*
+ * Record every read from /dev/diag into a trace, which can be replayed.
+ * It must be set before the interface is opened.
+ */
+void diag_char_set_trace(const char *path);
+
+/*
+ * Parse a MEMORY_DEVICE_MODE read of raw_len bytes in batch->buf into
+ * batch->iov, and set the other fields but the times. aligned is kept across
+ * calls, to tell whether the last message ended at a frame boundary. The
+ * length of the messages is returned, or 0 if it is not a read of logs.
+ */
+ssize_t diag_char_parse_batch(struct diag_batch_t *batch, size_t raw_len, int *aligned);
+
+/*
+ * Replay a raw read trace, or a data log and its stamp log given as
+ * DLOG,TLOG, with speed times the original rate, or as fast as possible
+ * if speed is 0. It must be set before the interface is opened.
+ */
+void diag_replay_set_source(const char *spec, double speed);
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include "common.h"
+#include "diag_interface.h"
+#include "stamp.h"
+
+#define RESPONSE_SIZE 65536
+#define LZ4_MAGIC 0x184d2204
+
+/*
+ * Replay what was captured before, so that the capture path can be
+ * exercised and benchmarked without a device. Each stamp record of a data
+ * log (or each read of a trace) becomes one read, which is delayed to keep
+ * the original pace, scaled by the speed.
+ */
+struct diag_replay_handle_t {
+	int data_fd;
+	FILE *stamp_fp;
+	int trace;
+	int message_stamps;
+	int aligned;
+
+	// The current record, which covers [offset, end) of the data log
+	uint64_t offset;
+	uint64_t end;
+	long stamp;
+	struct stamp_msg_t *msgs;
+	uint32_t nr_msgs;
+	uint32_t max_msgs;
+	uint32_t msg_id;
+	uint32_t msg_left;
+
+	long first_stamp;
+	long start_time;
+	uint64_t nr_reads;
+	uint64_t nr_bytes;
+
+	// The commands sent are echoed back as their responses
+	size_t response_len;
+	char response[RESPONSE_SIZE];
+};
+
+static const char *replay_spec;
+static double replay_speed = 1;
+
+void diag_replay_set_source(const char *spec, double speed)
+{
+	replay_spec = spec;
+	replay_speed = speed;
+}
+
+static int replay_is_compressed(int fd)
+{
+	uint32_t magic;
+
+	if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+		return 0;
+	return magic == LZ4_MAGIC;
+}
+
+static int replay_open_stamps(struct diag_replay_handle_t *handle, const char *path)
+{
+	struct stamp_log_t header;
+
+	handle->stamp_fp = fopen(path, "rb");
+	if (!handle->stamp_fp) {
+		LOGE("Cannot open stamp log %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	if (replay_is_compressed(fileno(handle->stamp_fp))) {
+		LOGE("Stamp log %s is compressed, decompress it first\n", path);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, handle->stamp_fp) == 1 &&
+	    header.offset == STAMP_LOG_MAGIC_OFFSET && header.stamp == STAMP_LOG_MAGIC_V2)
+		handle->message_stamps = 1;
+	else
+		rewind(handle->stamp_fp);
+	return 0;
+}
+
+static diag_handle_t diag_replay_open(void)
+{
+	struct diag_replay_handle_t *handle;
+	char *data_path, *stamp_path;
+	uint64_t magic;
+
+	if (!replay_spec) {
+		LOGE("Nothing to replay\n");
+		return 0;
+	}
+	handle = calloc(1, sizeof(struct diag_replay_handle_t));
+	data_path = strdup(replay_spec);
+	if (!handle || !data_path) {
+		LOGE("Cannot allocate memory for diag_replay_handle_t\n");
+		free(handle);
+		free(data_path);
+		return 0;
+	}
+	stamp_path = strchr(data_path, ',');
+	if (stamp_path)
+		*stamp_path++ = '\0';
+
+	handle->data_fd = open(data_path, O_RDONLY);
+	if (handle->data_fd < 0) {
+		LOGE("Cannot open %s (%s)\n", data_path, strerror(errno));
+		goto fail;
+	}
+	if (replay_is_compressed(handle->data_fd)) {
+		LOGE("Data log %s is compressed, decompress it first\n", data_path);
+		goto fail;
+	}
+
+	if (read(handle->data_fd, &magic, sizeof(magic)) == sizeof(magic) &&
+	    magic == DIAG_TRACE_MAGIC) {
+		handle->trace = 1;
+	} else if (!stamp_path) {
+		LOGE("%s is not a read trace, and no stamp log is given\n", data_path);
+		goto fail;
+	} else {
+		lseek(handle->data_fd, 0, SEEK_SET);
+		if (replay_open_stamps(handle, stamp_path) < 0)
+			goto fail;
+	}
+
+	handle->first_stamp = -1;
+	if (replay_speed > 0)
+		LOGI("Replaying %s at %g times the original pace\n", replay_spec, replay_speed);
+	else
+		LOGI("Replaying %s as fast as possible\n", replay_spec);
+	free(data_path);
+	return (diag_handle_t) handle;
+fail:
+	if (handle->data_fd >= 0)
+		close(handle->data_fd);
+	if (handle->stamp_fp)
+		fclose(handle->stamp_fp);
+	free(handle);
+	free(data_path);
+	return 0;
+}
+
+/*
+ * Sleep until the time of the stamp in the replay. The first stamp is
+ * replayed right away.
+ */
+static void replay_wait(struct diag_replay_handle_t *handle, long stamp)
+{
+	struct timespec ts;
+	long due, now;
+
+	if (handle->first_stamp < 0) {
+		handle->first_stamp = stamp;
+		handle->start_time = get_monotonic_raw_timestamp();
+	}
+	if (replay_speed <= 0 || stamp < handle->first_stamp)
+		return;
+
+	due = handle->start_time + (long) ((stamp - handle->first_stamp) / replay_speed);
+	now = get_monotonic_raw_timestamp();
+	if (due <= now)
+		return;
+	ts.tv_sec = (due - now) / 1000000000;
+	ts.tv_nsec = (due - now) % 1000000000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Load the next stamp record. 0 is returned at the end of the stamp log.
+ */
+static int replay_next_record(struct diag_replay_handle_t *handle)
+{
+	struct stamp_log_t slog;
+	struct stamp_batch_t sbatch;
+	struct stamp_msg_t *msgs;
+	uint64_t len = 0;
+	uint32_t i;
+
+	if (!handle->message_stamps) {
+		if (fread(&slog, sizeof(slog), 1, handle->stamp_fp) != 1)
+			return 0;
+		handle->end = slog.offset;
+		handle->stamp = slog.stamp;
+		return 1;
+	}
+
+	if (fread(&sbatch, sizeof(sbatch), 1, handle->stamp_fp) != 1)
+		return 0;
+	if (sbatch.nr_msgs > handle->max_msgs) {
+		msgs = realloc(handle->msgs, sbatch.nr_msgs * sizeof(struct stamp_msg_t));
+		if (!msgs) {
+			LOGE("Cannot allocate memory for message stamps\n");
+			return 0;
+		}
+		handle->msgs = msgs;
+		handle->max_msgs = sbatch.nr_msgs;
+	}
+	if (fread(handle->msgs, sizeof(struct stamp_msg_t), sbatch.nr_msgs,
+		  handle->stamp_fp) != sbatch.nr_msgs)
+		return 0;
+	for (i = 0; i < sbatch.nr_msgs; ++i)
+		len += handle->msgs[i].len;
+
+	// Skip anything in the data log not covered by the stamps
+	if (sbatch.offset != handle->offset) {
+		LOGW("Stamp log skips from %llu to %llu\n", (unsigned long long) handle->offset,
+		     (unsigned long long) sbatch.offset);
+		lseek(handle->data_fd, sbatch.offset, SEEK_SET);
+		handle->offset = sbatch.offset;
+	}
+	handle->end = sbatch.offset + len;
+	handle->stamp = sbatch.stamp;
+	handle->nr_msgs = sbatch.nr_msgs;
+	handle->msg_id = 0;
+	handle->msg_left = sbatch.nr_msgs ? handle->msgs[0].len : 0;
+	return 1;
+}
+
+/*
+ * Describe the len bytes read into batch->buf by the message lengths in
+ * the stamp log, or as one chunk without them. A record larger than the
+ * buffer is split, and the rest is returned by the next read.
+ */
+static void replay_fill_iov(struct diag_replay_handle_t *handle, struct diag_batch_t *batch,
+			    size_t len)
+{
+	char *data = batch->buf;
+	struct iovec *last = NULL;
+	size_t chunk;
+
+	batch->nr_iov = 0;
+	while (len > 0) {
+		chunk = len;
+		while (handle->msg_left == 0 && handle->msg_id + 1 < handle->nr_msgs)
+			handle->msg_left = handle->msgs[++handle->msg_id].len;
+		if (handle->msg_left > 0) {
+			if (handle->msg_left < chunk)
+				chunk = handle->msg_left;
+			handle->msg_left -= chunk;
+		}
+		if (batch->nr_iov < batch->max_iov) {
+			last = &batch->iov[batch->nr_iov++];
+			last->iov_base = data;
+			last->iov_len = chunk;
+		} else {
+			last->iov_len += chunk;
+		}
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+static ssize_t replay_read_log(struct diag_replay_handle_t *handle, struct diag_batch_t *batch)
+{
+	ssize_t ret;
+	size_t len;
+
+	while (handle->offset >= handle->end) {
+		if (!replay_next_record(handle))
+			return 0;
+		if (handle->end > handle->offset)
+			replay_wait(handle, handle->stamp);
+	}
+
+	len = handle->end - handle->offset;
+	if (len > batch->size)
+		len = batch->size;
+	batch->read_start = get_monotonic_raw_timestamp();
+	ret = read(handle->data_fd, batch->buf, len);
+	batch->read_end = get_monotonic_raw_timestamp();
+	if (ret < 0) {
+		LOGE("Failed to read the data log (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (ret == 0)
+		return 0;
+
+	handle->offset += ret;
+	batch->stamp = handle->stamp;
+	batch->raw_len = ret;
+	batch->saturated = handle->offset < handle->end;
+	batch->nr_gaps = 0;
+	replay_fill_iov(handle, batch, ret);
+	return ret;
+}
+
+static ssize_t replay_read_trace(struct diag_replay_handle_t *handle, struct diag_batch_t *batch)
+{
+	struct diag_trace_record_t record;
+	size_t len;
+	ssize_t ret;
+
+	for (;;) {
+		if (read(handle->data_fd, &record, sizeof(record)) != sizeof(record))
+			return 0;
+		replay_wait(handle, record.stamp);
+
+		// A read larger than the buffer is truncated, as the kernel would not do it
+		len = record.len < batch->size ? record.len : batch->size;
+		batch->read_start = get_monotonic_raw_timestamp();
+		ret = read(handle->data_fd, batch->buf, len);
+		batch->read_end = get_monotonic_raw_timestamp();
+		if (ret != len)
+			return ret < 0 ? -1 : 0;
+		if (record.len > len) {
+			LOGW("Read of %u bytes truncated to the buffer of %zu bytes\n", record.len, len);
+			lseek(handle->data_fd, record.len - len, SEEK_CUR);
+		}
+
+		batch->stamp = record.stamp;
+		ret = diag_char_parse_batch(batch, len, &handle->aligned);
+		if (record.len > len)
+			batch->saturated = 1;
+		if (ret > 0)
+			return ret;
+	}
+}
+
+static ssize_t diag_replay_read_batch(diag_handle_t handle_, struct diag_batch_t *batch)
+{
+	struct diag_replay_handle_t *handle = (struct diag_replay_handle_t *) handle_;
+	ssize_t ret;
+	double elapsed;
+
+	if (handle->trace)
+		ret = replay_read_trace(handle, batch);
+	else
+		ret = replay_read_log(handle, batch);
+
+	if (ret > 0) {
+		++handle->nr_reads;
+		handle->nr_bytes += batch->raw_len;
+	} else if (ret == 0) {
+		elapsed = handle->first_stamp < 0 ? 0 :
+			  (get_monotonic_raw_timestamp() - handle->start_time) / 1e9;
+		LOGI("Replayed %llu bytes in %llu reads in %.3f s (%.1f MB/s)\n",
+		     (unsigned long long) handle->nr_bytes, (unsigned long long) handle->nr_reads,
+		     elapsed, elapsed > 0 ? handle->nr_bytes / elapsed / 1e6 : 0);
+	}
+	return ret;
+}
+
+static ssize_t diag_replay_read(diag_handle_t handle_, const void **buf, long *stamp)
+{
+	LOGE("Replaying is only supported by batches\n");
+	return -1;
+}
+
+static ssize_t diag_replay_send(diag_handle_t handle_, const void *buf, size_t len)
+{
+	struct diag_replay_handle_t *handle = (struct diag_replay_handle_t *) handle_;
+
+	if (handle->response_len + len <= RESPONSE_SIZE) {
+		memcpy(handle->response + handle->response_len, buf, len);
+		handle->response_len += len;
+	}
+	return len;
+}
+
+static ssize_t diag_replay_recv(diag_handle_t handle_, void *buf, size_t size, int timeout)
+{
+	struct diag_replay_handle_t *handle = (struct diag_replay_handle_t *) handle_;
+	size_t len = handle->response_len < size ? handle->response_len : size;
+
+	memcpy(buf, handle->response, len);
+	memmove(handle->response, handle->response + len, handle->response_len - len);
+	handle->response_len -= len;
+	return len;
+}
+
+static ssize_t diag_replay_write(diag_handle_t handle_, const void *buf, size_t len)
+{
+	return len;
+}
+
+static void diag_replay_close(diag_handle_t handle_)
+{
+	struct diag_replay_handle_t *handle = (struct diag_replay_handle_t *) handle_;
+
+	close(handle->data_fd);
+	if (handle->stamp_fp)
+		fclose(handle->stamp_fp);
+	free(handle->msgs);
+	free(handle);
+}
+
+const struct diag_interface_t diag_replay_interface = {
+	.open = &diag_replay_open,
+	.read = &diag_replay_read,
+	.read_batch = &diag_replay_read_batch,
+	.write = &diag_replay_write,
+	.send = &diag_replay_send,
+	.recv = &diag_replay_recv,
+	.close = &diag_replay_close,
+};
@@ -1,6 +1,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <malloc.h>
 #include <string.h>
 #include <errno.h>
@@ -57,38 +58,96 @@ out:
 	return 0;
 }
 
-static ssize_t diag_serial_read(diag_handle_t handle_, const void **buf, long *stamp)
+static ssize_t diag_serial_read_into(struct diag_serial_handle_t *handle, char *rbuf,
+				     size_t size, const void **buf, long *stamp)
 {
-	struct diag_serial_handle_t *handle = (struct diag_serial_handle_t *) handle_;
-
 	for (;;) {
-		ssize_t len = read(handle->fd, handle->buf, BUFFER_SIZE);
+		ssize_t len = read(handle->fd, rbuf, size);
 		long current_stamp = get_posix_timestamp();
 
 		if (handle->drop_first) {
 			char *msg = NULL;
 			ssize_t i;
 			for (i = 0; i < len && !msg; ++i)
-				if (handle->buf[i] == 0x7e)
-					msg = &handle->buf[i + 1];
+				if (rbuf[i] == 0x7e)
+					msg = &rbuf[i + 1];
 			if (msg)
 				--handle->drop_first;
 			if (handle->drop_first)
 				continue;
-			if (msg == handle->buf + len)
+			if (msg == rbuf + len)
 				continue;
 			*buf = msg;
 			if (stamp)
 				*stamp = current_stamp;
-			return handle->buf + len - msg;
+			return rbuf + len - msg;
 		}
-		*buf = handle->buf;
+		*buf = rbuf;
 		if (stamp)
 			*stamp = current_stamp;
 		return len;
 	}
 }
 
+static ssize_t diag_serial_read(diag_handle_t handle_, const void **buf, long *stamp)
+{
+	struct diag_serial_handle_t *handle = (struct diag_serial_handle_t *) handle_;
+
+	return diag_serial_read_into(handle, handle->buf, BUFFER_SIZE, buf, stamp);
+}
+
+static ssize_t diag_serial_read_batch(diag_handle_t handle_, struct diag_batch_t *batch)
+{
+	struct diag_serial_handle_t *handle = (struct diag_serial_handle_t *) handle_;
+	const void *buf;
+	ssize_t len;
+
+	batch->read_start = get_monotonic_raw_timestamp();
+	len = diag_serial_read_into(handle, batch->buf, batch->size, &buf, &batch->stamp);
+	batch->read_end = get_monotonic_raw_timestamp();
+	if (len <= 0)
+		return -1;
+	batch->raw_len = (char *) buf + len - (char *) batch->buf;
+	// Without message boundaries, a full buffer is all that can be told
+	batch->saturated = batch->raw_len >= batch->size;
+	batch->nr_gaps = 0;
+
+	// There are no message boundaries for serial devices, so it is one chunk
+	batch->iov[0].iov_base = (void *) buf;
+	batch->iov[0].iov_len = len;
+	batch->nr_iov = 1;
+	return len;
+}
+
+static ssize_t diag_serial_send(diag_handle_t handle_, const void *buf, size_t len)
+{
+	struct diag_serial_handle_t *handle = (struct diag_serial_handle_t *) handle_;
+	int ret;
+
+	ret = write(handle->fd, buf, len);
+	if (ret != len)
+		LOGE("Failed to write into /dev/ttyUSB0 (%s)\n",
+		     ret >= 0 ? "Write incompletely" : strerror(errno));
+	handle->drop_first = 3;
+	return ret;
+}
+
+static ssize_t diag_serial_recv(diag_handle_t handle_, void *buf, size_t size, int timeout)
+{
+	struct diag_serial_handle_t *handle = (struct diag_serial_handle_t *) handle_;
+	struct pollfd pfd = { .fd = handle->fd, .events = POLLIN };
+	ssize_t ret;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret <= 0)
+		return ret;
+	ret = read(handle->fd, buf, size);
+	if (ret <= 0)
+		LOGE("Failed to receive responses from /dev/ttyUSB0 (%s)\n",
+		     ret == 0 ? "Empty response" : strerror(errno));
+	return ret ? ret : -1;
+}
+
 static ssize_t diag_serial_write(diag_handle_t handle_, const void *buf, size_t len)
 {
 	struct diag_serial_handle_t *handle = (struct diag_serial_handle_t *) handle_;
@@ -125,6 +184,9 @@ static void diag_serial_close(diag_handle_t handle_)
 const struct diag_interface_t diag_serial_interface = {
 	.open = &diag_serial_open,
 	.read = &diag_serial_read,
+	.read_batch = &diag_serial_read_batch,
 	.write = &diag_serial_write,
+	.send = &diag_serial_send,
+	.recv = &diag_serial_recv,
 	.close = &diag_serial_close,
 };
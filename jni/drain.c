@@ -0,0 +1,85 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "common.h"
+#include "drain.h"
+
+static const struct diag_interface_t *drain_interface;
+static diag_handle_t drain_handle;
+static unsigned long drain_interval;
+
+static pthread_t drain_thread;
+static sem_t drain_sem;
+static volatile sig_atomic_t drain_started;
+static volatile sig_atomic_t drain_stopping;
+
+static unsigned long drain_count;
+
+static int drain_wait(void)
+{
+	if (!drain_interval)
+		return sem_wait(&drain_sem);
+	return sem_wait_monotonic(&drain_sem, drain_interval);
+}
+
+/*
+ * Both the timeouts and the requests lead to a drain. The drain ioctl only
+ * takes a short time in the kernel, so it does not disturb the capture
+ * thread reading from the same device.
+ */
+static void *drain_main(void *arg)
+{
+	for (;;) {
+		if (drain_wait() < 0 && errno != ETIMEDOUT)
+			continue;
+		if (drain_stopping)
+			break;
+		(*drain_interface->drain)(drain_handle);
+		++drain_count;
+	}
+	return NULL;
+}
+
+int drain_start(const struct diag_interface_t *interface, diag_handle_t handle,
+		unsigned long interval)
+{
+	int ret;
+
+	if (!interface->drain) {
+		LOGW("The diag interface does not support draining\n");
+		return 0;
+	}
+
+	drain_interface = interface;
+	drain_handle = handle;
+	drain_interval = interval;
+	sem_init(&drain_sem, 0, 0);
+
+	ret = pthread_create(&drain_thread, NULL, &drain_main, NULL);
+	if (ret != 0) {
+		LOGE("Failed to create the drain thread (%s)\n", strerror(ret));
+		return -1;
+	}
+	drain_started = 1;
+	return 0;
+}
+
+void drain_request(void)
+{
+	if (drain_started)
+		sem_post(&drain_sem);
+}
+
+void drain_stop(void)
+{
+	if (!drain_started)
+		return;
+	drain_stopping = 1;
+	sem_post(&drain_sem);
+	pthread_join(drain_thread, NULL);
+	drain_started = 0;
+	LOGI("Drained the peripheral buffers %lu times\n", drain_count);
+}
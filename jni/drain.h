@@ -0,0 +1,16 @@
+#pragma once
+#include "diag_interface.h"
+
+/*
+ * Start the drain thread, which asks the peripherals to flush their buffers
+ * every interval milliseconds (never if it is 0), and whenever requested.
+ */
+int drain_start(const struct diag_interface_t *interface, diag_handle_t handle,
+		unsigned long interval);
+
+/*
+ * Request a drain now. It is safe to call it from a signal handler.
+ */
+void drain_request(void);
+
+void drain_stop(void);
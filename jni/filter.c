@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "common.h"
+#include "filter.h"
+
+#define LOG_CODE_MAX 0xffff
+#define FILTER_HEADER_LEN 16
+
+static int filter_enabled;
+static uint32_t filter_bitmap[(LOG_CODE_MAX + 1) / 32];
+
+/*
+ * Frames may be cut by the end of messages, so whether the next byte starts
+ * a new frame and the decision for the current frame are kept across them.
+ */
+static int filter_frame_start = 1;
+static int filter_keep_current = 1;
+
+static struct iovec filter_iov[CAPTURE_MAX_IOV];
+static int filter_nr_iov;
+static size_t filter_len;
+
+static uint64_t filter_dropped_frames;
+static uint64_t filter_dropped_bytes;
+
+static void filter_set(unsigned long first, unsigned long last, int allow)
+{
+	unsigned long code;
+
+	for (code = first; code <= last && code <= LOG_CODE_MAX; ++code) {
+		if (allow)
+			filter_bitmap[code / 32] |= 1u << (code % 32);
+		else
+			filter_bitmap[code / 32] &= ~(1u << (code % 32));
+	}
+}
+
+int filter_load(const char *filename)
+{
+	char line[256], *p, *end;
+	unsigned long first, last;
+	int lineno = 0, allow, has_allow = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		LOGE("Failed to open the filter %s (%s)\n", filename, strerror(errno));
+		return -1;
+	}
+
+	// The first pass decides the default policy
+	while (fgets(line, sizeof(line), fp)) {
+		for (p = line; *p == ' ' || *p == '\t'; ++p)
+			;
+		if (*p != '#' && *p != '!' && *p != '\n' && *p != '\0')
+			has_allow = 1;
+	}
+	memset(filter_bitmap, has_allow ? 0x00 : 0xff, sizeof(filter_bitmap));
+
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)) {
+		++lineno;
+		for (p = line; *p == ' ' || *p == '\t'; ++p)
+			;
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		allow = *p != '!';
+		if (!allow)
+			++p;
+		first = last = strtoul(p, &end, 0);
+		if (end != p && *end == '-')
+			last = strtoul(p = end + 1, &end, 0);
+		if (end == p || first > last || last > LOG_CODE_MAX) {
+			LOGE("Invalid log code at line %d of the filter %s\n", lineno, filename);
+			fclose(fp);
+			return -1;
+		}
+		filter_set(first, last, allow);
+	}
+
+	fclose(fp);
+	filter_enabled = 1;
+	return 0;
+}
+
+/*
+ * Decide whether the frame starting at buf should be kept. Only the bytes
+ * before the end of the message are available, and the frame is kept if
+ * its header is not complete there.
+ *
+ * The header layout is the same as the one in stamp_corrector.
+ */
+static int filter_decide(const char *buf, const char *end)
+{
+	uint8_t header[FILTER_HEADER_LEN];
+	uint64_t start_bytes;
+	size_t len = 0, offset = 0;
+	uint16_t code;
+	char c;
+
+	while (buf < end && len < FILTER_HEADER_LEN) {
+		c = *buf++;
+		if (c == 0x7e)
+			break;
+		if (c == 0x7d) {
+			if (buf == end)
+				break;
+			c = *buf++ ^ 0x20;
+		}
+		header[len++] = c;
+	}
+
+	if (len >= 8) {
+		memcpy(&start_bytes, header, sizeof(start_bytes));
+		if (start_bytes == 0x200000198 || start_bytes == 0x100000198)
+			offset = 8;
+	}
+	if (len < offset + 8)
+		return 1;
+	if (header[offset] != 0x10)
+		return 1;
+
+	code = header[offset + 6] | (header[offset + 7] << 8);
+	return (filter_bitmap[code / 32] >> (code % 32)) & 1;
+}
+
+/*
+ * Append a range to the output. Adjacent ranges are merged, and if there
+ * are too many ranges, the remaining ones are moved to follow the last one.
+ */
+static void filter_emit(char *buf, size_t len)
+{
+	struct iovec *last = filter_nr_iov ? &filter_iov[filter_nr_iov - 1] : NULL;
+
+	if (len == 0)
+		return;
+	filter_len += len;
+	if (last && (char *) last->iov_base + last->iov_len == buf) {
+		last->iov_len += len;
+	} else if (filter_nr_iov < CAPTURE_MAX_IOV) {
+		filter_iov[filter_nr_iov].iov_base = buf;
+		filter_iov[filter_nr_iov].iov_len = len;
+		++filter_nr_iov;
+	} else {
+		memmove((char *) last->iov_base + last->iov_len, buf, len);
+		last->iov_len += len;
+	}
+}
+
+void filter_apply(struct capture_buf_t *cbuf)
+{
+	char *buf, *end, *frame_end;
+	int i;
+
+	if (!filter_enabled)
+		return;
+
+	filter_nr_iov = 0;
+	filter_len = 0;
+	for (i = 0; i < cbuf->nr_iov; ++i) {
+		buf = cbuf->iov[i].iov_base;
+		end = buf + cbuf->iov[i].iov_len;
+		while (buf < end) {
+			if (filter_frame_start) {
+				filter_keep_current = filter_decide(buf, end);
+				filter_dropped_frames += !filter_keep_current;
+			}
+
+			frame_end = memchr(buf, 0x7e, end - buf);
+			filter_frame_start = frame_end != NULL;
+			frame_end = frame_end ? frame_end + 1 : end;
+
+			if (filter_keep_current)
+				filter_emit(buf, frame_end - buf);
+			else
+				filter_dropped_bytes += frame_end - buf;
+			buf = frame_end;
+		}
+	}
+
+	memcpy(cbuf->iov, filter_iov, filter_nr_iov * sizeof(struct iovec));
+	cbuf->nr_iov = filter_nr_iov;
+	cbuf->len = filter_len;
+}
+
+void filter_report(void)
+{
+	if (filter_enabled)
+		LOGI("Filter dropped %llu log packets (%llu bytes)\n",
+		     (unsigned long long) filter_dropped_frames,
+		     (unsigned long long) filter_dropped_bytes);
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "capture.h"
+
+/*
+ * Load the log code filter. Each line of the file is a log code or a range
+ * of log codes (e.g. 0xb0c0 or 0xb000-0xb0ff), optionally prefixed by '!'
+ * to deny them. If there are any allowed codes, all the other log packets
+ * are dropped; otherwise only the denied ones are dropped. Lines starting
+ * with '#' are ignored. Packets other than log packets are always kept.
+ */
+int filter_load(const char *filename);
+
+/*
+ * Drop the unwanted log packets from the batch, in place.
+ */
+void filter_apply(struct capture_buf_t *cbuf);
+
+void filter_report(void);
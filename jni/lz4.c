@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define LZ4_MAGIC		0x184d2204
+/* Version 01, independent blocks, no checksums */
+#define LZ4_FLG			0x60
+/* Maximum block size 64 KiB */
+#define LZ4_BD			0x40
+/* (XXH32(LZ4_FLG, LZ4_BD) >> 8) & 0xff */
+#define LZ4_HC			0x82
+
+#define LZ4_HASH_LOG		12
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5
+#define LZ4_MF_LIMIT		12
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void lz4_write32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t lz4_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_write_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/*
+ * Emit one sequence. If match_len is zero, it is the last sequence, which
+ * only contains literals.
+ */
+static uint8_t *lz4_write_sequence(uint8_t *op, const uint8_t *literals, size_t literal_len,
+				   size_t match_len, size_t offset)
+{
+	uint8_t *token = op++;
+
+	*token = (literal_len >= 15 ? 15 : literal_len) << 4;
+	if (literal_len >= 15)
+		op = lz4_write_length(op, literal_len - 15);
+	memcpy(op, literals, literal_len);
+	op += literal_len;
+	if (!match_len)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+	match_len -= LZ4_MIN_MATCH;
+	*token |= match_len >= 15 ? 15 : match_len;
+	if (match_len >= 15)
+		op = lz4_write_length(op, match_len - 15);
+	return op;
+}
+
+/*
+ * A greedy single-pass compressor with a small hash table. Since a block
+ * never exceeds 64 KiB, positions fit in 16 bits and every match offset is
+ * within the range allowed by the format.
+ */
+static size_t lz4_compress_block(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	uint16_t table[1 << LZ4_HASH_LOG];
+	const uint8_t *ip = src, *anchor = src, *end = src + len;
+	const uint8_t *mf_limit = end - LZ4_MF_LIMIT;
+	const uint8_t *match_limit = end - LZ4_LAST_LITERALS;
+	const uint8_t *ref, *mp, *rp;
+	uint8_t *op = dst;
+	uint32_t h;
+
+	if (len <= LZ4_MF_LIMIT)
+		goto out;
+
+	memset(table, 0, sizeof(table));
+	for (++ip; ip <= mf_limit; ) {
+		h = lz4_hash(lz4_read32(ip));
+		ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || lz4_read32(ref) != lz4_read32(ip)) {
+			++ip;
+			continue;
+		}
+
+		mp = ip + LZ4_MIN_MATCH;
+		rp = ref + LZ4_MIN_MATCH;
+		while (mp < match_limit && *mp == *rp) {
+			++mp;
+			++rp;
+		}
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			--ip;
+			--ref;
+		}
+
+		op = lz4_write_sequence(op, anchor, ip - anchor, mp - ip, ip - ref);
+		anchor = ip = mp;
+	}
+
+out:
+	return lz4_write_sequence(op, anchor, end - anchor, 0, 0) - dst;
+}
+
+size_t lz4_compress_frame(const void *src, size_t len, void *dst)
+{
+	uint8_t *op = dst;
+	size_t block_len;
+
+	lz4_write32(op, LZ4_MAGIC);
+	op[4] = LZ4_FLG;
+	op[5] = LZ4_BD;
+	op[6] = LZ4_HC;
+	op += 7;
+
+	block_len = lz4_compress_block(src, len, op + 4);
+	if (block_len >= len) {
+		// Incompressible, store it as it is
+		memcpy(op + 4, src, len);
+		lz4_write32(op, len | 0x80000000u);
+		op += 4 + len;
+	} else {
+		lz4_write32(op, block_len);
+		op += 4 + block_len;
+	}
+
+	lz4_write32(op, 0);
+	return op + 4 - (uint8_t *) dst;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * A minimal LZ4 compressor, producing standard LZ4 frames, which can be
+ * decompressed by the lz4 command line tool or by stamp_corrector.
+ *
+ * Every frame holds one independent block of at most LZ4_MAX_BLOCK_SIZE
+ * bytes, so a file can be decompressed frame by frame, and a truncated file
+ * only loses its last frame.
+ */
+
+#define LZ4_MAX_BLOCK_SIZE 65536
+// Magic, descriptor, block size, the worst case of the block and end mark
+#define LZ4_FRAME_BOUND(len) (7 + 4 + (len) + (len) / 255 + 16 + 4)
+
+/*
+ * Compress len (<= LZ4_MAX_BLOCK_SIZE) bytes into one frame.
+ * The size of dst must be at least LZ4_FRAME_BOUND(len).
+ * The length of the frame is returned.
+ */
+size_t lz4_compress_frame(const void *src, size_t len, void *dst);
@@ -11,8 +11,21 @@
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "common.h"
 #include "diag_interface.h"
+#include "capture.h"
+#include "segment.h"
+#include "compress.h"
+#include "stream.h"
+#include "filter.h"
+#include "correct.h"
+#include "command.h"
+#include "drain.h"
+#include "stats.h"
+#include "stamp.h"
 
 struct buffer_t {
 	size_t len;
@@ -25,6 +38,11 @@ static const struct diag_interface_t *diag_available_interfaces[] = {
 	NULL,
 };
 
+static const struct diag_interface_t *diag_replay_interfaces[] = {
+	&diag_replay_interface,
+	NULL,
+};
+
 static const struct diag_interface_t *diag_interface;
 static diag_handle_t diag_handle;
 
@@ -78,11 +96,19 @@ fail:
 	return ret;
 }
 
-static int write_commands(const struct buffer_t *cmd_buffer)
+/*
+ * With a window of one, each command waits for its response before the next
+ * one is sent. Otherwise they are pipelined, which is much faster on slow
+ * devices, e.g. serial ones.
+ */
+static int write_commands(const struct buffer_t *cmd_buffer, int window)
 {
 	char *now = cmd_buffer->buf;
 	char *end = now + cmd_buffer->len;
 
+	if (window > 1)
+		return command_submit(diag_interface, diag_handle, now, end - now, window) < 0 ? -1 : 0;
+
 	while (now < end) {
 		size_t len = 0;
 		ssize_t wlen;
@@ -103,125 +129,431 @@ static int write_commands(const struct buffer_t *cmd_buffer)
 	return 0;
 }
 
-static int retrieve_logs(const char *data_log_prefix,
-			 const char *stamp_log_prefix)
+/*
+ * What the writer gets from the capture pipeline: either a batch from the
+ * capture thread, or a compressed one from the compression thread.
+ */
+struct output_t {
+	const struct iovec *iov;
+	int nr_iov;
+	size_t len;
+	size_t raw_len;
+	long stamp;
+	long read_end;
+	const struct stamp_msg_t *msgs;
+	int nr_msgs;
+	long msg_stamp;
+	struct iovec zbuf_iov;
+};
+
+static int compression;
+static int message_stamps;
+static int correction;
+static size_t max_buf_size = CAPTURE_DEFAULT_MAX_BUF_SIZE;
+static unsigned int max_nr_bufs = CAPTURE_DEFAULT_MAX_NR_BUFS;
+
+static int next_output(struct output_t *out)
 {
-	static char data_log_name[FILENAME_MAX];
-	static char stamp_log_name[FILENAME_MAX];
-
-	size_t dlog_plen = strlen(data_log_prefix);
-	size_t tlog_plen = strlen(stamp_log_prefix);
-
-	if (dlog_plen > FILENAME_MAX - 11) {
-		LOGE("Invalid argument: data log prefix is too long\n");
-		return -4;
-	}
-	if (tlog_plen > FILENAME_MAX - 11) {
-		LOGE("Invalid argument: stamp log prefix is too long\n");
-		return -5;
-	}
-
-	strcpy(data_log_name, data_log_prefix);
-	strcpy(stamp_log_name, stamp_log_prefix);
-
-	strcpy(data_log_name + dlog_plen, ".0000.dlog");
-	strcpy(stamp_log_name + tlog_plen, ".0000.tlog");
-
-	const void *buf;
-	ssize_t len, wlen;
-	long stamp, last_stamp;
-	struct {
-		uint64_t offset;
-		uint64_t stamp;
-	} slog;
-	FILE *data_log, *stamp_log;
-
-	last_stamp = 0;
-	slog.offset = 0;
-	for (;;) {
-		if (!data_log)
-			data_log = fopen(data_log_name, "wb");
-		if (!data_log) {
-			LOGE("Failed to open data log at %s\n", data_log_name);
-			return -5;
-		}
-		if (!stamp_log)
-			stamp_log = fopen(stamp_log_name, "wb");
-		if (!stamp_log) {
-			LOGE("Failed to open stamp log at %s\n", stamp_log_name);
-			return -6;
+	static struct stamp_msg_t msgs[CAPTURE_MAX_IOV];
+	static struct iovec corrected_iov;
+	static int corrected_finished;
+	struct capture_buf_t *cbuf;
+	struct compress_buf_t *zbuf;
+	const char *corrected;
+
+	if (compression) {
+		zbuf = compress_next();
+		if (!zbuf)
+			return 0;
+		out->zbuf_iov.iov_base = zbuf->data;
+		out->zbuf_iov.iov_len = zbuf->len;
+		out->iov = &out->zbuf_iov;
+		out->nr_iov = 1;
+		out->len = zbuf->len;
+		out->raw_len = zbuf->raw_len;
+		out->stamp = zbuf->stamp;
+		out->read_end = zbuf->read_end;
+		out->msgs = zbuf->msgs;
+		out->nr_msgs = zbuf->nr_msgs;
+		out->msg_stamp = zbuf->msg_stamp;
+	} else if (correction) {
+		/*
+		 * The corrected frames are copied out of the batch, so the batch
+		 * is released here, and release_output() has nothing to do.
+		 */
+		cbuf = capture_next();
+		if (cbuf) {
+			out->stamp = cbuf->stamp;
+			out->read_end = cbuf->read_end;
+			out->len = correct_batch(cbuf, &corrected);
+			capture_release();
+		} else if (!corrected_finished) {
+			corrected_finished = 1;
+			out->stamp = -1;
+			out->read_end = -1;
+			out->len = correct_finish(&corrected);
+		} else {
+			return 0;
 		}
+		corrected_iov.iov_base = (void *) corrected;
+		corrected_iov.iov_len = out->len;
+		out->iov = &corrected_iov;
+		out->nr_iov = 1;
+		out->raw_len = out->len;
+		out->nr_msgs = 0;
+	} else {
+		cbuf = capture_next();
+		if (!cbuf)
+			return 0;
+		out->iov = cbuf->iov;
+		out->nr_iov = cbuf->nr_iov;
+		out->len = out->raw_len = cbuf->len;
+		out->stamp = cbuf->stamp;
+		out->read_end = cbuf->read_end;
+		if (message_stamps)
+			out->msg_stamp = capture_message_stamps(cbuf, msgs);
+		out->msgs = msgs;
+		out->nr_msgs = cbuf->nr_iov;
+	}
+	return 1;
+}
 
-		len = (*diag_interface->read)(diag_handle, &buf, &stamp);
-		if (len <= 0)
-			return -1;
+static void release_output(void)
+{
+	if (compression)
+		compress_release();
+	else if (!correction)
+		capture_release();
+}
 
-		wlen = fwrite(buf, 1, len, data_log);
-		if (wlen != len) {
-			LOGE("Failed to write to data log at %s\n", data_log_name);
-			return -2;
-		}
+static char stamp_buf[LZ4_MAX_BLOCK_SIZE];
+static size_t stamp_buf_len;
+
+/*
+ * Without compression, the stamps are flushed after every batch. Otherwise
+ * they are collected and compressed into one frame when the buffer is full
+ * or the segment is finished.
+ */
+static int flush_stamps(struct segment_t *segment)
+{
+	static char zbuf[LZ4_FRAME_BOUND(sizeof(stamp_buf))];
+	size_t len = stamp_buf_len;
+	ssize_t wlen;
+
+	if (!stamp_buf_len)
+		return 0;
+
+	stamp_buf_len = 0;
+	if (compression) {
+		len = lz4_compress_frame(stamp_buf, len, zbuf);
+		wlen = write(segment->stamp_fd, zbuf, len);
+	} else {
+		wlen = write(segment->stamp_fd, stamp_buf, len);
+	}
+	if (wlen != len) {
+		LOGE("Failed to write to stamp log %04u\n", segment->index);
+		return -3;
+	}
+	segment->stamp_len += wlen;
+	return 0;
+}
 
-		slog.offset += wlen;
-		if (stamp < 0)
-			continue;
-		slog.stamp = stamp;
+static int append_stamps(struct segment_t *segment, const void *buf, size_t len)
+{
+	int ret;
 
-		wlen = fwrite(&slog, sizeof(slog), 1, stamp_log);
-		if (wlen != 1) {
-			LOGE("Failed to write to stamp log at %s\n", stamp_log_name);
-			return -3;
+	if (stamp_buf_len + len > sizeof(stamp_buf)) {
+		ret = flush_stamps(segment);
+		if (ret < 0)
+			return ret;
+	}
+	memcpy(stamp_buf + stamp_buf_len, buf, len);
+	stamp_buf_len += len;
+	return 0;
+}
+
+static int write_stamps(struct segment_t *segment, const struct output_t *out)
+{
+	struct stamp_log_t slog;
+	struct stamp_batch_t sbatch;
+	int ret;
+
+	if (!message_stamps) {
+		slog.offset = segment->data_offset;
+		slog.stamp = out->stamp;
+		ret = append_stamps(segment, &slog, sizeof(slog));
+	} else {
+		if (segment->stamp_len == 0 && stamp_buf_len == 0) {
+			slog.offset = STAMP_LOG_MAGIC_OFFSET;
+			slog.stamp = STAMP_LOG_MAGIC_V2;
+			ret = append_stamps(segment, &slog, sizeof(slog));
+			if (ret < 0)
+				return ret;
 		}
+		sbatch.offset = segment->data_offset - out->raw_len;
+		sbatch.stamp = out->msg_stamp;
+		sbatch.nr_msgs = out->nr_msgs;
+		sbatch.reserved = 0;
+		ret = append_stamps(segment, &sbatch, sizeof(sbatch));
+		if (ret == 0)
+			ret = append_stamps(segment, out->msgs, out->nr_msgs * sizeof(struct stamp_msg_t));
+	}
+	if (ret == 0 && !compression)
+		ret = flush_stamps(segment);
+	return ret;
+}
 
-		if (stamp < last_stamp + 1000000000)
-			continue;
-		last_stamp = stamp;
-		fclose(data_log);
-		fclose(stamp_log);
-		data_log = NULL;
-		stamp_log = NULL;
-
-		if ((data_log_name[dlog_plen + 4]++, stamp_log_name[tlog_plen + 4]++) != '9')
-			continue;
-		data_log_name[dlog_plen + 4] = stamp_log_name[tlog_plen + 4] = '0';
-		if ((data_log_name[dlog_plen + 3]++, stamp_log_name[tlog_plen + 3]++) != '9')
-			continue;
-		data_log_name[dlog_plen + 3] = stamp_log_name[tlog_plen + 3] = '0';
-		if ((data_log_name[dlog_plen + 2]++, stamp_log_name[tlog_plen + 2]++) != '9')
-			continue;
-		data_log_name[dlog_plen + 2] = stamp_log_name[tlog_plen + 2] = '0';
-		if ((data_log_name[dlog_plen + 1]++, stamp_log_name[tlog_plen + 1]++) != '9')
-			continue;
-		data_log_name[dlog_plen + 1] = stamp_log_name[tlog_plen + 1] = '0';
-		LOGE("The number of the log files has overflowed\n");
+static int retrieve_logs(const char *data_log_prefix,
+			 const char *stamp_log_prefix,
+			 const struct segment_policy_t *policy)
+{
+	struct output_t out;
+	struct segment_t *segment;
+	ssize_t wlen;
+	long start;
+	int ret;
+
+	ret = segment_start(data_log_prefix, stamp_log_prefix, policy);
+	if (ret < 0)
+		return ret;
+	segment = segment_next(NULL);
+	if (!segment) {
+		segment_finish(NULL);
 		return -7;
 	}
+	if (capture_start(diag_interface, diag_handle, max_buf_size, max_nr_bufs) < 0 ||
+	    (compression && compress_start(max_buf_size) < 0)) {
+		segment_finish(segment);
+		return -8006;
+	}
+
+	while (next_output(&out)) {
+		if (segment_should_rotate(segment, out.len, out.stamp)) {
+			start = get_monotonic_raw_timestamp();
+			ret = flush_stamps(segment);
+			if (ret < 0)
+				break;
+			segment = segment_next(segment);
+			if (!segment) {
+				ret = -7;
+				break;
+			}
+			stats_rotation(get_monotonic_raw_timestamp() - start);
+		}
+
+		start = get_monotonic_raw_timestamp();
+		wlen = writev(segment->data_fd, out.iov, out.nr_iov);
+		if (wlen != out.len) {
+			LOGE("Failed to write to data log %04u\n", segment->index);
+			ret = -2;
+			break;
+		}
+		stats_write(wlen, out.read_end >= 0 ? (long) get_posix_timestamp() - out.read_end : -1,
+			    get_monotonic_raw_timestamp() - start);
+		segment->data_len += wlen;
+		segment->data_offset += out.raw_len;
+
+		// The corrected logs need no stamps, so the stamp logs are left empty
+		if (out.stamp >= 0) {
+			if (segment->start_stamp < 0)
+				segment->start_stamp = out.stamp;
+			ret = correction ? 0 : write_stamps(segment, &out);
+			if (ret < 0)
+				break;
+		}
+		release_output();
+	}
+
+	if (ret == 0 && segment)
+		ret = flush_stamps(segment);
+	segment_finish(segment);
+
+	/*
+	 * If the writer fails, the capture thread will be stopped, and the
+	 * remaining batches are discarded. Otherwise it has already stopped.
+	 */
+	capture_stop();
+	while (next_output(&out))
+		release_output();
+	if (compression)
+		compress_join();
+	if (capture_join() < 0 && ret == 0)
+		ret = -1;
+	filter_report();
+	correct_report();
+	return ret;
 }
 
+/*
+ * The first SIGINT stops the capture gracefully, so that all the buffered
+ * logs can be written. The second one exits immediately.
+ */
 static void on_sigint(int dummy)
 {
-	exit(0);
+	static volatile sig_atomic_t interrupted;
+
+	if (interrupted)
+		exit(0);
+	interrupted = 1;
+	capture_stop();
+}
+
+static void on_sigusr1(int dummy)
+{
+	stats_request();
+}
+
+static void on_sigusr2(int dummy)
+{
+	drain_request();
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [OPTIONS] [DIAG CFG] [DLOG PREFIX] [TLOG PREFIX]\n"
+	       "Options:\n"
+	       "  -s SIZE     switch to a new segment after SIZE MiB of data (default: unlimited)\n"
+	       "  -t SECONDS  switch to a new segment after SECONDS seconds (default: 1)\n"
+	       "  -n COUNT    keep at most COUNT segments, reusing the oldest ones (default: unlimited)\n"
+	       "  -z          compress data logs and stamp logs into LZ4 frames\n"
+	       "  -u SOCKET   stream batches to subscribers of the UNIX socket (@NAME for abstract)\n"
+	       "  -f FILTER   keep or drop log packets by the log codes listed in FILTER\n"
+	       "  -p          write interpolated per-message stamps instead of per-read ones\n"
+	       "  -c          correct the timestamps on the fly, leaving the stamp logs empty\n"
+	       "  -w WINDOW   send up to WINDOW config commands without waiting for responses\n"
+	       "              (default: 1, at most %d)\n"
+	       "  -P FILE     cache how /dev/diag is set up on this device in FILE\n"
+	       "  -b PERIPHERAL:MODE[:HIGH:LOW]\n"
+	       "              set the buffering mode (streaming, threshold or circular) and the\n"
+	       "              watermarks (in percent) of a peripheral, e.g. modem:threshold:80:20\n"
+	       "  -d MS       drain the buffering peripherals every MS milliseconds\n"
+	       "              (default: only on SIGUSR2)\n"
+	       "  -S FILE     write the capture stats to FILE periodically and on SIGUSR1\n"
+	       "              (default: print them on SIGUSR1 only)\n"
+	       "  -i SECONDS  write the stats every SECONDS seconds (default: 10)\n"
+	       "  -B KIB      grow the read buffers up to KIB KiB when the reads are saturated\n"
+	       "              (default: %d, at most %d)\n"
+	       "  -N COUNT    add read buffers up to COUNT when the writer falls behind\n"
+	       "              (default: %d, at most %d)\n"
+	       "  -R TRACE    record the raw reads from /dev/diag into TRACE\n"
+	       "  -r SOURCE   replay a read trace or DLOG,TLOG instead of reading from a device\n"
+	       "  -x SPEED    replay at SPEED times the original pace, 0 for as fast as possible\n"
+	       "              (default: 1)\n",
+	       name, COMMAND_MAX_WINDOW,
+	       CAPTURE_DEFAULT_MAX_BUF_SIZE >> 10, CAPTURE_MAX_BUF_SIZE >> 10,
+	       CAPTURE_DEFAULT_MAX_NR_BUFS, CAPTURE_MAX_NR_BUFS);
 }
 
 int main(int argc, char **argv)
 {
 	struct buffer_t cmd_buffer;
-	int i, ret;
+	struct segment_policy_t policy;
+	const char *stream_path = NULL, *stats_path = NULL, *replay_source = NULL;
+	const struct diag_interface_t **interfaces = diag_available_interfaces;
+	double replay_speed = 1;
+	unsigned long stats_interval = 10;
+	int i, ret, opt, window = 1, drain = 0;
+	unsigned long drain_interval = 0;
+
+	policy.max_size = 0;
+	policy.max_duration = 1000000000ull;
+	policy.max_count = 0;
+	while ((opt = getopt(argc, argv, "s:t:n:zu:f:pcw:P:b:d:S:i:B:N:R:r:x:")) != -1) {
+		switch (opt) {
+		case 's':
+			policy.max_size = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 't':
+			policy.max_duration = strtoull(optarg, NULL, 10) * 1000000000ull;
+			break;
+		case 'n':
+			policy.max_count = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			compression = 1;
+			break;
+		case 'u':
+			stream_path = optarg;
+			break;
+		case 'f':
+			if (filter_load(optarg) < 0)
+				return -8008;
+			break;
+		case 'p':
+			message_stamps = 1;
+			break;
+		case 'c':
+			correction = 1;
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			diag_char_set_profile_cache(optarg);
+			break;
+		case 'b':
+			if (diag_char_set_buffering(optarg) < 0)
+				return -8009;
+			drain = 1;
+			break;
+		case 'd':
+			drain_interval = strtoul(optarg, NULL, 10);
+			drain = 1;
+			break;
+		case 'S':
+			stats_path = optarg;
+			break;
+		case 'i':
+			stats_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			max_buf_size = strtoul(optarg, NULL, 10) << 10;
+			if (max_buf_size == 0 || max_buf_size > CAPTURE_MAX_BUF_SIZE)
+				max_buf_size = CAPTURE_MAX_BUF_SIZE;
+			break;
+		case 'N':
+			max_nr_bufs = strtoul(optarg, NULL, 10);
+			if (max_nr_bufs == 0 || max_nr_bufs > CAPTURE_MAX_NR_BUFS)
+				max_nr_bufs = CAPTURE_MAX_NR_BUFS;
+			break;
+		case 'R':
+			diag_char_set_trace(optarg);
+			break;
+		case 'r':
+			replay_source = optarg;
+			break;
+		case 'x':
+			replay_speed = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+			return -8000;
+		}
+	}
 
 	signal(SIGINT, &on_sigint);
-	if (argc != 4) {
-		printf("Usage: %s [DIAG CFG] [DLOG PREFIX] [TLOG PREFIX]\n", argv[0]);
+	if (argc - optind != 3) {
+		usage(argv[0]);
 		return -8000;
 	}
+	if (correction)
+		correct_enable(message_stamps);
 
 	// Read the config file
-	cmd_buffer = read_file(argv[1]);
+	cmd_buffer = read_file(argv[optind]);
 	if (cmd_buffer.buf == NULL || cmd_buffer.len == 0)
 		return -8003;
 
+	if (replay_source) {
+		diag_replay_set_source(replay_source, replay_speed);
+		// Nothing is lost by waiting for the writer, unlike with a device
+		if (replay_speed <= 0)
+			capture_set_lossless();
+		interfaces = diag_replay_interfaces;
+	}
 	i = 0;
-	while (diag_available_interfaces[i]) {
-		diag_interface = diag_available_interfaces[i];
+	while (interfaces[i]) {
+		diag_interface = interfaces[i];
 		diag_handle = (*diag_interface->open)();
 		if (diag_handle)
 			break;
@@ -230,10 +562,26 @@ int main(int argc, char **argv)
 	if (!diag_handle)
 		return -8004;
 
-	ret = write_commands(&cmd_buffer);
+	ret = write_commands(&cmd_buffer, window);
 	free(cmd_buffer.buf);
 	if (ret != 0)
 		return -8005;
 
-	return retrieve_logs(argv[2], argv[3]);
+	if (stream_path && stream_start(stream_path) < 0)
+		return -8007;
+
+	if (drain) {
+		if (drain_start(diag_interface, diag_handle, drain_interval) < 0)
+			return -8010;
+		signal(SIGUSR2, &on_sigusr2);
+	}
+
+	if (stats_start(stats_path, stats_interval) < 0)
+		return -8011;
+	signal(SIGUSR1, &on_sigusr1);
+
+	ret = retrieve_logs(argv[optind + 1], argv[optind + 2], &policy);
+	drain_stop();
+	stats_stop();
+	return ret;
 }
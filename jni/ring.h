@@ -0,0 +1,114 @@
+#pragma once
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/*
+ * A single-producer/single-consumer lock-free ring of slot indices.
+ *
+ * The ring only hands out indices; the slots themselves (e.g. an array of
+ * pre-allocated buffers) are owned by the user. The producer fills the slot
+ * returned by ring_produce_begin() and publishes it with ring_produce_end().
+ * The consumer does the same with ring_consume_begin() and ring_consume_end().
+ *
+ * head is only written by the producer and tail is only written by the
+ * consumer, so no locks are needed.
+ *
+ * The producer may use fewer slots at a time than the size, by setting a
+ * lower limit, and raise it later without moving anything.
+ */
+struct ring_t {
+	size_t size;
+	size_t limit;
+	_Atomic size_t head;
+	_Atomic size_t tail;
+
+	/* Statistics, written by the producer only */
+	_Atomic size_t high_water;
+	_Atomic size_t overflow;
+};
+
+/*
+ * Initialize the ring. The size must be a power of two.
+ */
+static inline void ring_init(struct ring_t *ring, size_t size)
+{
+	ring->size = size;
+	ring->limit = size;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->high_water, 0);
+	atomic_init(&ring->overflow, 0);
+}
+
+static inline size_t ring_used(struct ring_t *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	return head - tail;
+}
+
+/*
+ * Set the maximum number of slots in use, which is at most the size.
+ * Only the producer can call it.
+ */
+static inline void ring_set_limit(struct ring_t *ring, size_t limit)
+{
+	ring->limit = limit < ring->size ? limit : ring->size;
+}
+
+/*
+ * Get the number of slots consumed so far. The slots consumed are no longer
+ * accessed by the consumer.
+ */
+static inline size_t ring_consumed(struct ring_t *ring)
+{
+	return atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/*
+ * Get the slot to be filled next.
+ * If the ring is full, the overflow counter is increased and -1 is returned.
+ */
+static inline ssize_t ring_produce_begin(struct ring_t *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail >= ring->limit) {
+		atomic_fetch_add_explicit(&ring->overflow, 1, memory_order_relaxed);
+		return -1;
+	}
+	return head & (ring->size - 1);
+}
+
+static inline void ring_produce_end(struct ring_t *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	if (head + 1 - tail > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+		atomic_store_explicit(&ring->high_water, head + 1 - tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Get the slot to be consumed next.
+ * If the ring is empty, -1 is returned.
+ */
+static inline ssize_t ring_consume_begin(struct ring_t *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail)
+		return -1;
+	return tail & (ring->size - 1);
+}
+
+static inline void ring_consume_end(struct ring_t *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
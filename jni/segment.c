@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/falloc.h>
+#include "common.h"
+#include "segment.h"
+
+static char segment_data_prefix[FILENAME_MAX];
+static char segment_stamp_prefix[FILENAME_MAX];
+static struct segment_policy_t segment_policy;
+
+static pthread_t segment_thread;
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t segment_cond = PTHREAD_COND_INITIALIZER;
+
+/* Protected by segment_lock */
+static struct segment_t *segment_prepared;
+static struct segment_t *segment_activated;
+static struct segment_t *segment_retired;
+static unsigned int segment_next_index;
+static int segment_failed;
+static int segment_exiting;
+
+/* Only used by the background thread */
+static uint64_t segment_data_estimate;
+static uint64_t segment_stamp_estimate;
+
+/*
+ * The prepared segments have temporary names, so that when the segments are
+ * reused, the old segment is not lost until the new one is actually in use.
+ * -1 is returned if the names do not fit.
+ */
+static int segment_get_names(unsigned int index, int temporary,
+			     char *data_log_name, char *stamp_log_name)
+{
+	const char *suffix = temporary ? ".tmp" : "";
+
+	if (snprintf(data_log_name, FILENAME_MAX, "%s.%04u.dlog%s",
+		     segment_data_prefix, index, suffix) >= FILENAME_MAX ||
+	    snprintf(stamp_log_name, FILENAME_MAX, "%s.%04u.tlog%s",
+		     segment_stamp_prefix, index, suffix) >= FILENAME_MAX) {
+		LOGE("The log name of segment %u is too long\n", index);
+		return -1;
+	}
+	return 0;
+}
+
+static void segment_preallocate(int fd, uint64_t len, const char *name)
+{
+	static int warned;
+
+	if (len == 0 || warned)
+		return;
+	/*
+	 * Keep the file size unchanged, so that the file looks like a normal one
+	 * even if we are killed before the extra space is released.
+	 */
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len) < 0) {
+		LOGW("Failed to preallocate %s, giving up preallocation (%s)\n",
+		     name, strerror(errno));
+		warned = 1;
+	}
+}
+
+static struct segment_t *segment_open(unsigned int index)
+{
+	char data_log_name[FILENAME_MAX];
+	char stamp_log_name[FILENAME_MAX];
+	struct segment_t *segment;
+
+	segment = malloc(sizeof(struct segment_t));
+	if (!segment) {
+		LOGE("Cannot allocate memory for segment_t\n");
+		return NULL;
+	}
+	if (segment_get_names(index, 1, data_log_name, stamp_log_name) < 0)
+		goto fail;
+
+	segment->data_fd = open(data_log_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (segment->data_fd < 0) {
+		LOGE("Failed to open data log at %s (%s)\n", data_log_name, strerror(errno));
+		goto fail;
+	}
+	segment->stamp_fd = open(stamp_log_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (segment->stamp_fd < 0) {
+		LOGE("Failed to open stamp log at %s (%s)\n", stamp_log_name, strerror(errno));
+		close(segment->data_fd);
+		goto fail;
+	}
+
+	segment_preallocate(segment->data_fd, segment_policy.max_size ?
+			    segment_policy.max_size : segment_data_estimate, data_log_name);
+	segment_preallocate(segment->stamp_fd, segment_stamp_estimate, stamp_log_name);
+
+	segment->index = index;
+	segment->data_len = 0;
+	segment->data_offset = 0;
+	segment->stamp_len = 0;
+	segment->start_stamp = -1;
+	segment->temporary = 1;
+	return segment;
+fail:
+	free(segment);
+	return NULL;
+}
+
+static void segment_activate(struct segment_t *segment)
+{
+	char data_log_name[FILENAME_MAX], data_tmp_name[FILENAME_MAX];
+	char stamp_log_name[FILENAME_MAX], stamp_tmp_name[FILENAME_MAX];
+
+	segment->temporary = 0;
+	// The names fitted when the segment was opened, so they always do
+	if (segment_get_names(segment->index, 1, data_tmp_name, stamp_tmp_name) < 0 ||
+	    segment_get_names(segment->index, 0, data_log_name, stamp_log_name) < 0)
+		return;
+	if (rename(data_tmp_name, data_log_name) < 0)
+		LOGW("Failed to rename %s (%s)\n", data_tmp_name, strerror(errno));
+	if (rename(stamp_tmp_name, stamp_log_name) < 0)
+		LOGW("Failed to rename %s (%s)\n", stamp_tmp_name, strerror(errno));
+}
+
+/*
+ * Release the preallocated but unused space and close the files.
+ * Segments that have never been used are removed.
+ */
+static void segment_close(struct segment_t *segment)
+{
+	char data_log_name[FILENAME_MAX];
+	char stamp_log_name[FILENAME_MAX];
+
+	if (!segment->temporary) {
+		(void) ftruncate(segment->data_fd, segment->data_len);
+		(void) ftruncate(segment->stamp_fd, segment->stamp_len);
+		segment_data_estimate = segment->data_len;
+		segment_stamp_estimate = segment->stamp_len;
+	} else if (segment_get_names(segment->index, 1, data_log_name, stamp_log_name) == 0) {
+		unlink(data_log_name);
+		unlink(stamp_log_name);
+	}
+
+	close(segment->data_fd);
+	close(segment->stamp_fd);
+	free(segment);
+}
+
+static void *segment_main(void *arg)
+{
+	struct segment_t *segment;
+	unsigned int index;
+
+	pthread_mutex_lock(&segment_lock);
+	for (;;) {
+		if (segment_activated) {
+			segment = segment_activated;
+			segment_activated = NULL;
+			pthread_mutex_unlock(&segment_lock);
+			segment_activate(segment);
+			pthread_mutex_lock(&segment_lock);
+			pthread_cond_broadcast(&segment_cond);
+			continue;
+		}
+		if (segment_retired) {
+			segment = segment_retired;
+			segment_retired = NULL;
+			pthread_mutex_unlock(&segment_lock);
+			segment_close(segment);
+			pthread_mutex_lock(&segment_lock);
+			pthread_cond_broadcast(&segment_cond);
+			continue;
+		}
+		if (segment_exiting)
+			break;
+		if (segment_prepared || segment_failed) {
+			pthread_cond_wait(&segment_cond, &segment_lock);
+			continue;
+		}
+
+		index = segment_next_index;
+		if (index >= SEGMENT_MAX_COUNT) {
+			LOGE("The number of the log files has overflowed\n");
+			segment = NULL;
+		} else {
+			pthread_mutex_unlock(&segment_lock);
+			segment = segment_open(index);
+			pthread_mutex_lock(&segment_lock);
+		}
+
+		if (segment) {
+			segment_prepared = segment;
+			segment_next_index = index + 1;
+			if (segment_policy.max_count && segment_next_index >= segment_policy.max_count)
+				segment_next_index = 0;
+		} else {
+			segment_failed = 1;
+		}
+		pthread_cond_broadcast(&segment_cond);
+	}
+
+	segment = segment_prepared;
+	segment_prepared = NULL;
+	pthread_mutex_unlock(&segment_lock);
+
+	if (segment)
+		segment_close(segment);
+	return NULL;
+}
+
+int segment_start(const char *data_log_prefix, const char *stamp_log_prefix,
+		  const struct segment_policy_t *policy)
+{
+	int ret;
+
+	if (strlen(data_log_prefix) > FILENAME_MAX - 15) {
+		LOGE("Invalid argument: data log prefix is too long\n");
+		return -4;
+	}
+	if (strlen(stamp_log_prefix) > FILENAME_MAX - 15) {
+		LOGE("Invalid argument: stamp log prefix is too long\n");
+		return -5;
+	}
+	if (policy->max_count > SEGMENT_MAX_COUNT) {
+		LOGE("Invalid argument: at most %d segments are supported\n", SEGMENT_MAX_COUNT);
+		return -7;
+	}
+
+	strcpy(segment_data_prefix, data_log_prefix);
+	strcpy(segment_stamp_prefix, stamp_log_prefix);
+	segment_policy = *policy;
+
+	ret = pthread_create(&segment_thread, NULL, &segment_main, NULL);
+	if (ret != 0) {
+		LOGE("Failed to create the segment thread (%s)\n", strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+int segment_should_rotate(const struct segment_t *segment, uint64_t len, long stamp)
+{
+	if (segment->data_len == 0)
+		return 0;
+	if (segment_policy.max_size &&
+	    segment->data_len + len > segment_policy.max_size)
+		return 1;
+	if (segment_policy.max_duration && segment->start_stamp >= 0 &&
+	    stamp - segment->start_stamp >= (long) segment_policy.max_duration)
+		return 1;
+	return 0;
+}
+
+struct segment_t *segment_next(struct segment_t *segment)
+{
+	struct segment_t *next;
+
+	pthread_mutex_lock(&segment_lock);
+	/*
+	 * The background thread finishes the retired segment before preparing
+	 * another one, so there is at most one retired segment at any time.
+	 */
+	while (segment_retired || segment_activated)
+		pthread_cond_wait(&segment_cond, &segment_lock);
+	segment_retired = segment;
+	while (!segment_prepared && !segment_failed)
+		pthread_cond_wait(&segment_cond, &segment_lock);
+	next = segment_prepared;
+	segment_prepared = NULL;
+	segment_activated = next;
+	pthread_cond_broadcast(&segment_cond);
+	pthread_mutex_unlock(&segment_lock);
+
+	return next;
+}
+
+void segment_finish(struct segment_t *segment)
+{
+	pthread_mutex_lock(&segment_lock);
+	while (segment_retired || segment_activated)
+		pthread_cond_wait(&segment_cond, &segment_lock);
+	segment_retired = segment;
+	segment_exiting = 1;
+	pthread_cond_broadcast(&segment_cond);
+	pthread_mutex_unlock(&segment_lock);
+
+	pthread_join(segment_thread, NULL);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+
+#define SEGMENT_MAX_COUNT 10000
+
+/*
+ * When to switch to the next pair of log files.
+ * Zero means unlimited. If max_count is not zero, the segment files are
+ * reused in a ring, i.e. the oldest one will be overwritten.
+ */
+struct segment_policy_t {
+	uint64_t max_size;
+	uint64_t max_duration;
+	unsigned int max_count;
+};
+
+/*
+ * data_len and stamp_len are the lengths of the files, while data_offset is
+ * the length of the data log before compression, which is what the offsets
+ * in the stamp log refer to.
+ */
+struct segment_t {
+	unsigned int index;
+	int data_fd;
+	int stamp_fd;
+	uint64_t data_len;
+	uint64_t data_offset;
+	uint64_t stamp_len;
+	long start_stamp;
+	int temporary;
+};
+
+/*
+ * Start the background thread, which opens and preallocates the next segment
+ * before it is needed, and finishes the retired ones.
+ */
+int segment_start(const char *data_log_prefix, const char *stamp_log_prefix,
+		  const struct segment_policy_t *policy);
+
+/*
+ * Whether the batch should go to a new segment according to the policy.
+ */
+int segment_should_rotate(const struct segment_t *segment, uint64_t len, long stamp);
+
+/*
+ * Retire the current segment (if any) and get the prepared one.
+ * NULL will be returned if the next segment cannot be opened.
+ */
+struct segment_t *segment_next(struct segment_t *segment);
+
+/*
+ * Retire the current segment (if any) and stop the background thread.
+ */
+void segment_finish(struct segment_t *segment);
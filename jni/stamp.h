@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * By default, the stamp log has one record per batch: the offset of the
+ * data log after the batch, and the time when the batch was read.
+ */
+struct stamp_log_t {
+	uint64_t offset;
+	uint64_t stamp;
+};
+
+/*
+ * With per-message stamps, the stamp log starts with a header record
+ * (STAMP_LOG_MAGIC_OFFSET, STAMP_LOG_MAGIC_V2). Then every batch has one
+ * stamp_batch_t followed by nr_msgs stamp_msg_t. offset is the offset of
+ * the data log before the batch, and the stamp of each message is the
+ * stamp of the batch plus its delta in nanoseconds.
+ */
+#define STAMP_LOG_MAGIC_OFFSET	UINT64_MAX
+#define STAMP_LOG_MAGIC_V2	0x3256534d54474f4cull
+
+struct stamp_batch_t {
+	uint64_t offset;
+	uint64_t stamp;
+	uint32_t nr_msgs;
+	uint32_t reserved;
+};
+
+struct stamp_msg_t {
+	uint32_t len;
+	uint32_t delta;
+};
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "common.h"
+#include "stats.h"
+
+/*
+ * Power-of-two buckets, i.e. bucket i counts the values in [2^(i-1), 2^i),
+ * except the last one, which counts all the values from 2^(i-1) up.
+ */
+#define STATS_HIST_SIZE 40
+
+struct stats_hist_t {
+	_Atomic uint64_t count[STATS_HIST_SIZE];
+};
+
+struct stats_max_t {
+	_Atomic uint64_t total;
+	_Atomic uint64_t count;
+	_Atomic uint64_t max;
+};
+
+static _Atomic uint64_t stats_bytes;
+static _Atomic uint64_t stats_msgs;
+static _Atomic uint64_t stats_reads;
+static _Atomic uint64_t stats_saturated_reads;
+static _Atomic uint64_t stats_gaps;
+static _Atomic uint64_t stats_buffer_size;
+static _Atomic uint64_t stats_nr_buffers;
+static _Atomic uint64_t stats_dropped;
+static _Atomic uint64_t stats_written;
+static struct stats_hist_t stats_read_sizes;
+static struct stats_hist_t stats_latencies;
+static struct stats_max_t stats_queue_depth;
+static struct stats_max_t stats_write_time;
+static struct stats_max_t stats_rotation_time;
+
+static const char *stats_path;
+static unsigned long stats_interval;
+static uint64_t stats_last_time, stats_last_bytes, stats_last_msgs;
+static pthread_t stats_thread;
+static sem_t stats_sem;
+static volatile sig_atomic_t stats_started;
+static volatile sig_atomic_t stats_stopping;
+
+// Only one thread updates a counter, so there is no need for atomic RMW
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t value)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+			      memory_order_relaxed);
+}
+
+static inline uint64_t stats_get(_Atomic uint64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void stats_hist_add(struct stats_hist_t *hist, uint64_t value)
+{
+	int i = value ? 64 - __builtin_clzll(value) : 0;
+
+	stats_add(&hist->count[i < STATS_HIST_SIZE ? i : STATS_HIST_SIZE - 1], 1);
+}
+
+static void stats_max_add(struct stats_max_t *m, uint64_t value)
+{
+	stats_add(&m->total, value);
+	stats_add(&m->count, 1);
+	if (value > stats_get(&m->max))
+		atomic_store_explicit(&m->max, value, memory_order_relaxed);
+}
+
+void stats_read(size_t raw_len, int saturated, int nr_msgs)
+{
+	stats_add(&stats_bytes, raw_len);
+	stats_add(&stats_msgs, nr_msgs);
+	stats_add(&stats_reads, 1);
+	// The kernel had more than one buffer of logs, which is a sign of overflow
+	if (saturated)
+		stats_add(&stats_saturated_reads, 1);
+	stats_hist_add(&stats_read_sizes, raw_len);
+}
+
+void stats_gap(int nr_gaps)
+{
+	stats_add(&stats_gaps, nr_gaps);
+}
+
+void stats_buffers(size_t size, unsigned int nr_bufs)
+{
+	atomic_store_explicit(&stats_buffer_size, size, memory_order_relaxed);
+	atomic_store_explicit(&stats_nr_buffers, nr_bufs, memory_order_relaxed);
+}
+
+void stats_drop(void)
+{
+	stats_add(&stats_dropped, 1);
+}
+
+void stats_queue(size_t depth)
+{
+	stats_max_add(&stats_queue_depth, depth);
+}
+
+void stats_write(size_t len, long latency, long duration)
+{
+	stats_add(&stats_written, len);
+	if (latency >= 0)
+		stats_hist_add(&stats_latencies, latency / 1000);
+	stats_max_add(&stats_write_time, duration);
+}
+
+void stats_rotation(long duration)
+{
+	stats_max_add(&stats_rotation_time, duration);
+}
+
+static void stats_print_hist(FILE *fp, const char *name, struct stats_hist_t *hist)
+{
+	uint64_t count;
+	int i;
+
+	for (i = 0; i < STATS_HIST_SIZE - 1; ++i) {
+		count = stats_get(&hist->count[i]);
+		if (count)
+			fprintf(fp, "%s_lt_%llu %llu\n", name, 1ull << i, (unsigned long long) count);
+	}
+	count = stats_get(&hist->count[i]);
+	if (count)
+		fprintf(fp, "%s_ge_%llu %llu\n", name, 1ull << (i - 1), (unsigned long long) count);
+}
+
+static void stats_print_max(FILE *fp, const char *name, struct stats_max_t *m, uint64_t scale)
+{
+	uint64_t count = stats_get(&m->count);
+
+	fprintf(fp, "%s_count %llu\n", name, (unsigned long long) count);
+	fprintf(fp, "%s_avg %llu\n", name,
+		(unsigned long long) (count ? stats_get(&m->total) / count / scale : 0));
+	fprintf(fp, "%s_max %llu\n", name, (unsigned long long) (stats_get(&m->max) / scale));
+}
+
+/*
+ * The rates are computed over the time since the previous export, while
+ * everything else is since the start. Only the stats thread calls it, or
+ * the main thread after the stats thread exits.
+ */
+static void stats_print(FILE *fp)
+{
+	uint64_t now = get_monotonic_raw_timestamp();
+	uint64_t bytes = stats_get(&stats_bytes), msgs = stats_get(&stats_msgs);
+	double elapsed = (now - stats_last_time) / 1e9;
+
+	fprintf(fp, "bytes %llu\n", (unsigned long long) bytes);
+	fprintf(fp, "messages %llu\n", (unsigned long long) msgs);
+	fprintf(fp, "bytes_per_sec %.0f\n", elapsed > 0 ? (bytes - stats_last_bytes) / elapsed : 0);
+	fprintf(fp, "messages_per_sec %.0f\n", elapsed > 0 ? (msgs - stats_last_msgs) / elapsed : 0);
+	fprintf(fp, "reads %llu\n", (unsigned long long) stats_get(&stats_reads));
+	fprintf(fp, "saturated_reads %llu\n", (unsigned long long) stats_get(&stats_saturated_reads));
+	fprintf(fp, "gaps %llu\n", (unsigned long long) stats_get(&stats_gaps));
+	fprintf(fp, "read_buffer_size %llu\n", (unsigned long long) stats_get(&stats_buffer_size));
+	fprintf(fp, "read_buffers %llu\n", (unsigned long long) stats_get(&stats_nr_buffers));
+	fprintf(fp, "dropped_batches %llu\n", (unsigned long long) stats_get(&stats_dropped));
+	fprintf(fp, "written_bytes %llu\n", (unsigned long long) stats_get(&stats_written));
+	stats_print_hist(fp, "read_size", &stats_read_sizes);
+	stats_print_hist(fp, "latency_us", &stats_latencies);
+	stats_print_max(fp, "queue_depth", &stats_queue_depth, 1);
+	stats_print_max(fp, "write_time_us", &stats_write_time, 1000);
+	stats_print_max(fp, "rotation_time_us", &stats_rotation_time, 1000);
+
+	stats_last_time = now;
+	stats_last_bytes = bytes;
+	stats_last_msgs = msgs;
+}
+
+static void stats_export(void)
+{
+	char tmp_path[FILENAME_MAX];
+	FILE *fp;
+
+	if (!stats_path) {
+		LOGI("Stats:\n");
+		stats_print(stdout);
+		fflush(stdout);
+		return;
+	}
+
+	// Replace the file at once, so that readers never see a partial one
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_path);
+	fp = fopen(tmp_path, "w");
+	if (!fp) {
+		LOGW("Failed to write stats to %s (%s)\n", tmp_path, strerror(errno));
+		return;
+	}
+	stats_print(fp);
+	if (fclose(fp) != 0 || rename(tmp_path, stats_path) < 0)
+		LOGW("Failed to write stats to %s (%s)\n", stats_path, strerror(errno));
+}
+
+static int stats_wait(void)
+{
+	if (!stats_interval || !stats_path)
+		return sem_wait(&stats_sem);
+	return sem_wait_monotonic(&stats_sem, stats_interval * 1000);
+}
+
+static void *stats_main(void *arg)
+{
+	for (;;) {
+		if (stats_wait() < 0 && errno != ETIMEDOUT)
+			continue;
+		if (stats_stopping)
+			break;
+		stats_export();
+	}
+	return NULL;
+}
+
+int stats_start(const char *path, unsigned long interval)
+{
+	int ret;
+
+	stats_path = path;
+	stats_interval = interval;
+	stats_last_time = get_monotonic_raw_timestamp();
+	sem_init(&stats_sem, 0, 0);
+
+	ret = pthread_create(&stats_thread, NULL, &stats_main, NULL);
+	if (ret != 0) {
+		LOGE("Failed to create the stats thread (%s)\n", strerror(ret));
+		return -1;
+	}
+	stats_started = 1;
+	return 0;
+}
+
+void stats_request(void)
+{
+	if (stats_started)
+		sem_post(&stats_sem);
+}
+
+void stats_stop(void)
+{
+	if (!stats_started)
+		return;
+	stats_stopping = 1;
+	sem_post(&stats_sem);
+	pthread_join(stats_thread, NULL);
+	stats_started = 0;
+	// The final stats
+	if (stats_path)
+		stats_export();
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * Counters of the capture path, to tell whether the logs are lost in the
+ * kernel (saturated reads and gaps), in our reader (dropped batches) or in the storage
+ * (latency from read to write and slow rotations).
+ *
+ * Each counter is updated by one thread only, so they are cheap to update.
+ */
+
+// Called by the capture thread
+void stats_read(size_t raw_len, int saturated, int nr_msgs);
+void stats_gap(int nr_gaps);
+void stats_buffers(size_t size, unsigned int nr_bufs);
+void stats_drop(void);
+
+// Called by the writer
+void stats_queue(size_t depth);
+void stats_write(size_t len, long latency, long duration);
+void stats_rotation(long duration);
+
+/*
+ * Start the stats thread, which writes the stats to the file every interval
+ * seconds, and whenever requested. Without a file, the stats are printed
+ * when requested.
+ */
+int stats_start(const char *path, unsigned long interval);
+
+/*
+ * Request an export now. It is safe to call it from a signal handler.
+ */
+void stats_request(void);
+
+void stats_stop(void);
@@ -0,0 +1,278 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "common.h"
+#include "stream.h"
+
+/*
+ * Each subscriber has a bounded byte queue. The publisher appends to it at
+ * head, and the stream thread sends from it at tail.
+ */
+struct stream_subscriber_t {
+	int fd;
+	int dropped;
+	size_t head;
+	size_t tail;
+	char *queue;
+};
+
+static int stream_listen_fd = -1;
+static int stream_wake_fds[2];
+static pthread_t stream_thread;
+
+/* Protected by stream_lock */
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream_subscriber_t stream_subscribers[STREAM_MAX_SUBSCRIBERS];
+static int stream_nr_subscribers;
+static int stream_wake_pending;
+
+static void stream_enqueue(struct stream_subscriber_t *sub, const void *buf, size_t len)
+{
+	size_t pos = sub->head % STREAM_QUEUE_SIZE;
+	size_t first = STREAM_QUEUE_SIZE - pos;
+
+	if (first > len)
+		first = len;
+	memcpy(sub->queue + pos, buf, first);
+	memcpy(sub->queue, (const char *) buf + first, len - first);
+	sub->head += len;
+}
+
+void stream_publish(const struct iovec *iov, int nr_iov, size_t len, long stamp)
+{
+	struct stream_header_t header;
+	struct stream_subscriber_t *sub;
+	char wake = 0;
+	int i, j;
+
+	if (stream_listen_fd < 0)
+		return;
+
+	header.len = len;
+	header.reserved = 0;
+	header.stamp = stamp;
+
+	pthread_mutex_lock(&stream_lock);
+	for (i = 0; i < stream_nr_subscribers; ++i) {
+		sub = &stream_subscribers[i];
+		if (sub->dropped)
+			continue;
+		if (STREAM_QUEUE_SIZE - (sub->head - sub->tail) < sizeof(header) + len) {
+			LOGW("Stream subscriber %d is too slow, disconnecting it\n", sub->fd);
+			sub->dropped = 1;
+			continue;
+		}
+		stream_enqueue(sub, &header, sizeof(header));
+		for (j = 0; j < nr_iov; ++j)
+			stream_enqueue(sub, iov[j].iov_base, iov[j].iov_len);
+	}
+	if (stream_nr_subscribers && !stream_wake_pending) {
+		stream_wake_pending = 1;
+		(void) !write(stream_wake_fds[1], &wake, 1);
+	}
+	pthread_mutex_unlock(&stream_lock);
+}
+
+static void stream_accept(void)
+{
+	struct stream_subscriber_t *sub;
+	int fd;
+
+	fd = accept(stream_listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	pthread_mutex_lock(&stream_lock);
+	if (stream_nr_subscribers >= STREAM_MAX_SUBSCRIBERS) {
+		pthread_mutex_unlock(&stream_lock);
+		LOGW("Too many stream subscribers, rejecting a new one\n");
+		close(fd);
+		return;
+	}
+	sub = &stream_subscribers[stream_nr_subscribers];
+	sub->queue = malloc(STREAM_QUEUE_SIZE);
+	if (!sub->queue) {
+		pthread_mutex_unlock(&stream_lock);
+		LOGE("Cannot allocate memory for the stream queue\n");
+		close(fd);
+		return;
+	}
+	sub->fd = fd;
+	sub->dropped = 0;
+	sub->head = sub->tail = 0;
+	++stream_nr_subscribers;
+	pthread_mutex_unlock(&stream_lock);
+
+	LOGI("Stream subscriber %d connected\n", fd);
+}
+
+/*
+ * Send the queued data of one subscriber until the socket is full.
+ * The queue is only read here, while the publisher only writes the free
+ * space, so the lock is not held during send().
+ */
+static void stream_flush(struct stream_subscriber_t *sub)
+{
+	size_t pos, len;
+	ssize_t ret;
+
+	for (;;) {
+		pthread_mutex_lock(&stream_lock);
+		pos = sub->tail % STREAM_QUEUE_SIZE;
+		len = sub->head - sub->tail;
+		pthread_mutex_unlock(&stream_lock);
+		if (len == 0)
+			return;
+		if (len > STREAM_QUEUE_SIZE - pos)
+			len = STREAM_QUEUE_SIZE - pos;
+
+		ret = send(sub->fd, sub->queue + pos, len, MSG_NOSIGNAL);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (ret <= 0) {
+			pthread_mutex_lock(&stream_lock);
+			sub->dropped = 1;
+			pthread_mutex_unlock(&stream_lock);
+			return;
+		}
+
+		pthread_mutex_lock(&stream_lock);
+		sub->tail += ret;
+		pthread_mutex_unlock(&stream_lock);
+	}
+}
+
+/*
+ * Remove the dropped subscribers. Only the stream thread changes the list.
+ */
+static void stream_cleanup(void)
+{
+	struct stream_subscriber_t *sub;
+	int i;
+
+	pthread_mutex_lock(&stream_lock);
+	for (i = 0; i < stream_nr_subscribers; ) {
+		sub = &stream_subscribers[i];
+		if (!sub->dropped) {
+			++i;
+			continue;
+		}
+		LOGI("Stream subscriber %d disconnected\n", sub->fd);
+		close(sub->fd);
+		free(sub->queue);
+		*sub = stream_subscribers[--stream_nr_subscribers];
+	}
+	pthread_mutex_unlock(&stream_lock);
+}
+
+static void *stream_main(void *arg)
+{
+	struct pollfd fds[STREAM_MAX_SUBSCRIBERS + 2];
+	char buf[64];
+	int i, nr;
+
+	for (;;) {
+		fds[0].fd = stream_listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = stream_wake_fds[0];
+		fds[1].events = POLLIN;
+
+		pthread_mutex_lock(&stream_lock);
+		nr = stream_nr_subscribers;
+		for (i = 0; i < nr; ++i) {
+			fds[i + 2].fd = stream_subscribers[i].fd;
+			fds[i + 2].events = POLLIN;
+			if (stream_subscribers[i].head != stream_subscribers[i].tail)
+				fds[i + 2].events |= POLLOUT;
+		}
+		pthread_mutex_unlock(&stream_lock);
+
+		if (poll(fds, nr + 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGE("Failed to poll stream sockets (%s)\n", strerror(errno));
+			return NULL;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			pthread_mutex_lock(&stream_lock);
+			stream_wake_pending = 0;
+			(void) !read(stream_wake_fds[0], buf, sizeof(buf));
+			pthread_mutex_unlock(&stream_lock);
+		}
+		for (i = 0; i < nr; ++i) {
+			// Subscribers are not supposed to send anything, so it means EOF or errors
+			if (fds[i + 2].revents & (POLLIN | POLLERR | POLLHUP)) {
+				pthread_mutex_lock(&stream_lock);
+				stream_subscribers[i].dropped = 1;
+				pthread_mutex_unlock(&stream_lock);
+				continue;
+			}
+			stream_flush(&stream_subscribers[i]);
+		}
+		stream_cleanup();
+		if (fds[0].revents & POLLIN)
+			stream_accept();
+	}
+}
+
+int stream_start(const char *path)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	size_t path_len = strlen(path);
+	int ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path_len >= sizeof(addr.sun_path)) {
+		LOGE("Invalid argument: stream socket path is too long\n");
+		return -1;
+	}
+	memcpy(addr.sun_path, path, path_len);
+	addr_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+	else
+		unlink(path);
+
+	stream_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (stream_listen_fd < 0) {
+		LOGE("Failed to create the stream socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	fcntl(stream_listen_fd, F_SETFL, fcntl(stream_listen_fd, F_GETFL) | O_NONBLOCK);
+	if (bind(stream_listen_fd, (struct sockaddr *) &addr, addr_len) < 0 ||
+	    listen(stream_listen_fd, STREAM_MAX_SUBSCRIBERS) < 0) {
+		LOGE("Failed to listen on the stream socket %s (%s)\n", path, strerror(errno));
+		goto fail;
+	}
+
+	if (pipe(stream_wake_fds) < 0) {
+		LOGE("Failed to create the stream wakeup pipe (%s)\n", strerror(errno));
+		goto fail;
+	}
+	fcntl(stream_wake_fds[1], F_SETFL, fcntl(stream_wake_fds[1], F_GETFL) | O_NONBLOCK);
+
+	ret = pthread_create(&stream_thread, NULL, &stream_main, NULL);
+	if (ret != 0) {
+		LOGE("Failed to create the stream thread (%s)\n", strerror(ret));
+		close(stream_wake_fds[0]);
+		close(stream_wake_fds[1]);
+		goto fail;
+	}
+	pthread_detach(stream_thread);
+	return 0;
+fail:
+	close(stream_listen_fd);
+	stream_listen_fd = -1;
+	return -1;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define STREAM_MAX_SUBSCRIBERS 8
+#define STREAM_QUEUE_SIZE (4 << 20)
+
+/*
+ * Every batch is sent to the subscribers as the header followed by len bytes
+ * of messages, in the native byte order.
+ */
+struct stream_header_t {
+	uint32_t len;
+	uint32_t reserved;
+	uint64_t stamp;
+};
+
+/*
+ * Listen on the UNIX socket at path (or in the abstract namespace if path
+ * starts with '@'), and start the thread sending batches to subscribers.
+ */
+int stream_start(const char *path);
+
+/*
+ * Queue the batch for every subscriber. It never blocks: a subscriber whose
+ * queue cannot hold the batch is too slow, and it will be disconnected.
+ */
+void stream_publish(const struct iovec *iov, int nr_iov, size_t len, long stamp);